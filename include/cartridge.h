@@ -18,16 +18,31 @@ class Cartridge
 public:
     Cartridge(std::string rom);
 
-    uint8_t ReadROM(uint16_t address) const;
-    void SwitchBank(uint8_t bank);
+    // Inline so the CPU's instruction fetches compile down to an array access
+    uint8_t ReadROM(uint16_t address, uint8_t bank) const
+    {
+        if (address < 0x4000)
+        {
+            return romData[address];
+        }
+        else if (address < 0x8000)
+        {
+            uint32_t bankOffset = bank * 0x4000;
+            return romData[bankOffset + (address - 0x4000)];
+        }
+        return 0xFF;
+    }
+    uint8_t SelectBank(uint8_t value, uint8_t currentBank) const;
     void WriteRAM(uint16_t address, uint8_t value);
     std::string GetTitle() const { return rom_title; }
+    size_t GetBankCount() const { return romData.size() / 0x4000; }
+    // Header byte 0x143: 0x80 also runs on DMG, 0xC0 is CGB only
+    bool IsColor() const { return romData[0x143] == 0x80 || romData[0x143] == 0xC0; }
 
 private:
     std::vector<uint8_t>
         romData;
     MBCType mbcType;
-    uint8_t currentBank;
 
     std::string rom_title;
 
@@ -0,0 +1,7 @@
+#pragma once
+#include <cstdint>
+
+// CGB palette entries are 15-bit BGR. Every Status::colorMode preset gets a
+// 32768-entry table from them to ARGB pixels; all are built on the first
+// call, so a palette write costs one lookup and a pixel none.
+const uint32_t *ColorTable(int colorMode);
@@ -0,0 +1,31 @@
+#pragma once
+
+// Accuracy profiles CPU, MMU and PPU are compiled for. Both are built into
+// every binary and one is picked when a machine is created, so the checks
+// below fold away instead of costing a branch per memory access.
+enum class CoreType
+{
+    FAST,
+    ACCURATE
+};
+
+// Whole-instruction timing: every access sees the PPU as it was when the
+// instruction started, mode 3 always takes the same time and lines are
+// drawn from the registers as they are at its end
+struct FastCore
+{
+    static const CoreType TYPE = CoreType::FAST;
+    static const bool TIMED_ACCESSES = false;
+    static const bool PIXEL_FIFO = false;
+};
+
+// Each memory access takes its own M-cycle and brings the PPU up to date
+// before it happens; mode 3 runs a pixel FIFO dot by dot, so it lasts as
+// long as fine scroll, sprites and the window make it, HBlank is shortened
+// to match, and register writes during the line show from the next pixel
+struct AccurateCore
+{
+    static const CoreType TYPE = CoreType::ACCURATE;
+    static const bool TIMED_ACCESSES = true;
+    static const bool PIXEL_FIFO = true;
+};
@@ -1,31 +1,52 @@
 #include <SDL3/SDL_timer.h>
 #include "registers.h"
+#include "core.h"
+#include "machinestate.h"
+#include "interrupts.h"
+#include "loops.h"
 #include "mmu.h"
+#include "debugger.h"
+#ifdef SIGMABOY_PROFILER
+#include "profiler.h"
+#endif
 
-class CPU
+// Registers, host hooks and the ALU, which never touch memory
+class CPUBase
 {
 public:
-    CPU(MMU *memory, Registers *registers);
+    CPUBase(MachineState *state, InterruptController *interrupts);
 
-    MMU *memory;
+    MachineState *state;
+    InterruptController *interrupts;
     Registers *registers;
 
-    bool enableInterruptsNextInstruction = false;
+    // Set by the debugger while breakpoints exist or tracing is on
+    Debugger *debugger = nullptr;
 
-    bool ime = false;
+    // (bank, PC) edge hit counts for the fuzzer, null unless fuzzing
+    uint8_t *coverage = nullptr;
+    uint32_t previousLocation = 0;
+    uint64_t coveragePath = 0;
 
-    uint8_t cycles = 0;
-    bool isStopped = false;
-    bool isHalted = false;
+    // Recognised copy and fill loops run in bulk, see CPU::RunLoop
+    bool bulkLoops = true;
 
-    int Execute(uint8_t opcode);
-    int ExecuteCB(uint8_t opcode);
-    void CheckInterrupts();
-    int Step();
+    // Counts the edges of `iterations` passes through the loop from start to
+    // the JR at jump, as if each had been stepped
+    void CoverLoop(uint16_t start, uint16_t jump, uint32_t iterations);
+    uint32_t CoverageLocation(uint16_t pc) const;
+
+    // Second byte of the last CB-prefixed instruction
+    uint8_t lastOpcodeCB = 0;
+
+#ifdef SIGMABOY_PROFILER
+    Profiler *profiler = nullptr;
+#endif
 
     // CPU Instructions
     void Add(uint8_t value);
     void AddHL(uint16_t value);
+    void AddSPFlags(int8_t offset);
     void Adc(uint8_t value);
     void Sub(uint8_t value);
     void Sbc(uint8_t value);
@@ -46,4 +67,31 @@ public:
     void Bit(uint8_t &value, uint8_t bit);
     void Res(uint8_t &value, uint8_t bit);
     void Set(uint8_t &value, uint8_t bit);
-};
\ No newline at end of file
+};
+
+// Instruction decoding, compiled once per bus so the bus helpers inline into
+// every opcode handler. Bus is an MMU<Policy> or a FlatBus.
+template <typename Bus>
+class CPU : public CPUBase
+{
+public:
+    CPU(Bus *memory, MachineState *state, InterruptController *interrupts);
+
+    Bus *memory;
+
+    int Execute(uint8_t opcode);
+    int ExecuteCB(uint8_t opcode);
+    int CheckInterrupts();
+    int Step();
+
+    // Copy and fill loops recognised at their closing JR NZ run in bulk, up
+    // to the last iteration, which is left to the interpreter. A run stops
+    // short of any PPU event the program could notice: a line drawn from
+    // VRAM it is writing, or an interrupt that could be taken. Otherwise it
+    // covers at most BULK_HORIZON_CYCLES so a frame boundary is never skipped.
+    static const int MIN_BULK_ITERATIONS = 4;
+    static const int BULK_HORIZON_CYCLES = 5 * 456;
+
+    // Extra cycles spent, 0 when the loop was left alone
+    int RunLoop(uint16_t start, uint16_t jump);
+};
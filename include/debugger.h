@@ -0,0 +1,66 @@
+#pragma once
+#include <cstdint>
+#include <set>
+#include <vector>
+#include "status.h"
+
+class CPUBase;
+class MMUBase;
+
+enum WatchKind : uint8_t
+{
+    WATCH_READ = 1 << 0,
+    WATCH_WRITE = 1 << 1,
+    WATCH_EXEC = 1 << 2
+};
+
+// Execution breakpoints and read/write watchpoints. CPU and MMU only see a
+// debugger while something is set, so an idle debugger costs nothing; once
+// armed, each access looks at a per-256-byte page flag and only accesses to
+// flagged pages take the slow path.
+class Debugger
+{
+public:
+    Debugger(Status *status);
+
+    void Attach(CPUBase *cpu, MMUBase *memory);
+
+    void AddBreakpoint(uint16_t address);
+    void RemoveBreakpoint(uint16_t address);
+    void AddWatchpoint(uint16_t start, uint16_t end, uint8_t kind);
+    void RemoveWatchpoint(uint16_t start, uint16_t end);
+    void Clear();
+    void SetTrace(bool enabled);
+
+    bool IsWatched(uint16_t address, uint8_t kind) const { return pageFlags[address >> 8] & kind; }
+
+    // Slow paths, only reached for flagged pages
+    bool CheckBreakpoint(uint16_t pc);
+    void CheckRead(uint16_t address);
+    void CheckWrite(uint16_t address, uint8_t value);
+
+    // Per-instruction PC/opcode log
+    bool trace = false;
+
+private:
+    struct Watchpoint
+    {
+        uint16_t start;
+        uint16_t end;
+        uint8_t kind;
+    };
+
+    Status *status;
+    CPUBase *cpu = nullptr;
+    MMUBase *memory = nullptr;
+
+    uint8_t pageFlags[256] = {};
+    std::set<uint16_t> breakpoints;
+    std::vector<Watchpoint> watchpoints;
+
+    // Lets execution resume past the breakpoint it stopped on
+    int resumeAt = -1;
+
+    void Rebuild();
+    bool Matches(uint16_t address, uint8_t kind) const;
+};
@@ -1,11 +1,15 @@
 #pragma once
 #include <SDL3/SDL.h>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
 #include "cartridge.h"
-#include "cpu.h"
-#include "mmu.h"
+#include "debugger.h"
+#include "joypad.h"
+#include "machine.h"
 #include "status.h"
-#include "registers.h"
-#include "ppu.h"
+#include "triplebuffer.h"
 
 class Emulator
 {
@@ -14,6 +18,7 @@ private:
     SDL_Window *window;
     SDL_Renderer *renderer;
     SDL_Surface *screen;
+    SDL_Texture *texture;
     const SDL_DialogFileFilter filters[1] = {{"Gameboy File", "*"}};
     bool isEmulatorWindowOpen;
     const double frameDurationMs = 1000.0 / 59.7275;
@@ -21,6 +26,26 @@ private:
     static const int SCREEN_WIDTH = 160;
     static const int SCREEN_HEIGHT = 144;
     static const int SCALE = 4;
+    static constexpr int MAX_RUN_AHEAD = 6;
+    static const int MAX_FRAME_SKIP = 9;
+
+    // Emulation thread
+    std::thread emulationThread;
+    std::atomic<bool> isEmulationThreadRunning{false};
+    TripleBuffer frames;
+
+    // Frame skip bookkeeping, emulation thread only
+    int skippedFrames = 0;
+    uint64_t lastDrawnFrame = 0;
+    uint64_t lastFrameNs = 0;
+
+    // Set by the file dialog callback, consumed on the main thread
+    std::mutex pendingRomMutex;
+    std::string pendingRom;
+
+#ifdef SIGMABOY_PROFILER
+    Profiler *profiler = nullptr;
+#endif
 
 public:
     Emulator();
@@ -32,19 +57,38 @@ public:
 
     // Emulator Functions
     void LoadCartridge(Cartridge *cartridge);
+    void QueueRom(const std::string &rom);
     static void OnFileAdded(void *userdata, const char *const *filelist, int filter);
     void Run();
 
+    // Command line options
+    std::string profilePath;
+    std::string symbolPath;
+    std::string timelinePath;
+    bool renderThread = true;
+    bool bulkLoops = true;
+    CoreType core = CoreType::FAST;
+
     // Emulator Hardware
     Status status;
+    Debugger debugger;
+    Joypad joypad;
 
-    Registers registers;
     Cartridge *cartridge;
-    MMU *memory;
-    CPU *cpu;
-    PPU *ppu;
+    Machine *machine;
+    Machine *runAheadState;
 
 private:
     void HandleEvents();
-    void RunStep();
-};
\ No newline at end of file
+    void LoadPendingCartridge();
+    void Present();
+    int RunFrame(bool draw);
+    bool ShouldDrawFrame(uint64_t now, uint64_t frameDurationNs);
+
+    void StartEmulation();
+    void StopEmulation();
+    void EmulationLoop();
+
+    void StartProfiling();
+    void FinishProfiling();
+};
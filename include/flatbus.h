@@ -0,0 +1,73 @@
+#pragma once
+#include <cstdint>
+
+// 64 KB of plain RAM behind the CPU's bus interface: no banking, IO or
+// debugger. CPU<FlatBus> runs instruction tests without a cartridge; every
+// access and idle cycle bumps mCycles so tests can check instruction timing.
+class FlatBus
+{
+public:
+    uint8_t data[0x10000] = {};
+    uint64_t mCycles = 0;
+
+    uint8_t Read(uint16_t address)
+    {
+        mCycles++;
+        return data[address];
+    }
+
+    void Write(uint16_t address, uint8_t value)
+    {
+        mCycles++;
+        data[address] = value;
+    }
+
+    uint8_t ReadImm8(uint16_t &pc) { return Read(pc++); }
+
+    uint16_t ReadImm16(uint16_t &pc)
+    {
+        uint8_t low = Read(pc++);
+        uint8_t high = Read(pc++);
+        return (high << 8) | low;
+    }
+
+    uint8_t ReadHRAM(uint8_t offset) { return Read(0xFF00 | offset); }
+    void WriteHRAM(uint8_t offset, uint8_t value) { Write(0xFF00 | offset, value); }
+
+    void PushWord(uint16_t &sp, uint16_t value)
+    {
+        Write(--sp, value >> 8);
+        Write(--sp, value & 0xFF);
+    }
+
+    uint16_t PopWord(uint16_t &sp)
+    {
+        uint8_t low = Read(sp++);
+        uint8_t high = Read(sp++);
+        return (high << 8) | low;
+    }
+
+    void Idle() { mCycles++; }
+
+    uint8_t Peek(uint16_t address) const { return data[address]; }
+
+    bool IsPlainRun(uint16_t start, int count, int step, bool) const
+    {
+        int end = start + (count - 1) * step;
+        return count > 0 && end >= 0 && end <= 0xFFFF;
+    }
+
+    uint8_t CopyRun(uint16_t destination, uint16_t source, int count, int step)
+    {
+        uint8_t value = 0;
+        for (int i = 0; i < count; i++, source += step, destination += step)
+            data[destination] = value = data[source];
+        return value;
+    }
+
+    void FillRun(uint16_t destination, uint8_t value, int count, int step)
+    {
+        for (int i = 0; i < count; i++, destination += step)
+            data[destination] = value;
+    }
+};
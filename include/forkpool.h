@@ -0,0 +1,37 @@
+#pragma once
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "machine.h"
+
+// Fixed set of worker threads that run tasks on forked machines. Each task
+// gets its machine exclusively, so children can be stepped in parallel.
+class ForkPool
+{
+public:
+    explicit ForkPool(unsigned threads = std::thread::hardware_concurrency());
+    ~ForkPool();
+
+    void Submit(Machine *machine, std::function<void(Machine &)> task);
+    void Wait();
+
+private:
+    struct Job
+    {
+        Machine *machine;
+        std::function<void(Machine &)> task;
+    };
+
+    std::vector<std::thread> workers;
+    std::deque<Job> jobs;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable idle;
+    size_t running = 0;
+    bool stopping = false;
+
+    void Work();
+};
@@ -0,0 +1,81 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+#include "cartridge.h"
+#include "machine.h"
+
+struct FuzzOptions
+{
+    unsigned threads = 0; // 0 means one per hardware thread
+    double seconds = 60.0;
+    int frames = 300;     // length of every input sequence, at least MIN_FRAMES
+    std::string outputDir = ".";
+    CoreType core = CoreType::FAST;
+
+    static const int MIN_FRAMES = 32;
+};
+
+// Coverage-guided joypad fuzzer. Every worker thread owns one headless
+// machine and replays mutated per-frame button sequences from a forked
+// post-boot state. Inputs that reach new (bank, PC) edges join the corpus;
+// illegal opcodes and input-insensitive loops are saved as findings.
+class Fuzzer
+{
+public:
+    Fuzzer(Cartridge *cartridge, const FuzzOptions &options);
+
+    void Run();
+
+    enum class Outcome
+    {
+        OK,
+        ILLEGAL_OPCODE,
+        HANG
+    };
+
+    struct Result
+    {
+        Outcome outcome = Outcome::OK;
+        uint8_t bank = 0;
+        uint16_t pc = 0;
+        int frame = 0;
+    };
+
+    // Runs one input from a freshly booted machine, as a worker would
+    Result Replay(const std::vector<uint8_t> &input);
+
+private:
+    static const int COVERAGE_SIZE = 1 << 16;
+    static const int CYCLES_PER_FRAME = 70224;
+
+    // A run counts as hung once the executed path stays identical for a
+    // quarter of the input while the input changes at least 8 times
+    static const int HANG_FRACTION = 4;
+    static const int HANG_INPUT_CHANGES = 8;
+
+    Cartridge *cartridge;
+    FuzzOptions options;
+    int hangFrames;
+
+    std::mutex mutex;
+    std::vector<std::vector<uint8_t>> corpus;
+    uint8_t virgin[COVERAGE_SIZE] = {}; // hit-count buckets seen so far
+    std::set<uint32_t> findings;
+
+    std::atomic<bool> stopping{false};
+    std::atomic<uint64_t> executions{0};
+    std::atomic<uint64_t> edges{0};
+    std::atomic<uint64_t> hangs{0};
+    std::atomic<uint64_t> illegalOpcodes{0};
+
+    void Worker(Machine &base, unsigned seed);
+    Result Execute(Machine &machine, const std::vector<uint8_t> &input, uint8_t *trace);
+    bool MergeCoverage(const uint8_t *trace, uint8_t *seen);
+    void Mutate(std::vector<uint8_t> &input, std::mt19937 &random);
+    void SaveFinding(const std::vector<uint8_t> &input, const Result &result);
+};
@@ -0,0 +1,91 @@
+#pragma once
+#include <cstdint>
+#include "machinestate.h"
+
+enum InterruptFlag : uint8_t
+{
+    INTERRUPT_VBLANK = 1 << 0,
+    INTERRUPT_STAT = 1 << 1,
+    INTERRUPT_TIMER = 1 << 2,
+    INTERRUPT_SERIAL = 1 << 3,
+    INTERRUPT_JOYPAD = 1 << 4
+};
+
+// Owns IE (0xFFFF), IF (0xFF0F) and IME. IE & IF is cached in the machine
+// state whenever either changes, together with one attention flag that is
+// set while the CPU has something to do besides the next instruction: a
+// dispatch, HALT, a pending EI or the HALT bug.
+class InterruptController
+{
+public:
+    explicit InterruptController(MachineState *state) : state(state) {}
+
+    void WriteIE(uint8_t value)
+    {
+        state->ie = value;
+        Update();
+    }
+
+    // The top three bits of IF don't exist and always read as 1
+    void WriteIF(uint8_t value)
+    {
+        state->io[0x0F] = value | 0xE0;
+        Update();
+    }
+
+    void Request(uint8_t interrupts)
+    {
+        state->io[0x0F] |= interrupts;
+        Update();
+    }
+
+    void Acknowledge(uint8_t interrupt)
+    {
+        state->io[0x0F] &= ~interrupt;
+        Update();
+    }
+
+    uint8_t Pending() const { return state->pendingInterrupts; }
+
+    // RETI and DI take effect immediately
+    void SetIME(bool enable)
+    {
+        state->ime = enable;
+        state->enableInterruptsNextInstruction = false;
+        UpdateAttention();
+    }
+
+    // EI takes effect after the instruction that follows it
+    void EnableAfterNextInstruction()
+    {
+        if (!state->ime)
+            state->enableInterruptsNextInstruction = true;
+        UpdateAttention();
+    }
+
+    // With IME off and an interrupt already pending HALT doesn't halt, and
+    // the next opcode is fetched without advancing PC
+    void Halt()
+    {
+        if (!state->ime && state->pendingInterrupts)
+            state->haltBug = true;
+        else
+            state->isHalted = true;
+        UpdateAttention();
+    }
+
+    void Update()
+    {
+        state->pendingInterrupts = state->ie & state->io[0x0F] & 0x1F;
+        UpdateAttention();
+    }
+
+    void UpdateAttention()
+    {
+        state->interruptAttention = state->isHalted || state->haltBug || state->enableInterruptsNextInstruction ||
+                                    (state->ime && state->pendingInterrupts);
+    }
+
+private:
+    MachineState *state;
+};
@@ -0,0 +1,39 @@
+#pragma once
+#include <SDL3/SDL.h>
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <vector>
+#include "machinestate.h"
+
+// Button state fed from the keyboard and any number of SDL gamepads. Events
+// arrive on the main thread, the emulation thread samples GetButtons once
+// per frame. Bindings can be replaced with Bind*.
+class Joypad
+{
+public:
+    Joypad();
+    ~Joypad();
+
+    // Returns true when the event was a joypad input
+    bool HandleEvent(const SDL_Event &event);
+
+    uint8_t GetButtons() const { return keyboardButtons.load(std::memory_order_relaxed) | gamepadButtons.load(std::memory_order_relaxed); }
+
+    // Event time of the oldest button change not yet taken, 0 if none
+    uint64_t TakeInputTimestamp() { return inputTimestamp.exchange(0, std::memory_order_relaxed); }
+
+    void BindKey(SDL_Keycode key, JoypadButton button) { keyBindings[key] = button; }
+    void BindGamepadButton(uint8_t gamepadButton, JoypadButton button) { gamepadBindings[gamepadButton] = button; }
+
+private:
+    std::atomic<uint8_t> keyboardButtons{0};
+    std::atomic<uint8_t> gamepadButtons{0};
+    std::atomic<uint64_t> inputTimestamp{0};
+
+    std::map<SDL_Keycode, JoypadButton> keyBindings;
+    std::map<uint8_t, JoypadButton> gamepadBindings;
+    std::vector<SDL_Gamepad *> gamepads;
+
+    void SetButton(std::atomic<uint8_t> &buttons, JoypadButton button, bool down, uint64_t timestamp);
+};
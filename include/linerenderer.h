@@ -0,0 +1,131 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "machinestate.h"
+#include "triplebuffer.h"
+
+// DMG shades, lightest to darkest
+extern const uint32_t dmgShades[4];
+
+// VRAM pages pinned for the render thread. Lines recorded while VRAM did not
+// change share one view; the CPU's next write to a pinned page copies it.
+struct VramView
+{
+    // Both CGB banks, bank 1 after bank 0
+    static const int PAGES = 2 * MachineState::VRAM_PAGES;
+
+    std::atomic<uint32_t> refs;
+    MemoryPage *pages[PAGES];
+
+    VramView *Retain()
+    {
+        refs.fetch_add(1, std::memory_order_relaxed);
+        return this;
+    }
+    void Release();
+};
+
+// Everything needed to draw one line, captured when the PPU leaves mode 3
+struct LineRecord
+{
+    uint8_t line;
+    uint8_t lcdc, scy, scx, wy, wx, bgp, obp0, obp1;
+    uint8_t windowLine;
+    bool window;
+
+    // Same inputs as in the last published frame, copy the line from there
+    bool reuse;
+
+    uint8_t spriteHeight;
+    uint8_t spriteCount;
+    uint8_t sprites[10][4]; // OAM entries in priority order
+
+    // The accurate profile's pixel FIFO drew the line as it went, mid-line
+    // register writes included; the registers above are then unused
+    bool prerendered;
+    uint32_t pixels[160];
+
+    // CGB palettes already turned into pixels, only filled in on CGB
+    bool cgb;
+    uint32_t bgColors[32];
+    uint32_t objColors[32];
+
+    // 0x8000-0x9FFF, either the machine's own pages or a pinned view. On CGB
+    // bank 1 follows as if it were at 0xA000.
+    MemoryPage *const *vram;
+    VramView *view;
+
+    // Line 143 only
+    bool publish;
+    bool showPerfOverlay;
+    uint64_t inputTimestamp;
+};
+
+// Turns line records into pixels in the frontend's back buffer and publishes
+// finished frames. Runs inline on the emulation thread, or on its own thread
+// once StartThread is called; both produce the same pixels.
+class LineRenderer
+{
+public:
+    explicit LineRenderer(TripleBuffer *frames);
+    ~LineRenderer();
+
+    void StartThread();
+    bool IsThreaded() const { return worker.joinable(); }
+
+    void Submit(const LineRecord &record);
+
+    // Waits until the worker has drawn (and published) every submitted line
+    void Finish();
+
+private:
+    static const size_t QUEUE_SIZE = 2 * 144;
+
+    TripleBuffer *frames;
+
+    // Points into the back buffer, swapped on every publish
+    uint32_t *framebuffer;
+    // Last published frame, read-only until the next publish
+    const uint32_t *previousFrame = nullptr;
+
+    bool lineReused[144] = {};
+    uint64_t inputTimestamp = 0;
+
+    // Colour number (0-3) of the background/window pixels of the current
+    // line, bit 7 set where a CGB tile takes priority over sprites
+    uint8_t lineColors[160];
+
+    // The line's palettes as pixels, four colours each: the record's on CGB,
+    // or BGP followed by OBP0 and OBP1 from dmgColors
+    uint32_t dmgColors[12];
+    const uint32_t *bgColors;
+    const uint32_t *objColors;
+
+    // Single producer, single consumer ring
+    std::thread worker;
+    std::vector<LineRecord> queue;
+    size_t head = 0;
+    size_t count = 0;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable space;
+    bool workerWaiting = false;
+    bool stopping = false;
+
+    // Lines handed to the worker, and lines it has drawn, for Finish
+    uint64_t submitted = 0;
+    std::atomic<uint64_t> rendered{0};
+
+    void Work();
+    void Render(const LineRecord &record);
+    void FinishFrame(const LineRecord &record);
+    void ExpandPalettes(const LineRecord &record);
+
+    void RenderBackground(const LineRecord &record, uint32_t *row);
+    void RenderWindow(const LineRecord &record, uint32_t *row);
+    void RenderSprites(const LineRecord &record, uint32_t *row);
+};
@@ -0,0 +1,40 @@
+#pragma once
+#include <cstdint>
+
+enum class LoopKind : uint8_t
+{
+    COPY_HL_TO_DE, // LD A,(HL+); LD (DE),A; INC DE
+    COPY_DE_TO_HL, // LD A,(DE); LD (HL+),A; INC DE
+    FILL,          // LD (HL+),A or LD (HL-),A
+    CLEAR          // XOR A; LD (HL+),A
+};
+
+enum class LoopCounter : uint8_t
+{
+    B,  // DEC B
+    C,  // DEC C
+    BC  // DEC BC; LD A,B; OR C
+};
+
+// A copy or fill idiom the CPU can run as one bulk memory operation: the
+// loop body plus the closing JR NZ back to its first byte. Every body
+// instruction is a single byte, so coverage and timing follow from the code.
+struct LoopSignature
+{
+    static const int MAX_LENGTH = 8;
+
+    uint8_t code[MAX_LENGTH];
+    uint8_t length;
+    LoopKind kind;
+    LoopCounter counter;
+    int8_t step;      // HL per iteration
+    int bodyCycles;   // without the JR
+};
+
+// Every idiom FindLoop knows
+extern const LoopSignature loopSignatures[];
+extern const int loopSignatureCount;
+
+// Loop closed by a backward JR NZ whose bytes (body and JR) are code, or
+// null when it is not one of the known idioms
+const LoopSignature *FindLoop(const uint8_t *code, int length);
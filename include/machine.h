@@ -0,0 +1,82 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include "cartridge.h"
+#include "core.h"
+#include "cpu.h"
+#include "interrupts.h"
+#include "machinestate.h"
+#include "mmu.h"
+#include "ppu.h"
+#include "sprites.h"
+#include "triplebuffer.h"
+
+// What one Machine::Run got through
+struct RunResult
+{
+    uint64_t cycles = 0; // CPU clocks, so twice the PPU time in double speed
+    uint64_t instructions = 0;
+    bool stopped = false; // an instruction couldn't run
+};
+
+// One emulated Game Boy. All mutable state lives in a single cache-aligned
+// arena; CPU, MMU and PPU are thin views onto it, so a reset is a memset and
+// copying a whole machine is a memcpy plus a reference on each RAM page.
+// The parts are compiled once per accuracy profile, Create picks one.
+class Machine
+{
+public:
+    static Machine *Create(CoreType core, Cartridge *cartridge, TripleBuffer *frames);
+    virtual ~Machine();
+
+    Machine(const Machine &) = delete;
+    Machine &operator=(const Machine &) = delete;
+
+    void Reset();
+
+    // Both machines end up sharing every RAM page until one of them writes it
+    void CopyFrom(Machine &other);
+
+    // Headless child sharing this machine's pages, owned by the caller. The
+    // parent must not be stepping while it is forked.
+    Machine *Fork();
+
+    // Runs instructions and interrupt dispatches, each followed by the PPU
+    // work that falls due, while state->cycles is below until. Also stops
+    // when the PPU enters VBlank (if vblank is set), when an instruction
+    // can't run (0 cycles: breakpoint or illegal opcode) and when *pause is
+    // set. The loop is compiled per profile, one virtual call per batch.
+    virtual RunResult Run(uint64_t until, bool vblank = false) = 0;
+
+    RunResult RunUntilVBlank() { return Run(UINT64_MAX, true); }
+
+    // One instruction, 0 when it couldn't run
+    int Step() { return static_cast<int>(Run(state->cycles + 1).cycles); }
+
+    // Checked after every instruction of a Run, the emulator points it at Status::isPaused
+    const std::atomic<bool> *pause = nullptr;
+
+    // Status::colorMode preset CGB palettes are shown with
+    void SetColorMode(int colorMode);
+
+    // Buttons held from now on, newly pressed ones raise the joypad interrupt
+    void SetJoypad(uint8_t buttons, uint64_t inputTimestamp = 0);
+
+    const CoreType core;
+    Cartridge *cartridge;
+    MachineState *state;
+
+    InterruptController interrupts;
+    SpriteIndex sprites;
+
+    // The profile's parts as the rest of the emulator sees them
+    MMUBase *memory = nullptr;
+    CPUBase *cpu = nullptr;
+    PPUBase *ppu = nullptr;
+
+protected:
+    Machine(CoreType core, Cartridge *cartridge);
+
+private:
+    void ReleasePages();
+};
@@ -0,0 +1,165 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <type_traits>
+#include "registers.h"
+
+// 256 bytes of VRAM, ERAM or WRAM. Pages are shared between forked machines
+// and copied on the first write by a machine that does not own them.
+struct MemoryPage
+{
+    static const int SIZE = 0x100;
+
+    std::atomic<uint32_t> refs;
+    uint8_t data[SIZE];
+
+    // Shared all-zero page every fresh machine starts out with, never freed
+    static MemoryPage zero;
+    static MemoryPage *Zero() { return &zero; }
+
+    MemoryPage *Retain()
+    {
+        if (this != &zero)
+            refs.fetch_add(1, std::memory_order_relaxed);
+        return this;
+    }
+    void Release();
+};
+
+enum JoypadButton : uint8_t
+{
+    JOYPAD_RIGHT = 1 << 0,
+    JOYPAD_LEFT = 1 << 1,
+    JOYPAD_UP = 1 << 2,
+    JOYPAD_DOWN = 1 << 3,
+    JOYPAD_A = 1 << 4,
+    JOYPAD_B = 1 << 5,
+    JOYPAD_SELECT = 1 << 6,
+    JOYPAD_START = 1 << 7
+};
+
+// Sprites touching each visible line, maintained by SpriteIndex
+struct SpriteLines
+{
+    static const int LINES = 144;
+
+    uint64_t covering[LINES]; // bit n set when sprite n's Y range includes the line
+    uint8_t sprites[LINES][10];
+    uint8_t count[LINES];
+    bool dirty[LINES];
+    uint8_t height;
+};
+
+// The accurate profile's pixel FIFO part way through a line's mode 3, see PixelFifo
+struct FifoState
+{
+    bool active; // running for this line's mode 3
+    bool done;   // and has sent all 160 pixels
+    uint64_t start; // cycle mode 3 began
+    int32_t dot;    // dots run since then
+
+    uint8_t x;          // pixels sent to the LCD
+    uint8_t discard;    // pixels still to drop, fine scroll or the window's left edge
+    uint8_t stall;      // dots the fetcher is held: the line's first fetch, sprite fetches
+    uint8_t spriteWait; // dots the background fetch runs on before a sprite fetch
+    bool window;        // switched to the window on this line
+
+    // Background/window fetcher: step 0-5 reads tile, low and high byte,
+    // step 6 waits for the FIFO to empty
+    uint8_t fetchStep;
+    uint8_t fetchX;
+    uint8_t tile, tileAttributes, tileLow, tileHigh;
+
+    // Background FIFO, one tile at a time: bit 7 of the planes is next
+    uint8_t bgLow, bgHigh, bgAttributes, bgCount;
+
+    // Sprite FIFO, slot 0 is the next pixel: colour 0 is empty, rank is the
+    // sprite's position in SpriteIndex::Line's priority order. Slots from
+    // objCount on are all empty.
+    uint8_t objColor[8], objAttributes[8], objRank[8];
+    uint8_t objCount;
+
+    // Sprites on the line in X order with their ranks, and the next to fetch
+    uint8_t sprites[10], spriteRanks[10];
+    uint8_t spriteCount, nextSprite;
+};
+
+// Every mutable bit of the emulated Game Boy in one trivially copyable block.
+// Fields the CPU touches on every instruction come first so they share the
+// leading cache lines. VRAM, ERAM and WRAM live in copy-on-write pages that
+// the block only points to; see MMUBase::Store and Machine::Fork.
+struct alignas(64) MachineState
+{
+    // CPU
+    Registers registers;
+    bool ime;
+    bool enableInterruptsNextInstruction;
+    bool isHalted;
+    bool isStopped;
+    bool haltBug;
+
+    // Maintained by InterruptController: IE & IF, and whether the CPU has to
+    // look at interrupts before the next instruction
+    uint8_t pendingInterrupts;
+    bool interruptAttention;
+
+    // Emulated time in PPU dots; in CGB double speed an M-cycle only takes two
+    uint64_t cycles;
+    bool doubleSpeed;
+
+    // Interrupt enable and the current ROM bank
+    uint8_t ie;
+    uint8_t romBank;
+
+    // Buttons currently held, see JoypadButton
+    uint8_t joypad;
+
+    // PPU, only brought up to date once cycles reaches ppuNextEvent
+    int32_t ppuMode;
+    int32_t ppuLine;
+    uint64_t ppuNextEvent;
+    // Length of the current line's mode 3, HBlank takes the rest of the line
+    int32_t ppuDrawingCycles;
+    // STAT interrupt line, the sources enabled in STAT ORed together
+    bool statLine;
+    FifoState fifo;
+
+    // Memory, smallest and most frequently used first
+    uint8_t hram[0x7F];
+    uint8_t io[0x80];
+    uint8_t oam[0xA0];
+    uint8_t windowLine;
+
+    SpriteLines spriteLines;
+
+    // 0x8000-0xDFFF: VRAM, ERAM, WRAM, one bit per page this machine may write in place
+    static const int PAGE_COUNT = 0x6000 / MemoryPage::SIZE;
+    MemoryPage *pages[PAGE_COUNT];
+    uint32_t ownedPages[PAGE_COUNT / 32];
+
+    // Game Boy Color, picked from the cartridge header at reset
+    bool cgb;
+    uint8_t vramBank; // VBK, mapped at 0x8000
+    uint8_t wramBank; // SVBK, 1-7, mapped at 0xD000
+    uint8_t bgPalettes[64];
+    uint8_t objPalettes[64];
+
+    // VRAM DMA (HDMA1-HDMA5): where the next 16 byte block comes from and
+    // goes to (an offset into VRAM), and the blocks left minus one
+    uint16_t hdmaSource;
+    uint16_t hdmaDestination;
+    uint8_t hdmaBlocks;
+    bool hdmaActive;
+    // PPU dots the CPU is held up by DMA, added once the current step is done
+    uint32_t dmaStall;
+
+    // Banks that are not mapped right now. VBK and SVBK swap them with the
+    // matching pages above, so the mapped bank's slots are null (as is WRAM
+    // bank 0, which always sits at 0xC000).
+    static const int VRAM_PAGES = 0x2000 / MemoryPage::SIZE;
+    static const int WRAM_BANK_PAGES = 0x1000 / MemoryPage::SIZE;
+    MemoryPage *vramBanks[2][VRAM_PAGES];
+    MemoryPage *wramBanks[8][WRAM_BANK_PAGES];
+};
+
+static_assert(std::is_trivially_copyable<MachineState>::value, "MachineState must stay memcpy-able");
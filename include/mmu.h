@@ -1,24 +1,265 @@
 #pragma once
 #include "cartridge.h"
+#include "colortable.h"
+#include "core.h"
+#include "debugger.h"
+#include "interrupts.h"
+#include "sprites.h"
+#include "machinestate.h"
+#include "perf.h"
+#include "status.h"
 #include <cstdint>
 #include <array>
 
-class MMU
+class PPUBase;
+template <typename Policy>
+class PPU;
+
+// The address space as everything but the CPU sees it. Load and Store never
+// take emulated time; the per-profile MMU below adds the bus timing.
+class MMUBase
 {
 public:
-    MMU(Cartridge *cartridge);
+    MMUBase(Cartridge *cartridge, MachineState *state, InterruptController *interrupts, SpriteIndex *sprites);
 
-    uint8_t Read(uint16_t address);
-    void Write(uint16_t address, uint8_t value);
+    uint8_t Load(uint16_t address);
+    void Store(uint16_t address, uint8_t value);
 
-private:
+    // Set by the debugger while watchpoints exist
+    Debugger *debugger = nullptr;
+
+    // Told about LCDC, STAT and LYC writes, and caught up before timed accesses
+    PPUBase *ppu = nullptr;
+
+    // Input latency tracking, host timestamps of the newest input the game
+    // hasn't read yet and of the input it read during the current frame
+    uint64_t pendingInputTimestamp = 0;
+    uint64_t observedInputTimestamp = 0;
+
+    // Bumped on every write to a 16 byte VRAM block (one tile, or half a map
+    // row) so the PPU can tell which lines may look different; CGB bank 1
+    // follows bank 0. Host-side only, not part of the machine state.
+    uint32_t vramVersions[2 * 0x2000 / 16] = {};
+    uint32_t vramGeneration = 0;
+
+    // CGB palette RAM as pixels, four colours per palette. Palette writes
+    // keep it current; the machine state only has the 15-bit entries.
+    uint32_t bgColors[32];
+    uint32_t objColors[32];
+
+    // One of ColorTable's presets, setting it re-expands both palettes
+    const uint32_t *colorTable = ColorTable(NORMAL);
+    void SetColorTable(const uint32_t *table);
+    void ExpandPalettes();
+
+    // 0x8000-0xDFFF, echo RAM already folded back
+    uint8_t ReadPaged(uint16_t address) const
+    {
+        uint16_t offset = address - 0x8000;
+        return state->pages[offset >> 8]->data[offset & 0xFF];
+    }
+
+    void WritePaged(uint16_t address, uint8_t value)
+    {
+        uint16_t offset = address - 0x8000;
+        int page = offset >> 8;
+        if (!(state->ownedPages[page >> 5] & (1u << (page & 31))))
+            MakePrivate(page);
+        state->pages[page]->data[offset & 0xFF] = value;
+    }
+
+    // Either VRAM bank whatever VBK maps in, as the PPU sees it
+    MemoryPage *VramPage(int bank, int page) const
+    {
+        return bank == state->vramBank ? state->pages[page] : state->vramBanks[bank][page];
+    }
+
+    uint8_t ReadVram(int bank, uint16_t address) const
+    {
+        uint16_t offset = address - 0x8000;
+        return VramPage(bank, offset >> 8)->data[offset & 0xFF];
+    }
+
+    // Bulk copies and fills for loops the CPU recognises. A run is plain when
+    // every byte is ROM (read only), 0x8000-0xDFFF or HRAM and no watchpoint
+    // is armed; such bytes have no side effects besides the VRAM versions.
+    uint8_t Peek(uint16_t address) const
+    {
+        if (address <= 0x7FFF)
+            return cartridge->ReadROM(address, state->romBank);
+        if (address >= 0x8000 && address <= 0xDFFF)
+            return ReadPaged(address);
+        if (address >= 0xFF80 && address <= 0xFFFE)
+            return state->hram[address - 0xFF80];
+        return 0xFF;
+    }
+
+    bool IsPlainRun(uint16_t start, int count, int step, bool write) const;
+    // Byte by byte like the loop, so overlapping runs behave the same; returns the last byte
+    uint8_t CopyRun(uint16_t destination, uint16_t source, int count, int step);
+    void FillRun(uint16_t destination, uint8_t value, int count, int step);
+
+    // One block of HBlank DMA, at the PPU's mode 0 transition
+    void TransferHBlankBlock();
+
+protected:
     Cartridge *cartridge;
+    MachineState *state;
+    InterruptController *interrupts;
+    SpriteIndex *sprites;
+
+    void MakePrivate(int page);
+    void Poke(uint16_t address, uint8_t value);
+    void StoreColorRegister(uint16_t address, uint8_t value);
+    void WritePalette(uint8_t *palettes, uint32_t *colors, uint8_t specification, uint8_t value);
+    void SwapBank(int first, MemoryPage **unmapped, MemoryPage **mapped, int count);
+    void StartVramTransfer(uint8_t value);
+    bool TransferBlock();
+    uint8_t ReadSTAT() const;
+    uint8_t ReadJoypad();
+    void TransferOAM(uint8_t source);
+};
+
+template <typename Policy>
+class MMU : public MMUBase
+{
+public:
+    using MMUBase::MMUBase;
+
+    uint8_t Read(uint16_t address)
+    {
+        if (Policy::TIMED_ACCESSES)
+            Tick();
+        return Load(address);
+    }
+
+    void Write(uint16_t address, uint8_t value)
+    {
+        if (Policy::TIMED_ACCESSES)
+            Tick();
+        if (Policy::PIXEL_FIFO && FeedsFifo(address))
+            SyncFifo();
+        Store(address, value);
+    }
+
+    // Bus helpers the CPU inlines into its opcode handlers. Each byte is one
+    // access with the same timing and counters as Read and Write; the common
+    // region is an array access, anything else (or an armed debugger) takes
+    // the full decode.
+    uint8_t ReadImm8(uint16_t &pc)
+    {
+        uint16_t address = pc++;
+        if (Policy::TIMED_ACCESSES)
+            Tick();
+        if (address > 0x7FFF || debugger)
+            return Load(address);
+        CountAccess(REGION_ROM);
+        return cartridge->ReadROM(address, state->romBank);
+    }
+
+    uint16_t ReadImm16(uint16_t &pc)
+    {
+        uint8_t low = ReadImm8(pc);
+        uint8_t high = ReadImm8(pc);
+        return (high << 8) | low;
+    }
+
+    // 0xFF00 + offset, as used by LDH and LD (C)
+    uint8_t ReadHRAM(uint8_t offset)
+    {
+        if (Policy::TIMED_ACCESSES)
+            Tick();
+        if (offset < 0x80 || offset == 0xFF || debugger)
+            return Load(0xFF00 | offset);
+        CountAccess(REGION_HRAM);
+        return state->hram[offset - 0x80];
+    }
+
+    void WriteHRAM(uint8_t offset, uint8_t value)
+    {
+        if (Policy::TIMED_ACCESSES)
+            Tick();
+        if (offset < 0x80 || offset == 0xFF || debugger)
+        {
+            if (Policy::PIXEL_FIFO && FeedsFifo(0xFF00 | offset))
+                SyncFifo();
+            Store(0xFF00 | offset, value);
+            return;
+        }
+        CountAccess(REGION_HRAM);
+        state->hram[offset - 0x80] = value;
+    }
+
+    // High byte first, like CALL and PUSH
+    void PushWord(uint16_t &sp, uint16_t value)
+    {
+        WriteStack(--sp, value >> 8);
+        WriteStack(--sp, value & 0xFF);
+    }
+
+    uint16_t PopWord(uint16_t &sp)
+    {
+        uint8_t low = ReadStack(sp++);
+        uint8_t high = ReadStack(sp++);
+        return (high << 8) | low;
+    }
+
+    // An M-cycle with no bus access (16-bit ALU, branch and stack setup)
+    void Idle()
+    {
+        if (Policy::TIMED_ACCESSES)
+            Tick();
+    }
+
+private:
+    // Brings the PPU up to the access and moves on to the next M-cycle
+    void Tick();
+
+    // LCDC, scroll, the DMG palettes, window position and CGB palette data:
+    // the pixel FIFO has to be caught up before they change under it
+    static bool FeedsFifo(uint16_t address)
+    {
+        return (address >= 0xFF40 && address <= 0xFF4B) || address == 0xFF69 || address == 0xFF6B;
+    }
+    void SyncFifo();
+
+    // The stack lives in HRAM or WRAM in practice
+    uint8_t ReadStack(uint16_t address)
+    {
+        if (Policy::TIMED_ACCESSES)
+            Tick();
+        if (debugger)
+            return Load(address);
+        if (address >= 0xFF80 && address <= 0xFFFE)
+        {
+            CountAccess(REGION_HRAM);
+            return state->hram[address - 0xFF80];
+        }
+        if (address >= 0xC000 && address <= 0xDFFF)
+        {
+            CountAccess(REGION_WRAM);
+            return ReadPaged(address);
+        }
+        return Load(address);
+    }
 
-    uint8_t vram[0x2000];
-    uint8_t eram[0x2000];
-    uint8_t wram[0x2000];
-    uint8_t oam[0xA0];
-    uint8_t io[0x80];
-    uint8_t hram[0x7F];
-    uint8_t ie;
+    void WriteStack(uint16_t address, uint8_t value)
+    {
+        if (Policy::TIMED_ACCESSES)
+            Tick();
+        if (debugger)
+            Store(address, value);
+        else if (address >= 0xFF80 && address <= 0xFFFE)
+        {
+            CountAccess(REGION_HRAM);
+            state->hram[address - 0xFF80] = value;
+        }
+        else if (address >= 0xC000 && address <= 0xDFFF)
+        {
+            CountAccess(REGION_WRAM);
+            WritePaged(address, value);
+        }
+        else
+            Store(address, value);
+    }
 };
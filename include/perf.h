@@ -0,0 +1,139 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+enum PerfRegion
+{
+    REGION_ROM = 0,
+    REGION_VRAM,
+    REGION_ERAM,
+    REGION_WRAM,
+    REGION_OAM,
+    REGION_IO,
+    REGION_HRAM,
+    REGION_IE,
+    REGION_COUNT
+};
+
+enum PerfTimer
+{
+    TIMER_CPU = 0,
+    TIMER_PPU,
+    TIMER_PRESENT,
+    TIMER_SLEEP,
+    TIMER_COUNT
+};
+
+// Per-thread batch, plain increments on the hot path and flushed into the
+// shared counters once per frame
+struct PerfBatch
+{
+    uint64_t instructions = 0;
+    uint64_t cycles = 0;
+    uint64_t frames = 0;
+    uint64_t framesSkipped = 0;
+    uint64_t timerNs[TIMER_COUNT] = {};
+    uint64_t memoryAccesses[REGION_COUNT] = {};
+};
+
+extern thread_local PerfBatch perfBatch;
+
+// Per-region counts cost an increment on every bus access, opcode fetches
+// included, so they are only compiled in with SIGMABOY_REGION_COUNTERS
+inline void CountAccess(PerfRegion region, uint64_t count = 1)
+{
+#ifdef SIGMABOY_REGION_COUNTERS
+    perfBatch.memoryAccesses[region] += count;
+#else
+    (void)region;
+    (void)count;
+#endif
+}
+
+struct PerfSnapshot
+{
+    uint64_t instructions = 0;
+    uint64_t cycles = 0;
+    uint64_t frames = 0;
+    uint64_t framesSkipped = 0;
+    uint64_t timerNs[TIMER_COUNT] = {};
+    uint64_t memoryAccesses[REGION_COUNT] = {};
+
+    // Rates over the last sampling window
+    double emulatedMhz = 0.0;
+    double fps = 0.0;
+
+    // Host time spent emulating a frame, sleep excluded
+    double frameP50Ms = 0.0;
+    double frameP99Ms = 0.0;
+
+    // Input event to presented frame
+    uint64_t inputSamples = 0;
+    double inputMinMs = 0.0;
+    double inputMeanMs = 0.0;
+    double inputP99Ms = 0.0;
+};
+
+class PerfCounters
+{
+public:
+    PerfCounters();
+
+    void Flush();
+    void RecordFrameTime(uint64_t ns);
+    void RecordInputLatency(uint64_t ns);
+
+    PerfSnapshot Snapshot();
+    std::string SnapshotJSON();
+    void DrawOverlay(uint32_t *framebuffer);
+
+    static uint64_t Now();
+
+private:
+    static const int HISTOGRAM_BUCKETS = 512; // last one is overflow
+    static const uint64_t BUCKET_NS = 100000; // frame times, 0.1 ms
+    static const uint64_t LATENCY_BUCKET_NS = 1000000; // input latency runs to tens of ms
+    static const uint64_t RATE_WINDOW_NS = 500000000;
+
+    std::atomic<uint64_t> instructions{0};
+    std::atomic<uint64_t> cycles{0};
+    std::atomic<uint64_t> frames{0};
+    std::atomic<uint64_t> framesSkipped{0};
+    std::atomic<uint64_t> timerNs[TIMER_COUNT];
+    std::atomic<uint64_t> memoryAccesses[REGION_COUNT];
+    std::atomic<uint64_t> frameHistogram[HISTOGRAM_BUCKETS];
+
+    // Rate sampling, only touched by Snapshot
+    std::mutex sampleMutex;
+    uint64_t sampleTime = 0;
+    uint64_t sampleCycles = 0;
+    uint64_t sampleFrames = 0;
+    double emulatedMhz = 0.0;
+    double fps = 0.0;
+
+    // Input latency histogram in 1 ms buckets, plus what the buckets can't
+    // give exactly
+    std::atomic<uint64_t> latencyHistogram[HISTOGRAM_BUCKETS];
+    std::atomic<uint64_t> latencyCount{0};
+    std::atomic<uint64_t> latencySumNs{0};
+    std::atomic<uint64_t> latencyMinNs{UINT64_MAX};
+
+    static void AddToHistogram(std::atomic<uint64_t> *histogram, uint64_t bucketNs, uint64_t ns);
+    static double Percentile(const std::atomic<uint64_t> *histogram, uint64_t bucketNs, double fraction);
+};
+
+extern PerfCounters perf;
+
+// Adds the host time of a scope to one of the timers of the current thread
+class PerfScope
+{
+public:
+    explicit PerfScope(PerfTimer timer) : timer(timer), start(PerfCounters::Now()) {}
+    ~PerfScope() { perfBatch.timerNs[timer] += PerfCounters::Now() - start; }
+
+private:
+    PerfTimer timer;
+    uint64_t start;
+};
@@ -0,0 +1,44 @@
+#pragma once
+#include <cstdint>
+#include "machinestate.h"
+#include "mmu.h"
+#include "sprites.h"
+
+// Mode 3 of the accurate profile, one dot at a time: the background/window
+// fetcher fills an eight pixel FIFO, sprites are fetched into a second one
+// as the LCD reaches them, and each dot mixes one pixel from both with the
+// registers as they are at that dot. The line ends when the 160th pixel is
+// out, so fine scroll, sprites and the window stretch mode 3 by as much as
+// they hold the fetcher up. All progress is in MachineState::fifo; pixels
+// only feed the picture.
+class PixelFifo
+{
+public:
+    PixelFifo(MMUBase *memory, MachineState *state, SpriteIndex *sprites);
+
+    // Mode 3 of state->ppuLine begins at `cycle`
+    void Start(uint64_t cycle);
+
+    // Runs the dots before `cycle`, true once the line is finished
+    bool Run(uint64_t cycle);
+
+    // Earliest cycle the line can finish at, given what is left to do
+    uint64_t EarliestEnd() const;
+
+    // The line so far, valid up to state->fifo.x. Left alone while drawing
+    // is off (headless or hidden frames), the timing is the same either way.
+    uint32_t pixels[160];
+    bool drawing = true;
+
+private:
+    MMUBase *memory;
+    MachineState *state;
+    SpriteIndex *sprites;
+
+    bool Dot();
+    void Fetch();
+    uint16_t TileRowAddress() const;
+    void FetchSprite(int index);
+    void StartWindow();
+    uint32_t Mix(uint8_t color, uint8_t attributes, uint8_t objColor, uint8_t objAttributes) const;
+};
@@ -1,31 +1,98 @@
 #pragma once
 #include <cstdint>
+#include "core.h"
+#include "machinestate.h"
+#include "interrupts.h"
+#include "linerenderer.h"
 #include "mmu.h"
-#include <SDL3/SDL_render.h>
+#include "pixelfifo.h"
+#include "sprites.h"
+#include "triplebuffer.h"
 
-class PPU
+// Scanline capture and memoisation, shared by both profiles. Mode timing
+// lives in the per-profile PPU below.
+class PPUBase
 {
 public:
-    PPU(MMU *memory, SDL_Renderer *renderer);
-    ~PPU();
+    PPUBase(MMUBase *memory, MachineState *state, InterruptController *interrupts, SpriteIndex *sprites, TripleBuffer *frames);
+    ~PPUBase();
 
-    void Step(int cycles);
-    void RenderScanline();
+    static const int OAM_SCAN_CYCLES = 80;
+    static const int DRAWING_CYCLES = 172;
+    static const int LINE_CYCLES = 456;
 
-    uint32_t framebuffer[160 * 144];
-    MMU *memory;
-    SDL_Renderer *renderer;
+    // Records the line that just left mode 3; pixels is the FIFO's picture
+    // of it, or null to have the renderer draw it from the registers
+    void RenderScanline(const uint32_t *pixels);
 
-    SDL_Texture *texture = nullptr;
+    // Brings a running pixel FIFO up to state->cycles, before a write to a
+    // register it reads
+    void SyncFifo();
+
+    // Recomputes the STAT interrupt line after a mode, LY, STAT or LYC change
+    // and requests the interrupt when it goes high
+    void UpdateStatLine();
+
+    // LCDC bit 7. The mode machine keeps running while the LCD is off so
+    // frames stay paced, but reads see line 0 in mode 0 and no interrupts
+    // are raised; switching it on restarts line 0 from OAM scan.
+    void SetLcdEnabled(bool enabled);
+
+    // Earliest cycle at which the PPU can next request an interrupt
+    static uint64_t NextInterruptEvent(const MachineState *state);
+
+    // VRAM was replaced wholesale (Machine::CopyFrom). The line signatures
+    // stay valid only if it is back to the pages the last drawn frame ended on.
+    void VramReplaced();
+
+    MMUBase *memory;
+    MachineState *state;
+    InterruptController *interrupts;
+    SpriteIndex *sprites;
+    TripleBuffer *frames;
+
+    // Draws the lines RenderScanline records, inline or on a worker thread
+    LineRenderer renderer;
+
+    // Mode 3 of the accurate profile
+    PixelFifo fifo;
+
+    bool showPerfOverlay = false;
+    // Cleared for frames that are emulated but never shown (run-ahead)
+    bool drawFrame = true;
 
 private:
-    uint8_t lcdc;
-    uint8_t stat;
-    uint16_t scy;
-    uint16_t scx;
-    uint16_t ly;
-    uint16_t lyc;
-    int mode = 2;
-    int modeClock = 0;
-    int line = 0;
-};
\ No newline at end of file
+    // Line memoisation: a line whose inputs hash to the same signature as in
+    // the last published frame is copied from it instead of being drawn, and
+    // a frame where that holds for every line is not published at all
+    uint64_t lineSignatures[144];
+    bool linesValid = false;
+    bool frameChanged = false;
+
+    // VRAM as the render thread sees it, replaced after VRAM writes
+    VramView *vramView = nullptr;
+    uint32_t vramViewGeneration = 0;
+
+    // VRAM at the end of the last drawn frame, pinned so the page pointers
+    // can't be reused for other contents
+    VramView *frameView = nullptr;
+
+    // Both CGB banks for inline rendering, gathered per line
+    MemoryPage *linePages[VramView::PAGES];
+
+    uint64_t LineSignature(int line);
+    uint64_t PixelSignature(const uint32_t *pixels) const;
+    uint64_t MixMapEntry(uint64_t hash, uint16_t mapAddress, bool unsignedTiles) const;
+    bool WindowVisible(int line) const;
+    MemoryPage *const *PinVram(VramView *&view);
+};
+
+template <typename Policy>
+class PPU : public PPUBase
+{
+public:
+    using PPUBase::PPUBase;
+
+    // Runs every mode change that is due by state->cycles
+    void CatchUp();
+};
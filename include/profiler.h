@@ -0,0 +1,127 @@
+#pragma once
+#include <cstdint>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "cartridge.h"
+#include "machinestate.h"
+
+// Per-opcode and per-(bank, PC) execution profiler. Only built when
+// SIGMABOY_PROFILER is defined, see CMakeLists.txt.
+class Profiler
+{
+public:
+    Profiler(const Cartridge *cartridge, const MachineState *state);
+
+    // Called once per executed instruction, opcodes 0x100-0x1FF are CB-prefixed
+    void Record(uint16_t pc, uint16_t opcode, int cycles)
+    {
+        uint32_t index = Index(pc);
+        pcCount[index]++;
+        pcCycles[index] += cycles;
+        opcodeCount[opcode]++;
+        opcodeCycles[opcode] += cycles;
+    }
+
+    // Shadow call stack, fed after every instruction with the SP it started with
+    void TrackCalls(uint8_t opcode, int cycles, uint16_t spBefore, uint16_t pc, uint16_t sp)
+    {
+        nodes[stack.back().node].cycles += cycles;
+
+        switch (opcode)
+        {
+        case 0xC4: // CALL cc, only when taken
+        case 0xCC:
+        case 0xD4:
+        case 0xDC:
+            if (cycles != 24)
+                break;
+            [[fallthrough]];
+        case 0xCD: // CALL
+        case 0xC7: // RST
+        case 0xCF:
+        case 0xD7:
+        case 0xDF:
+        case 0xE7:
+        case 0xEF:
+        case 0xF7:
+        case 0xFF:
+            EnterCall(pc, sp);
+            break;
+        case 0xC0: // RET cc, only when taken
+        case 0xC8:
+        case 0xD0:
+        case 0xD8:
+            if (cycles != 20)
+                break;
+            [[fallthrough]];
+        case 0xC9: // RET
+        case 0xD9: // RETI
+            LeaveCall(spBefore);
+            break;
+        }
+    }
+
+    void EnterInterrupt(uint16_t vector, uint16_t sp) { EnterCall(vector, sp); }
+
+    bool LoadSymbols(const std::string &path);
+
+    // Sorted hot spot report, a callgrind flat profile and folded stacks
+    void WriteReport(const std::string &path) const;
+    void WriteCallgrind(const std::string &path) const;
+    void WriteFoldedStacks(const std::string &path) const;
+
+    // Bank-aware address, bank in the upper 16 bits
+    uint32_t Location(uint16_t pc) const;
+    std::string Label(uint32_t location) const;
+    std::string Function(uint32_t location) const;
+
+private:
+    const Cartridge *cartridge;
+    const MachineState *state;
+    uint32_t romSize;
+
+    uint64_t opcodeCount[0x200] = {};
+    uint64_t opcodeCycles[0x200] = {};
+
+    // ROM is indexed by physical offset, everything from 0x8000 up follows it
+    std::vector<uint64_t> pcCount;
+    std::vector<uint64_t> pcCycles;
+
+    std::map<uint32_t, std::string> symbols;
+
+    // Call tree, node 0 is the root and every path from it is one stack
+    struct CallNode
+    {
+        uint32_t parent;
+        uint32_t location;
+        uint64_t cycles;
+    };
+
+    struct Frame
+    {
+        uint32_t node;
+        uint16_t sp; // where the return address was pushed
+    };
+
+    static const size_t MAX_DEPTH = 256;
+
+    std::vector<CallNode> nodes;
+    std::unordered_map<uint64_t, uint32_t> children;
+    std::vector<Frame> stack;
+
+    void EnterCall(uint16_t target, uint16_t sp);
+    void LeaveCall(uint16_t sp);
+
+    uint32_t Index(uint16_t pc) const
+    {
+        if (pc < 0x4000)
+            return pc;
+        if (pc < 0x8000)
+            return state->romBank * 0x4000 + (pc - 0x4000);
+        return romSize + (pc - 0x8000);
+    }
+
+    uint32_t IndexToLocation(uint32_t index) const;
+};
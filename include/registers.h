@@ -14,7 +14,7 @@ enum Flag : uint8_t {
 class Registers
 {
 public:
-    uint16_t pc = 0;
+    uint16_t pc;
     uint16_t sp;
 
     struct
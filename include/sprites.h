@@ -0,0 +1,35 @@
+#pragma once
+#include <cstdint>
+#include "machinestate.h"
+
+// Keeps MachineState::spriteLines in step with OAM so the renderer never
+// scans all 40 entries per line. Every line has a mask of the sprites whose
+// Y range covers it, updated when a Y byte or the sprite height changes, and
+// a cached list of the ten sprites the hardware picks, rebuilt only after
+// the mask or the X position of one of its sprites changed.
+class SpriteIndex
+{
+public:
+    static const int MAX_PER_LINE = 10;
+
+    explicit SpriteIndex(MachineState *state) : state(state) {}
+
+    // OAM byte written by the CPU
+    void WriteOAM(uint8_t offset, uint8_t value);
+
+    // LCDC bit 2, 8x8 or 8x16 sprites
+    void SetHeight(uint8_t height);
+
+    // Whole OAM replaced (DMA, reset)
+    void Rebuild();
+
+    // Sprites on a visible line in drawing priority order: lowest X first,
+    // ties broken by OAM position (CGB: OAM position only)
+    const uint8_t *Line(int line, int &count);
+
+private:
+    MachineState *state;
+
+    void SetCoverage(int sprite, uint8_t y, bool covered);
+    void MarkDirty(int sprite);
+};
@@ -1,18 +1,34 @@
 #pragma once
+#include <atomic>
 
+// CGB colour presets, see ColorTable. NORMAL imitates the CGB's LCD, RAW
+// shows palette values as they are.
 enum ColorModes
 {
     NORMAL = 0,
     RETRO = 1,
     GRAY = 2,
-    SIGMA = 3
+    SIGMA = 3,
+    RAW = 4
 };
 
+const int COLOR_MODE_COUNT = 5;
+
+// Status::frameSkip value that skips frames only while they can't be shown
+// or emulation is behind
+const int FRAME_SKIP_AUTO = -1;
+
+// Shared between the main (event/presentation) thread and the emulation thread
 struct Status
 {
-    bool isRunning = false;
-    bool isPaused = false;
-    bool doStep = false;
+    std::atomic<bool> isRunning{false};
+    std::atomic<bool> isPaused{false};
+    std::atomic<bool> doStep{false};
+    std::atomic<bool> isFastForward{false};
+    std::atomic<bool> showPerfOverlay{false};
+    std::atomic<int> runAhead{0};
+    // 0 draws every frame, N draws one frame in N + 1, or FRAME_SKIP_AUTO
+    std::atomic<int> frameSkip{0};
 
-    int colorMode = NORMAL;
-};
\ No newline at end of file
+    std::atomic<int> colorMode{NORMAL};
+};
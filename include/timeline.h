@@ -0,0 +1,87 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Tracks for events that happen in emulated time rather than host time
+enum TimelineTrack : uint8_t
+{
+    TRACK_HOST = 0,
+    TRACK_PPU,
+    TRACK_INTERRUPTS,
+    TRACK_DMA,
+    TRACK_CARTRIDGE,
+    TRACK_COUNT
+};
+
+struct TimelineEvent
+{
+    const char *name;
+    uint64_t start; // host ns, or emulated cycles for non-host tracks
+    uint64_t duration;
+    uint32_t arg;
+    TimelineTrack track;
+};
+
+// Optional recorder that writes Chrome/Perfetto trace-event JSON. Every
+// thread records into its own preallocated buffer, so recording never takes
+// a lock and costs a single flag test while disabled.
+class Timeline
+{
+public:
+    void Start(const std::string &path);
+    void Stop();
+
+    bool IsEnabled() const { return enabled.load(std::memory_order_relaxed); }
+
+    void NameThread(const char *name);
+
+    // Emulated events are stamped with the emulated clock
+    void SetClock(const uint64_t *cycles) { clock = cycles; }
+    void Emulated(const char *name, TimelineTrack track, uint32_t arg = 0, uint64_t duration = 0)
+    {
+        if (IsEnabled() && clock)
+            Record({name, *clock, duration, arg, track});
+    }
+
+    void Record(const TimelineEvent &event);
+
+private:
+    static const size_t EVENTS_PER_THREAD = 1 << 20;
+
+    struct Buffer
+    {
+        std::vector<TimelineEvent> events;
+        size_t count = 0;
+        uint64_t dropped = 0;
+        uint32_t tid = 0;
+        std::string name;
+    };
+
+    std::atomic<bool> enabled{false};
+    std::string path;
+    uint64_t startTime = 0;
+    const uint64_t *clock = nullptr;
+
+    std::mutex buffersMutex;
+    std::vector<std::unique_ptr<Buffer>> buffers;
+
+    Buffer *ThreadBuffer();
+};
+
+extern Timeline timeline;
+
+// Records the host time of a scope as one complete event on the current thread
+class TimelineSpan
+{
+public:
+    explicit TimelineSpan(const char *name);
+    ~TimelineSpan();
+
+private:
+    const char *name;
+    uint64_t start = 0;
+};
@@ -0,0 +1,37 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+
+// Lock-free single-producer/single-consumer triple buffer for finished frames.
+// The frontend owns the storage: the PPU renders straight into the back slot,
+// the presentation thread always takes the newest published slot and neither
+// side ever blocks the other.
+class TripleBuffer
+{
+public:
+    static const int WIDTH = 160;
+    static const int HEIGHT = 144;
+
+    TripleBuffer();
+
+    // Producer side. inputTimestamp is the host time of the input that first
+    // shows up in this frame, 0 if none
+    uint32_t *BackBuffer() { return buffers[back]; }
+    uint32_t *Publish(uint64_t inputTimestamp = 0);
+
+    // Consumer side, returns nullptr when nothing new has been published
+    const uint32_t *AcquireLatest(uint64_t *inputTimestamp = nullptr);
+
+private:
+    static const uint8_t FRESH = 0x4;
+
+    uint32_t buffers[3][WIDTH * HEIGHT];
+    uint64_t inputTimestamps[3] = {};
+
+    // Input of a frame that was replaced before it was ever presented
+    uint64_t droppedInputTimestamp = 0;
+
+    uint8_t back = 0;
+    uint8_t front = 1;
+    std::atomic<uint8_t> middle{2};
+};
@@ -82,24 +82,32 @@ void Cartridge::DetectMBC()
     }
 }
 
-uint8_t Cartridge::ReadROM(uint16_t address) const
+uint8_t Cartridge::SelectBank(uint8_t bank, uint8_t currentBank) const
 {
-    if (address < 0x4000)
-    {
-        return romData[address];
-    }
-    else if (address < 0x8000)
-    {
-        uint16_t bankOffset = currentBank * 0x4000;
-        return romData[bankOffset + (address - 0x4000)];
-    }
-    return 0xFF;
-}
+    size_t banks = GetBankCount();
 
-void Cartridge::SwitchBank(uint8_t bank)
-{
-    if (mbcType == MBCType::MBC1)
+    switch (mbcType)
     {
-        currentBank = bank % (romData.size() / 0x4000);
+    case MBCType::NONE:
+        return currentBank;
+    case MBCType::MBC1:
+        bank &= 0x1F;
+        if (bank == 0)
+            bank = 1;
+        break;
+    case MBCType::MBC2:
+        bank &= 0x0F;
+        if (bank == 0)
+            bank = 1;
+        break;
+    case MBCType::MBC3:
+        bank &= 0x7F;
+        if (bank == 0)
+            bank = 1;
+        break;
+    case MBCType::MBC5:
+        break;
     }
+
+    return banks ? bank % banks : 0;
 }
\ No newline at end of file
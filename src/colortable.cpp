@@ -0,0 +1,68 @@
+#include "colortable.h"
+#include "status.h"
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+static const int ENTRIES = 0x8000;
+
+// Channels in 0-1
+static uint32_t Pixel(double red, double green, double blue)
+{
+    auto channel = [](double value)
+    { return static_cast<uint32_t>(std::lround(std::clamp(value, 0.0, 1.0) * 255)); };
+    return 0xFF000000 | channel(red) << 16 | channel(green) << 8 | channel(blue);
+}
+
+static uint32_t Convert(int colorMode, uint16_t bgr)
+{
+    double red = (bgr & 0x1F) / 31.0;
+    double green = ((bgr >> 5) & 0x1F) / 31.0;
+    double blue = ((bgr >> 10) & 0x1F) / 31.0;
+    if (colorMode == RAW)
+        return Pixel(red, green, blue);
+
+    // The CGB's LCD: a steep response curve darkens the mid tones and each
+    // subpixel bleeds into its neighbours
+    const double lcdGamma = 4.0;
+    const double outputGamma = 2.2;
+    double r = std::pow(red, lcdGamma);
+    double g = std::pow(green, lcdGamma);
+    double b = std::pow(blue, lcdGamma);
+    red = std::pow((255 * r + 50 * g + 0 * b) / 255, 1 / outputGamma) * 255 / 280;
+    green = std::pow((10 * r + 230 * g + 30 * b) / 255, 1 / outputGamma) * 255 / 280;
+    blue = std::pow((50 * r + 10 * g + 220 * b) / 255, 1 / outputGamma) * 255 / 280;
+
+    double luma = 0.299 * red + 0.587 * green + 0.114 * blue;
+    switch (colorMode)
+    {
+    case GRAY:
+        return Pixel(luma, luma, luma);
+    case RETRO:
+        // Brightness along the DMG's green, darkest to lightest shade
+        return Pixel(0x0F / 255.0 + luma * (0x9B - 0x0F) / 255.0, 0x38 / 255.0 + luma * (0xBC - 0x38) / 255.0, 0x0F / 255.0);
+    case SIGMA:
+        // LCD colours, pushed away from grey
+        return Pixel(luma + (red - luma) * 1.4, luma + (green - luma) * 1.4, luma + (blue - luma) * 1.4);
+    default:
+        return Pixel(red, green, blue);
+    }
+}
+
+const uint32_t *ColorTable(int colorMode)
+{
+    static const std::vector<uint32_t> tables = []
+    {
+        std::vector<uint32_t> built(COLOR_MODE_COUNT * ENTRIES);
+        for (int mode = 0; mode < COLOR_MODE_COUNT; mode++)
+        {
+            for (int bgr = 0; bgr < ENTRIES; bgr++)
+                built[mode * ENTRIES + bgr] = Convert(mode, bgr);
+        }
+        return built;
+    }();
+
+    if (colorMode < 0 || colorMode >= COLOR_MODE_COUNT)
+        colorMode = NORMAL;
+    return tables.data() + colorMode * ENTRIES;
+}
@@ -1,33 +1,35 @@
 #include "cpu.h"
+#include "flatbus.h"
+#include "ppu.h"
+#include "timeline.h"
+#include <algorithm>
 
-CPU::CPU(MMU *memory, Registers *registers) : memory(memory), registers(registers)
-{
-    registers->pc = 0x0100;
-    registers->sp = 0xFFFE;
-}
+CPUBase::CPUBase(MachineState *state, InterruptController *interrupts) : state(state), interrupts(interrupts), registers(&state->registers) {}
 
-int CPU::Execute(uint8_t opcode)
+template <typename Bus>
+CPU<Bus>::CPU(Bus *memory, MachineState *state, InterruptController *interrupts) : CPUBase(state, interrupts), memory(memory) {}
+
+template <typename Bus>
+int CPU<Bus>::Execute(uint8_t opcode)
 {
-    uint8_t low, high;
     uint16_t address;
     int8_t offset;
+    uint8_t value;
     uint8_t correction;
     bool setC;
-    printf("PC: %04X, Opcode: %02X\n", registers->pc - 1, opcode);
-
     switch (opcode)
     {
     case 0x00: // NOP
         return 4;
     case 0x01:
-        registers->c = memory->Read(registers->pc++);
-        registers->b = memory->Read(registers->pc++);
+        registers->bc = memory->ReadImm16(registers->pc);
         return 12; // LD BC,d16
     case 0x02:
         memory->Write(registers->bc, registers->a);
         return 8; // LD (BC),A
     case 0x03:
         registers->bc++;
+        memory->Idle();
         return 8; // INC BC
     case 0x04:
         Inc(registers->b);
@@ -36,27 +38,27 @@ int CPU::Execute(uint8_t opcode)
         Dec(registers->b);
         return 4; // DEC B
     case 0x06:
-        registers->b = memory->Read(registers->pc++);
+        registers->b = memory->ReadImm8(registers->pc);
         return 8; // LD B,d8
     case 0x07:
         Rlc(registers->a, false);
         return 4; // RLCA
     case 0x08:
-        low = memory->Read(registers->pc++);
-        high = memory->Read(registers->pc++);
-        address = (high << 8) | low;
+        address = memory->ReadImm16(registers->pc);
 
         memory->Write(address, registers->sp & 0xFF);
         memory->Write(address + 1, (registers->sp >> 8) & 0xFF);
         return 20; // LD (a16),SP
     case 0x09:
         AddHL(registers->bc);
+        memory->Idle();
         return 8; // ADD HL,BC
     case 0xA:
         registers->a = memory->Read(registers->bc);
         return 8; // LD A,(BC)
     case 0xB:
         registers->bc--;
+        memory->Idle();
         return 8; // DEC BC
     case 0xC:
         Inc(registers->c);
@@ -65,24 +67,31 @@ int CPU::Execute(uint8_t opcode)
         Dec(registers->c);
         return 4; // DEC C
     case 0xE:
-        registers->c = memory->Read(registers->pc++);
+        registers->c = memory->ReadImm8(registers->pc);
         return 8; // LD C,d8
     case 0xF:
         Rrc(registers->a, false);
         return 4; // RRCA
     case 0x10:
         registers->pc++; // just skip the byte its not being used
-        isStopped = true;
+        if (state->cgb && (state->io[0x4D] & 0x01))
+        {
+            // CGB speed switch armed through KEY1
+            state->doubleSpeed = !state->doubleSpeed;
+            state->io[0x4D] = 0x7E | (state->doubleSpeed ? 0x80 : 0);
+        }
+        else
+            state->isStopped = true;
         return 4; // STOP with a dummy byte??
     case 0x11:
-        registers->e = memory->Read(registers->pc++);
-        registers->d = memory->Read(registers->pc++);
+        registers->de = memory->ReadImm16(registers->pc);
         return 12; // LD DE, n16
     case 0x12:
         memory->Write(registers->de, registers->a);
         return 8; // LD (DE),A
     case 0x13:
         registers->de++;
+        memory->Idle();
         return 8; // INC DE
     case 0x14:
         Inc(registers->d);
@@ -91,23 +100,26 @@ int CPU::Execute(uint8_t opcode)
         Dec(registers->d);
         return 4; // DEC D
     case 0x16:
-        registers->d = memory->Read(registers->pc++);
+        registers->d = memory->ReadImm8(registers->pc);
         return 8; // LD D,n8
     case 0x17:
         Rl(registers->a, false);
         return 4; // RLA
     case 0x18:
-        offset = static_cast<int8_t>(memory->Read(registers->pc++));
+        offset = static_cast<int8_t>(memory->ReadImm8(registers->pc));
         registers->pc += offset;
+        memory->Idle();
         return 12; // JR e8
     case 0x19:
         AddHL(registers->de);
+        memory->Idle();
         return 8; // ADD HL, DE
     case 0x1A:
         registers->a = memory->Read(registers->de);
         return 8; // LD A, (DE)
     case 0x1B:
         registers->de--;
+        memory->Idle();
         return 8; // DEC DE
     case 0x1C:
         Inc(registers->e);
@@ -116,22 +128,25 @@ int CPU::Execute(uint8_t opcode)
         Dec(registers->e);
         return 4; // DEC E
     case 0x1E:
-        registers->e = memory->Read(registers->pc++);
+        registers->e = memory->ReadImm8(registers->pc);
         return 8; // LD E, n8
     case 0x1F:
         Rr(registers->a, false);
         return 4; // RRA
     case 0x20:
-        offset = static_cast<int8_t>(memory->Read(registers->pc++));
+        offset = static_cast<int8_t>(memory->ReadImm8(registers->pc));
         if (!registers->IsFlagSet(Flag::Z))
         {
             registers->pc += offset;
+            memory->Idle();
+            // Backward jumps may close a copy or fill loop
+            if (offset < 0)
+                return 12 + RunLoop(registers->pc, registers->pc - offset - 2);
             return 12;
         }
         return 8; // JR NZ, e
     case 0x21:
-        registers->l = memory->Read(registers->pc++);
-        registers->h = memory->Read(registers->pc++);
+        registers->hl = memory->ReadImm16(registers->pc);
         return 12; // LD HL, n16
     case 0x22:
         memory->Write(registers->hl, registers->a);
@@ -139,6 +154,7 @@ int CPU::Execute(uint8_t opcode)
         return 8; // LD (HL+), A
     case 0x23:
         registers->hl++;
+        memory->Idle();
         return 8; // INC HL
     case 0x24:
         Inc(registers->h);
@@ -147,7 +163,7 @@ int CPU::Execute(uint8_t opcode)
         Dec(registers->h);
         return 4; // DEC H
     case 0x26:
-        registers->h = memory->Read(registers->pc++);
+        registers->h = memory->ReadImm8(registers->pc);
         return 8; // LD H, n8
     case 0x27:
         correction = 0;
@@ -180,15 +196,17 @@ int CPU::Execute(uint8_t opcode)
 
         return 4; // DAA
     case 0x28:
-        offset = static_cast<int8_t>(memory->Read(registers->pc++));
+        offset = static_cast<int8_t>(memory->ReadImm8(registers->pc));
         if (registers->IsFlagSet(Flag::Z))
         {
             registers->pc += offset;
+            memory->Idle();
             return 12;
         }
         return 8; // JR Z, e
     case 0x29:
         AddHL(registers->hl);
+        memory->Idle();
         return 8; // ADD HL, HL
     case 0x2A:
         registers->a = memory->Read(registers->hl);
@@ -196,6 +214,7 @@ int CPU::Execute(uint8_t opcode)
         return 8; // LD A, (HL+)
     case 0x2B:
         registers->hl--;
+        memory->Idle();
         return 8; // DEC HL
     case 0x2C:
         Inc(registers->l);
@@ -204,7 +223,7 @@ int CPU::Execute(uint8_t opcode)
         Dec(registers->l);
         return 4; // DEC L
     case 0x2E:
-        registers->l = memory->Read(registers->pc++);
+        registers->l = memory->ReadImm8(registers->pc);
         return 8; // LD L, n8
     case 0x2F:
         registers->a = ~registers->a;
@@ -212,18 +231,16 @@ int CPU::Execute(uint8_t opcode)
         registers->WriteFlag(Flag::H, true);
         return 4; // CPL
     case 0x30:
-        offset = static_cast<int8_t>(memory->Read(registers->pc++));
+        offset = static_cast<int8_t>(memory->ReadImm8(registers->pc));
         if (!registers->IsFlagSet(Flag::C))
         {
             registers->pc += offset;
+            memory->Idle();
             return 12;
         }
         return 8; // JR NC, e
     case 0x31:
-        low = memory->Read(registers->pc++);
-        high = memory->Read(registers->pc++);
-
-        registers->sp = (high << 8) | low;
+        registers->sp = memory->ReadImm16(registers->pc);
         return 12; // LD SP, n16
     case 0x32:
         memory->Write(registers->hl, registers->a);
@@ -231,15 +248,20 @@ int CPU::Execute(uint8_t opcode)
         return 8; // LD (HL-), A
     case 0x33:
         registers->sp++;
+        memory->Idle();
         return 8; // INC SP
     case 0x34:
-        memory->Write(registers->hl, memory->Read(registers->hl) + 1);
+        value = memory->Read(registers->hl);
+        Inc(value);
+        memory->Write(registers->hl, value);
         return 12; // INC (HL)
     case 0x35:
-        memory->Write(registers->hl, memory->Read(registers->hl) - 1);
+        value = memory->Read(registers->hl);
+        Dec(value);
+        memory->Write(registers->hl, value);
         return 12; // DEC (HL)
     case 0x36:
-        memory->Write(registers->hl, memory->Read(registers->pc++));
+        memory->Write(registers->hl, memory->ReadImm8(registers->pc));
         return 12; // LD (HL), n8
     case 0x37:
         registers->WriteFlag(Flag::N, false);
@@ -247,15 +269,17 @@ int CPU::Execute(uint8_t opcode)
         registers->WriteFlag(Flag::C, true);
         return 4; // SCF
     case 0x38:
-        offset = static_cast<int8_t>(memory->Read(registers->pc++));
+        offset = static_cast<int8_t>(memory->ReadImm8(registers->pc));
         if (registers->IsFlagSet(Flag::C))
         {
             registers->pc += offset;
+            memory->Idle();
             return 12;
         }
         return 8; // JR C, e
     case 0x39:
         AddHL(registers->sp);
+        memory->Idle();
         return 8; // ADD HL, SP
     case 0x3A:
         registers->a = memory->Read(registers->hl);
@@ -263,6 +287,7 @@ int CPU::Execute(uint8_t opcode)
         return 8; // LD A, (HL-)
     case 0x3B:
         registers->sp--;
+        memory->Idle();
         return 8; // DEC SP
     case 0x3C:
         Inc(registers->a);
@@ -271,7 +296,7 @@ int CPU::Execute(uint8_t opcode)
         Dec(registers->a);
         return 4; // DEC A
     case 0x3E:
-        registers->a = memory->Read(registers->pc++);
+        registers->a = memory->ReadImm8(registers->pc);
         return 8; // LD A, n8
     case 0x3F:
         registers->WriteFlag(Flag::N, false);
@@ -442,7 +467,7 @@ int CPU::Execute(uint8_t opcode)
         memory->Write(registers->hl, registers->l);
         return 8; // LD (HL), L
     case 0x76:
-        isHalted = true;
+        interrupts->Halt();
         return 4; // HALT
     case 0x77:
         memory->Write(registers->hl, registers->a);
@@ -664,301 +689,278 @@ int CPU::Execute(uint8_t opcode)
         Cp(registers->a);
         return 4; // CP A
     case 0xC0:
+        memory->Idle();
         if (!registers->IsFlagSet(Flag::Z))
         {
-            registers->pc = memory->Read(registers->sp++);
-            registers->pc |= memory->Read(registers->sp++) << 8;
+            registers->pc = memory->PopWord(registers->sp);
+            memory->Idle();
             return 20;
         }
         return 8; // RET NZ
     case 0xC1:
-        registers->c = memory->Read(registers->sp++);
-        registers->b = memory->Read(registers->sp++);
+        registers->bc = memory->PopWord(registers->sp);
         return 12; // POP BC
     case 0xC2:
-        low = memory->Read(registers->pc++);
-        high = memory->Read(registers->pc++);
-        address = (high << 8) | low;
+        address = memory->ReadImm16(registers->pc);
         if (!registers->IsFlagSet(Flag::Z))
         {
+            memory->Idle();
             registers->pc = address;
             return 16;
         }
         return 12; // JP NZ, a16
     case 0xC3:
-        low = memory->Read(registers->pc++);
-        high = memory->Read(registers->pc++);
-        address = (high << 8) | low;
-
+        address = memory->ReadImm16(registers->pc);
+        memory->Idle();
         registers->pc = address;
         return 16; // JP a16
     case 0xC4:
-        low = memory->Read(registers->pc++);
-        high = memory->Read(registers->pc++);
-        address = (high << 8) | low;
+        address = memory->ReadImm16(registers->pc);
         if (!registers->IsFlagSet(Flag::Z))
         {
-            memory->Write(registers->sp--, (registers->pc >> 8) & 0xFF);
-            memory->Write(registers->sp--, registers->pc & 0xFF);
+            memory->Idle();
+            memory->PushWord(registers->sp, registers->pc);
             registers->pc = address;
             return 24;
         }
         return 12; // CALL NZ, a16
     case 0xC5:
-        memory->Write(registers->sp--, registers->b);
-        memory->Write(registers->sp--, registers->c);
+        memory->Idle();
+        memory->PushWord(registers->sp, registers->bc);
         return 16; // PUSH BC
     case 0xC6:
-        Add(memory->Read(registers->pc++));
+        Add(memory->ReadImm8(registers->pc));
         return 8; // ADD A, d8
     case 0xC7:
-        memory->Write(registers->sp--, (registers->pc >> 8) & 0xFF);
-        memory->Write(registers->sp--, registers->pc & 0xFF);
-
+        memory->Idle();
+        memory->PushWord(registers->sp, registers->pc);
         registers->pc = 0x0000;
         return 16; // RST 00H
     case 0xC8:
+        memory->Idle();
         if (registers->IsFlagSet(Flag::Z))
         {
-            registers->pc = memory->Read(registers->sp++);
-            registers->pc |= memory->Read(registers->sp++) << 8;
+            registers->pc = memory->PopWord(registers->sp);
+            memory->Idle();
             return 20;
         }
         return 8; // RET Z
     case 0xC9:
-        registers->pc = memory->Read(registers->sp++);
-        registers->pc |= memory->Read(registers->sp++) << 8;
+        registers->pc = memory->PopWord(registers->sp);
+        memory->Idle();
         return 16; // RET
     case 0xCA:
-        low = memory->Read(registers->pc++);
-        high = memory->Read(registers->pc++);
-        address = (high << 8) | low;
+        address = memory->ReadImm16(registers->pc);
         if (registers->IsFlagSet(Flag::Z))
         {
+            memory->Idle();
             registers->pc = address;
             return 16;
         }
         return 12; // JP Z, a16
     case 0xCB:
-        opcode = memory->Read(registers->pc++);
+        opcode = memory->ReadImm8(registers->pc);
         return ExecuteCB(opcode); // PREFIX CB
     case 0xCC:
-        low = memory->Read(registers->pc++);
-        high = memory->Read(registers->pc++);
-        address = (high << 8) | low;
+        address = memory->ReadImm16(registers->pc);
         if (registers->IsFlagSet(Flag::Z))
         {
-            memory->Write(registers->sp--, (registers->pc >> 8) & 0xFF);
-            memory->Write(registers->sp--, registers->pc & 0xFF);
+            memory->Idle();
+            memory->PushWord(registers->sp, registers->pc);
             registers->pc = address;
             return 24;
         }
         return 12; // CALL Z, a16
     case 0xCD:
-        low = memory->Read(registers->pc++);
-        high = memory->Read(registers->pc++);
-        address = (high << 8) | low;
-        memory->Write(registers->sp--, (registers->pc >> 8) & 0xFF);
-        memory->Write(registers->sp--, registers->pc & 0xFF);
+        address = memory->ReadImm16(registers->pc);
+        memory->Idle();
+        memory->PushWord(registers->sp, registers->pc);
         registers->pc = address;
         return 24; // CALL a16
     case 0xCE:
-        Adc(memory->Read(registers->pc++));
+        Adc(memory->ReadImm8(registers->pc));
         return 8; // ADC A, d8
     case 0xCF:
-        memory->Write(registers->sp--, (registers->pc >> 8) & 0xFF);
-        memory->Write(registers->sp--, registers->pc & 0xFF);
+        memory->Idle();
+        memory->PushWord(registers->sp, registers->pc);
         registers->pc = 0x0008;
         return 16; // RST 08H
     case 0xD0:
+        memory->Idle();
         if (!registers->IsFlagSet(Flag::C))
         {
-            registers->pc = memory->Read(registers->sp++);
-            registers->pc |= memory->Read(registers->sp++) << 8;
+            registers->pc = memory->PopWord(registers->sp);
+            memory->Idle();
             return 20;
         }
         return 8; // RET NC
     case 0xD1:
-        registers->e = memory->Read(registers->sp++);
-        registers->d = memory->Read(registers->sp++);
+        registers->de = memory->PopWord(registers->sp);
         return 12; // POP DE
     case 0xD2:
-        low = memory->Read(registers->pc++);
-        high = memory->Read(registers->pc++);
-        address = (high << 8) | low;
+        address = memory->ReadImm16(registers->pc);
         if (!registers->IsFlagSet(Flag::C))
         {
+            memory->Idle();
             registers->pc = address;
             return 16;
         }
         return 12; // JP NC, a16
     case 0xD4:
-        low = memory->Read(registers->pc++);
-        high = memory->Read(registers->pc++);
-        address = (high << 8) | low;
+        address = memory->ReadImm16(registers->pc);
         if (!registers->IsFlagSet(Flag::C))
         {
-            memory->Write(registers->sp--, (registers->pc >> 8) & 0xFF);
-            memory->Write(registers->sp--, registers->pc & 0xFF);
+            memory->Idle();
+            memory->PushWord(registers->sp, registers->pc);
             registers->pc = address;
             return 24;
         }
         return 12; // CALL NC, a16
     case 0xD5:
-        memory->Write(registers->sp--, registers->d);
-        memory->Write(registers->sp--, registers->e);
+        memory->Idle();
+        memory->PushWord(registers->sp, registers->de);
         return 16; // PUSH DE
     case 0xD6:
-        Sub(memory->Read(registers->pc++));
+        Sub(memory->ReadImm8(registers->pc));
         return 8; // SUB d8
     case 0xD7:
-        memory->Write(registers->sp--, (registers->pc >> 8) & 0xFF);
-        memory->Write(registers->sp--, registers->pc & 0xFF);
+        memory->Idle();
+        memory->PushWord(registers->sp, registers->pc);
         registers->pc = 0x0010;
         return 16; // RST 10H
     case 0xD8:
+        memory->Idle();
         if (registers->IsFlagSet(Flag::C))
         {
-            registers->pc = memory->Read(registers->sp++);
-            registers->pc |= memory->Read(registers->sp++) << 8;
+            registers->pc = memory->PopWord(registers->sp);
+            memory->Idle();
             return 20;
         }
         return 8; // RET C
     case 0xD9:
-        registers->pc = memory->Read(registers->sp++);
-        registers->pc |= memory->Read(registers->sp++) << 8;
-        enableInterruptsNextInstruction = true;
+        registers->pc = memory->PopWord(registers->sp);
+        memory->Idle();
+        interrupts->SetIME(true);
         return 16; // RETI
     case 0xDA:
-        low = memory->Read(registers->pc++);
-        high = memory->Read(registers->pc++);
-        address = (high << 8) | low;
+        address = memory->ReadImm16(registers->pc);
         if (registers->IsFlagSet(Flag::C))
         {
+            memory->Idle();
             registers->pc = address;
             return 16;
         }
         return 12; // JP C, a16
     case 0xDC:
-        low = memory->Read(registers->pc++);
-        high = memory->Read(registers->pc++);
-        address = (high << 8) | low;
+        address = memory->ReadImm16(registers->pc);
         if (registers->IsFlagSet(Flag::C))
         {
-            memory->Write(registers->sp--, (registers->pc >> 8) & 0xFF);
-            memory->Write(registers->sp--, registers->pc & 0xFF);
+            memory->Idle();
+            memory->PushWord(registers->sp, registers->pc);
             registers->pc = address;
             return 24;
         }
         return 12; // CALL C, a16
     case 0xDE:
-        Sbc(memory->Read(registers->pc++));
+        Sbc(memory->ReadImm8(registers->pc));
         return 8; // SBC A, d8
     case 0xDF:
-        memory->Write(registers->sp--, (registers->pc >> 8) & 0xFF);
-        memory->Write(registers->sp--, registers->pc & 0xFF);
+        memory->Idle();
+        memory->PushWord(registers->sp, registers->pc);
         registers->pc = 0x0018;
         return 16; // RST 18H
     case 0xE0:
-        address = 0xFF00 + memory->Read(registers->pc++);
-        memory->Write(address, registers->a);
+        memory->WriteHRAM(memory->ReadImm8(registers->pc), registers->a);
         return 12; // LDH (a8),A
     case 0xE1:
-        registers->l = memory->Read(registers->sp++);
-        registers->h = memory->Read(registers->sp++);
+        registers->hl = memory->PopWord(registers->sp);
         return 12; // POP HL
     case 0xE2:
-        memory->Write(0xFF00 + registers->c, registers->a);
+        memory->WriteHRAM(registers->c, registers->a);
         return 8; // LD (C),A
     case 0xE5:
-        memory->Write(registers->sp--, registers->h);
-        memory->Write(registers->sp--, registers->l);
+        memory->Idle();
+        memory->PushWord(registers->sp, registers->hl);
         return 16; // PUSH HL
     case 0xE6:
-        And(memory->Read(registers->pc++));
+        And(memory->ReadImm8(registers->pc));
         return 8; // AND d8
     case 0xE7:
-        memory->Write(registers->sp--, (registers->pc >> 8) & 0xFF);
-        memory->Write(registers->sp--, registers->pc & 0xFF);
+        memory->Idle();
+        memory->PushWord(registers->sp, registers->pc);
         registers->pc = 0x0020;
         return 16; // RST 20H
     case 0xE8:
-        offset = static_cast<int8_t>(memory->Read(registers->pc++));
+        offset = static_cast<int8_t>(memory->ReadImm8(registers->pc));
+        memory->Idle();
+        memory->Idle();
+        AddSPFlags(offset);
         registers->sp += offset;
-        registers->WriteFlag(Flag::Z, false);
-        registers->WriteFlag(Flag::N, false);
-        registers->WriteFlag(Flag::H, ((registers->sp & 0xFFF) + (offset & 0xFFF)) > 0xFFF);
-        registers->WriteFlag(Flag::C, (registers->sp & 0xFF00) != (registers->hl & 0xFF00));
 
         return 16; // ADD SP, r8
     case 0xE9:
         registers->pc = registers->hl;
         return 4; // JP (HL)
     case 0xEA:
-        low = memory->Read(registers->pc++);
-        high = memory->Read(registers->pc++);
-        address = (high << 8) | low;
+        address = memory->ReadImm16(registers->pc);
         memory->Write(address, registers->a);
         return 16; // LD (a16),A
     case 0xEE:
-        Xor(memory->Read(registers->pc++));
+        Xor(memory->ReadImm8(registers->pc));
         return 8; // XOR d8
     case 0xEF:
-        memory->Write(registers->sp--, (registers->pc >> 8) & 0xFF);
-        memory->Write(registers->sp--, registers->pc & 0xFF);
+        memory->Idle();
+        memory->PushWord(registers->sp, registers->pc);
         registers->pc = 0x0028;
         return 16; // RST 28H
     case 0xF0:
-        address = 0xFF00 + memory->Read(registers->pc++);
-        registers->a = memory->Read(address);
+        registers->a = memory->ReadHRAM(memory->ReadImm8(registers->pc));
         return 12; // LDH A,(a8)
     case 0xF1:
-        registers->f = memory->Read(registers->sp++);
-        registers->a = memory->Read(registers->sp++);
+        // The low nibble of F doesn't exist
+        registers->af = memory->PopWord(registers->sp) & 0xFFF0;
         return 12; // POP AF
     case 0xF2:
-        registers->a = memory->Read(0xFF00 + registers->c);
+        registers->a = memory->ReadHRAM(registers->c);
         return 8; // LD A,(C)
     case 0xF3:
-        enableInterruptsNextInstruction = false;
+        interrupts->SetIME(false);
         return 4; // DI
     case 0xF5:
-        memory->Write(registers->sp--, registers->a);
-        memory->Write(registers->sp--, registers->f);
+        memory->Idle();
+        memory->PushWord(registers->sp, registers->af);
         return 16; // PUSH AF
     case 0xF6:
-        Or(memory->Read(registers->pc++));
+        Or(memory->ReadImm8(registers->pc));
         return 8; // OR d8
     case 0xF7:
-        memory->Write(registers->sp--, (registers->pc >> 8) & 0xFF);
-        memory->Write(registers->sp--, registers->pc & 0xFF);
+        memory->Idle();
+        memory->PushWord(registers->sp, registers->pc);
         registers->pc = 0x0030;
         return 16; // RST 30H
     case 0xF8:
-        offset = static_cast<int8_t>(memory->Read(registers->pc++));
+        offset = static_cast<int8_t>(memory->ReadImm8(registers->pc));
+        memory->Idle();
+        AddSPFlags(offset);
         registers->hl = registers->sp + offset;
-        registers->WriteFlag(Flag::N, false);
-        registers->WriteFlag(Flag::H, ((registers->sp & 0xFFF) + (offset & 0xFFF)) > 0xFFF);
-        registers->WriteFlag(Flag::C, (registers->sp & 0xFF00) != (registers->hl & 0xFF00));
         return 12; // LD HL,SP+r8
     case 0xF9:
         registers->sp = registers->hl;
+        memory->Idle();
         return 8; // LD SP,HL
     case 0xFA:
-        low = memory->Read(registers->pc++);
-        high = memory->Read(registers->pc++);
-        address = (high << 8) | low;
+        address = memory->ReadImm16(registers->pc);
         registers->a = memory->Read(address);
         return 16; // LD A,(a16)
     case 0xFB:
-        enableInterruptsNextInstruction = true;
+        interrupts->EnableAfterNextInstruction();
         return 4; // EI
     case 0xFE:
-        Cp(memory->Read(registers->pc++));
+        Cp(memory->ReadImm8(registers->pc));
         return 8; // CP d8
     case 0xFF:
-        memory->Write(registers->sp--, (registers->pc >> 8) & 0xFF);
-        memory->Write(registers->sp--, registers->pc & 0xFF);
+        memory->Idle();
+        memory->PushWord(registers->sp, registers->pc);
         registers->pc = 0x0038;
         return 16; // RST 38H
     case 0xD3:
@@ -980,9 +982,11 @@ int CPU::Execute(uint8_t opcode)
     return 0; // Default return value
 }
 
-int CPU::ExecuteCB(uint8_t opcode)
+template <typename Bus>
+int CPU<Bus>::ExecuteCB(uint8_t opcode)
 {
     uint8_t value;
+    lastOpcodeCB = opcode;
 
     switch (opcode)
     {
@@ -1817,7 +1821,30 @@ int CPU::ExecuteCB(uint8_t opcode)
     }
 }
 
-void CPU::Add(uint8_t value)
+uint32_t CPUBase::CoverageLocation(uint16_t pc) const
+{
+    uint32_t location = (pc >= 0x4000 && pc < 0x8000 ? state->romBank << 16 : 0) | pc;
+    return (location * 0x9E3779B1u) >> 16;
+}
+
+void CPUBase::CoverLoop(uint16_t start, uint16_t jump, uint32_t iterations)
+{
+    // Every pass takes the same edges, from the JR back to the start and
+    // then through the single byte body
+    uint32_t previous = previousLocation;
+    for (uint16_t pc = start;; pc++)
+    {
+        uint32_t location = CoverageLocation(pc);
+        uint32_t edge = (location ^ previous) & 0xFFFF;
+        coverage[edge] += iterations;
+        coveragePath += iterations * ((edge | 0x10000) * 0x9E3779B97F4A7C15ull);
+        previous = location >> 1;
+        if (pc == jump)
+            break;
+    }
+}
+
+void CPUBase::Add(uint8_t value)
 {
     uint16_t result = registers->a + value;
 
@@ -1829,7 +1856,7 @@ void CPU::Add(uint8_t value)
     registers->a = result & 0xFF;
 }
 
-void CPU::AddHL(uint16_t value)
+void CPUBase::AddHL(uint16_t value)
 {
     uint32_t result = registers->hl + value;
 
@@ -1840,7 +1867,7 @@ void CPU::AddHL(uint16_t value)
     registers->hl = result & 0xFFFF;
 }
 
-void CPU::Adc(uint8_t value)
+void CPUBase::Adc(uint8_t value)
 {
     bool carry = registers->IsFlagSet(Flag::C);
     uint16_t result = registers->a + value + carry;
@@ -1853,7 +1880,7 @@ void CPU::Adc(uint8_t value)
     registers->a = result & 0xFF;
 }
 
-void CPU::Sub(uint8_t value)
+void CPUBase::Sub(uint8_t value)
 {
     uint16_t result = registers->a - value;
 
@@ -1865,21 +1892,30 @@ void CPU::Sub(uint8_t value)
     registers->a = result & 0xFF;
 }
 
-void CPU::Sbc(uint8_t value)
+void CPUBase::Sbc(uint8_t value)
 {
     bool carry = registers->IsFlagSet(Flag::C);
-    uint8_t thatValueWithCarry = value + carry;
     uint16_t result = registers->a - value - carry;
 
     registers->WriteFlag(Flag::Z, (result & 0xFF) == 0);
     registers->WriteFlag(Flag::N, true);
-    registers->WriteFlag(Flag::H, (registers->a & 0xF) < (thatValueWithCarry & 0xF));
-    registers->WriteFlag(Flag::C, thatValueWithCarry > registers->a);
+    registers->WriteFlag(Flag::H, (registers->a & 0xF) < (value & 0xF) + carry);
+    registers->WriteFlag(Flag::C, registers->a < value + carry);
 
     registers->a = result & 0xFF;
 }
 
-void CPU::Inc(uint8_t &value)
+// ADD SP,e and LD HL,SP+e carry out of the low byte, as an 8-bit add would
+void CPUBase::AddSPFlags(int8_t offset)
+{
+    uint8_t low = offset;
+    registers->WriteFlag(Flag::Z, false);
+    registers->WriteFlag(Flag::N, false);
+    registers->WriteFlag(Flag::H, ((registers->sp & 0xF) + (low & 0xF)) > 0xF);
+    registers->WriteFlag(Flag::C, ((registers->sp & 0xFF) + low) > 0xFF);
+}
+
+void CPUBase::Inc(uint8_t &value)
 {
     registers->WriteFlag(Flag::H, ((value & 0x0F) == 0x0F));
 
@@ -1888,7 +1924,7 @@ void CPU::Inc(uint8_t &value)
     registers->WriteFlag(Flag::N, false);
 }
 
-void CPU::Dec(uint8_t &value)
+void CPUBase::Dec(uint8_t &value)
 {
     registers->WriteFlag(Flag::H, (value & 0xF) == 0);
 
@@ -1897,7 +1933,7 @@ void CPU::Dec(uint8_t &value)
     registers->WriteFlag(Flag::N, true);
 }
 
-void CPU::And(uint8_t value)
+void CPUBase::And(uint8_t value)
 {
     registers->a &= value;
     registers->WriteFlag(Flag::Z, registers->a == 0);
@@ -1906,7 +1942,7 @@ void CPU::And(uint8_t value)
     registers->WriteFlag(Flag::C, false);
 }
 
-void CPU::Or(uint8_t value)
+void CPUBase::Or(uint8_t value)
 {
     registers->a |= value;
     registers->WriteFlag(Flag::Z, registers->a == 0);
@@ -1915,7 +1951,7 @@ void CPU::Or(uint8_t value)
     registers->WriteFlag(Flag::C, false);
 }
 
-void CPU::Xor(uint8_t value)
+void CPUBase::Xor(uint8_t value)
 {
     registers->a ^= value;
     registers->WriteFlag(Flag::Z, registers->a == 0);
@@ -1924,7 +1960,7 @@ void CPU::Xor(uint8_t value)
     registers->WriteFlag(Flag::C, false);
 }
 
-void CPU::Cp(uint8_t value)
+void CPUBase::Cp(uint8_t value)
 {
     uint8_t a = registers->a;
 
@@ -1934,69 +1970,57 @@ void CPU::Cp(uint8_t value)
     registers->WriteFlag(Flag::C, a < value);
 }
 
-void CPU::Rl(uint8_t &value, bool isPrefixCB)
+void CPUBase::Rl(uint8_t &value, bool isPrefixCB)
 {
     bool isLastBit = (value & 0x80) != 0;
     value <<= 1;
     value |= registers->IsFlagSet(Flag::C);
 
-    if (isPrefixCB)
-    {
-        registers->WriteFlag(Flag::Z, value == 0);
-    }
+    registers->WriteFlag(Flag::Z, isPrefixCB && value == 0);
 
     registers->WriteFlag(Flag::N, false);
     registers->WriteFlag(Flag::H, false);
     registers->WriteFlag(Flag::C, isLastBit);
 }
 
-void CPU::Rlc(uint8_t &value, bool isPrefixCB)
+void CPUBase::Rlc(uint8_t &value, bool isPrefixCB)
 {
     bool isLastBit = (value & 0x80) != 0;
     value = (value << 1) | (value >> 7);
 
-    if (isPrefixCB)
-    {
-        registers->WriteFlag(Flag::Z, value == 0);
-    }
+    registers->WriteFlag(Flag::Z, isPrefixCB && value == 0);
 
     registers->WriteFlag(Flag::N, false);
     registers->WriteFlag(Flag::H, false);
     registers->WriteFlag(Flag::C, isLastBit);
 }
 
-void CPU::Rr(uint8_t &value, bool isPrefixCB)
+void CPUBase::Rr(uint8_t &value, bool isPrefixCB)
 {
     bool isLastBit = (value & 0x1) != 0;
     value >>= 1;
-    value |= registers->IsFlagSet(Flag::C);
+    value |= registers->IsFlagSet(Flag::C) << 7;
 
-    if (isPrefixCB)
-    {
-        registers->WriteFlag(Flag::Z, value == 0);
-    }
+    registers->WriteFlag(Flag::Z, isPrefixCB && value == 0);
 
     registers->WriteFlag(Flag::N, false);
     registers->WriteFlag(Flag::H, false);
     registers->WriteFlag(Flag::C, isLastBit);
 }
 
-void CPU::Rrc(uint8_t &value, bool isPrefixCB)
+void CPUBase::Rrc(uint8_t &value, bool isPrefixCB)
 {
     bool isLastBit = (value & 0x1) != 0;
     value = (value >> 1) | (value << 7);
 
-    if (isPrefixCB)
-    {
-        registers->WriteFlag(Flag::Z, value == 0);
-    }
+    registers->WriteFlag(Flag::Z, isPrefixCB && value == 0);
 
     registers->WriteFlag(Flag::N, false);
     registers->WriteFlag(Flag::H, false);
     registers->WriteFlag(Flag::C, isLastBit);
 }
 
-void CPU::Sla(uint8_t &value)
+void CPUBase::Sla(uint8_t &value)
 {
     bool isLastBit = (value & 0x80) != 0;
     value <<= 1;
@@ -2007,13 +2031,11 @@ void CPU::Sla(uint8_t &value)
     registers->WriteFlag(Flag::C, isLastBit);
 }
 
-void CPU::Sra(uint8_t &value)
+void CPUBase::Sra(uint8_t &value)
 {
     bool bit0 = value & 0x01;
-    bool bit7 = value & 0x80;
 
-    value >>= 1;
-    value |= bit7;
+    value = (value >> 1) | (value & 0x80);
 
     registers->WriteFlag(Flag::Z, value == 0);
     registers->WriteFlag(Flag::N, false);
@@ -2021,7 +2043,7 @@ void CPU::Sra(uint8_t &value)
     registers->WriteFlag(Flag::C, bit0);
 }
 
-void CPU::Srl(uint8_t &value)
+void CPUBase::Srl(uint8_t &value)
 {
     bool bit0 = value & 0x01;
 
@@ -2033,7 +2055,7 @@ void CPU::Srl(uint8_t &value)
     registers->WriteFlag(Flag::C, bit0);
 }
 
-void CPU::Swap(uint8_t &value)
+void CPUBase::Swap(uint8_t &value)
 {
     value = (value << 4) | (value >> 4);
 
@@ -2043,95 +2065,250 @@ void CPU::Swap(uint8_t &value)
     registers->WriteFlag(Flag::C, false);
 }
 
-void CPU::Bit(uint8_t &value, uint8_t bit)
+void CPUBase::Bit(uint8_t &value, uint8_t bit)
 {
     registers->WriteFlag(Flag::Z, (value & bit) == 0);
     registers->WriteFlag(Flag::N, false);
     registers->WriteFlag(Flag::H, true);
 }
 
-void CPU::Res(uint8_t &value, uint8_t bit)
+void CPUBase::Res(uint8_t &value, uint8_t bit)
 {
     value &= ~bit;
 }
 
-void CPU::Set(uint8_t &value, uint8_t bit)
+void CPUBase::Set(uint8_t &value, uint8_t bit)
 {
     value |= bit;
 }
 
-void CPU::CheckInterrupts()
+template <typename Bus>
+int CPU<Bus>::CheckInterrupts()
 {
-    if (!ime)
-        return;
-
-    uint8_t ie = memory->Read(0xFFFF);
-    uint8_t iflag = memory->Read(0xFF0F);
-
-    uint8_t interrupts = ie & iflag & 0x1F;
+    uint8_t pending = interrupts->Pending();
 
-    if (interrupts == 0)
-        return;
+    // HALT ends as soon as anything is pending, whatever IME says
+    if (state->isHalted)
+    {
+        if (!pending)
+            return 4;
+        state->isHalted = false;
+    }
 
-    ime = false;
-    isHalted = false;
+    if (state->ime && pending)
+    {
+        state->ime = false;
+
+        // Two idle M-cycles, the pushes, then one more while PC is loaded
+        memory->Idle();
+        memory->Idle();
+        memory->PushWord(registers->sp, registers->pc);
+        memory->Idle();
+
+        // Lowest bit wins, vectors are 0x40, 0x48, ... 0x60
+        int index = 0;
+        while (!(pending & (1 << index)))
+            index++;
+        registers->pc = 0x0040 + index * 8;
+        interrupts->Acknowledge(1 << index);
+
+#ifdef SIGMABOY_PROFILER
+        if (profiler)
+            profiler->EnterInterrupt(registers->pc, registers->sp);
+#endif
+
+        timeline.Emulated("Interrupt", TRACK_INTERRUPTS, registers->pc);
+        return 20;
+    }
 
-    memory->Write(--registers->sp, (registers->pc >> 8) & 0xFF);
-    memory->Write(--registers->sp, registers->pc & 0xFF);
+    // EI from the previous instruction
+    if (state->enableInterruptsNextInstruction)
+    {
+        state->ime = true;
+        state->enableInterruptsNextInstruction = false;
+    }
 
-    if (interrupts & 0x01)
+    // HALT bug: the byte after HALT runs twice because PC isn't advanced
+    if (state->haltBug)
     {
-        registers->pc = 0x0040;
-        memory->Write(0xFF0F, iflag & ~0x01);
+        state->haltBug = false;
+        interrupts->UpdateAttention();
+        return Execute(memory->Read(registers->pc));
     }
-    else if (interrupts & 0x02)
+
+    interrupts->UpdateAttention();
+    return 0;
+}
+
+template <typename Bus>
+int CPU<Bus>::Step()
+{
+    // Timed accesses move the clock along as they go, the instruction's
+    // total still decides where it ends up. The PPU runs at half the CPU's
+    // pace in double speed.
+    uint64_t start = state->cycles;
+
+    // One flag covers dispatch, HALT, the EI delay and the HALT bug
+    if (state->interruptAttention)
     {
-        registers->pc = 0x0048;
-        memory->Write(0xFF0F, iflag & ~0x02);
+        int cycles = CheckInterrupts();
+        if (cycles)
+        {
+            state->cycles = start + (cycles >> state->doubleSpeed);
+            return cycles;
+        }
     }
-    else if (interrupts & 0x04)
+
+#ifdef SIGMABOY_PROFILER
+    uint16_t pc = registers->pc;
+    uint16_t sp = registers->sp;
+#endif
+
+    if (debugger)
     {
-        registers->pc = 0x0050;
-        memory->Write(0xFF0F, iflag & ~0x04);
+        if (debugger->IsWatched(registers->pc, WATCH_EXEC) && debugger->CheckBreakpoint(registers->pc))
+            return 0;
     }
-    else if (interrupts & 0x08)
+
+    if (coverage)
     {
-        registers->pc = 0x0058;
-        memory->Write(0xFF0F, iflag & ~0x08);
+        // AFL-style edges between consecutive (bank, PC) locations
+        uint32_t location = CoverageLocation(registers->pc);
+        uint32_t edge = (location ^ previousLocation) & 0xFFFF;
+        coverage[edge]++;
+        coveragePath += (edge | 0x10000) * 0x9E3779B97F4A7C15ull;
+        previousLocation = location >> 1;
     }
-    else if (interrupts & 0x10)
+
+    uint8_t opcode = memory->ReadImm8(registers->pc);
+
+    if (debugger && debugger->trace)
+        printf("PC: %04X, Opcode: %02X\n", registers->pc - 1, opcode);
+
+    int instructionCycles = Execute(opcode);
+    state->cycles = start + (instructionCycles >> state->doubleSpeed);
+
+#ifdef SIGMABOY_PROFILER
+    if (profiler)
     {
-        registers->pc = 0x0060;
-        memory->Write(0xFF0F, iflag & ~0x10);
+        profiler->Record(pc, opcode == 0xCB ? 0x100 | lastOpcodeCB : opcode, instructionCycles);
+        profiler->TrackCalls(opcode, instructionCycles, sp, registers->pc, registers->sp);
     }
+#endif
+
+    return instructionCycles;
 }
 
-int CPU::Step()
+static bool TouchesVram(uint16_t start, uint32_t count, int step)
 {
-    if (isHalted)
+    int64_t end = start + static_cast<int64_t>(count - 1) * step;
+    return std::min<int64_t>(start, end) <= 0x9FFF && std::max<int64_t>(start, end) >= 0x8000;
+}
+
+static int64_t CyclesUntil(uint64_t now, uint64_t event)
+{
+    if (event <= now)
+        return 0;
+    return static_cast<int64_t>(std::min<uint64_t>(event - now, INT32_MAX));
+}
+
+template <typename Bus>
+int CPU<Bus>::RunLoop(uint16_t start, uint16_t jump)
+{
+    int length = jump + 2 - start;
+    if (!bulkLoops || length > LoopSignature::MAX_LENGTH || debugger || state->interruptAttention)
+        return 0;
+#ifdef SIGMABOY_PROFILER
+    if (profiler)
+        return 0;
+#endif
+
+    uint8_t code[LoopSignature::MAX_LENGTH];
+    for (int i = 0; i < length; i++)
+        code[i] = memory->Peek(start + i);
+    const LoopSignature *loop = FindLoop(code, length);
+    if (!loop)
+        return 0;
+
+    // Passes the loop still has to make, the counter is decremented first
+    uint32_t remaining;
+    if (loop->counter == LoopCounter::BC)
+        remaining = registers->bc ? registers->bc : 0x10000;
+    else
     {
-        uint8_t ie = memory->Read(0xFFFF);
-        uint8_t iflag = memory->Read(0xFF0F);
-        if (ie & iflag & 0x1F)
-        {
-            isHalted = false;
-        }
-        else
-        {
-            cycles += 4;
-            return 4;
-        }
+        uint8_t counter = loop->counter == LoopCounter::B ? registers->b : registers->c;
+        remaining = counter ? counter : 0x100;
     }
 
-    uint8_t opcode = memory->Read(registers->pc++);
-    int instructionCycles = Execute(opcode);
-    cycles += instructionCycles;
+    bool copy = loop->kind == LoopKind::COPY_HL_TO_DE || loop->kind == LoopKind::COPY_DE_TO_HL;
+    uint16_t source = loop->kind == LoopKind::COPY_HL_TO_DE ? registers->hl : registers->de;
+    uint16_t destination = loop->kind == LoopKind::COPY_HL_TO_DE ? registers->de : registers->hl;
+    bool vram = TouchesVram(destination, remaining, loop->step) || (copy && TouchesVram(source, remaining, loop->step));
+    if (vram && state->ppuMode == 3)
+        return 0;
+
+    // Events the program can't observe are simply caught up afterwards.
+    // This JR's own 12 cycles come first. The budget is in CPU cycles, twice
+    // the PPU's in double speed.
+    int speed = state->doubleSpeed;
+    int64_t budget = BULK_HORIZON_CYCLES;
+    if (state->ime && (state->ie & (INTERRUPT_VBLANK | INTERRUPT_STAT)))
+        budget = std::min(budget, (CyclesUntil(state->cycles, PPUBase::NextInterruptEvent(state)) << speed) - 12);
+    // HBlank DMA copies at mode 0, ordered against the loop's accesses like VRAM
+    if ((vram || state->hdmaActive) && (state->io[0x40] & 0x80))
+        budget = std::min(budget, (CyclesUntil(state->cycles, state->ppuNextEvent) << speed) - 12);
+    int iterationCycles = loop->bodyCycles + 12;
+    int64_t iterations = std::min<int64_t>(remaining - 1, budget / iterationCycles);
+    if (iterations < MIN_BULK_ITERATIONS)
+        return 0;
+
+    int count = static_cast<int>(iterations);
+    if (!memory->IsPlainRun(destination, count, loop->step, true) || (copy && !memory->IsPlainRun(source, count, loop->step, false)))
+        return 0;
 
-    if (enableInterruptsNextInstruction)
+    // Code in RAM must not be overwritten under the loop
+    if (start >= 0x8000)
     {
-        ime = true;
-        enableInterruptsNextInstruction = false;
+        uint16_t first = loop->step > 0 ? destination : destination - (count - 1);
+        uint16_t last = first + count - 1;
+        if (first <= jump + 1 && last >= start)
+            return 0;
     }
 
-    return instructionCycles;
-}
\ No newline at end of file
+    if (copy)
+        registers->a = memory->CopyRun(destination, source, count, loop->step);
+    else
+        memory->FillRun(destination, loop->kind == LoopKind::CLEAR ? 0 : registers->a, count, loop->step);
+
+    uint16_t advance = count * loop->step;
+    registers->hl += advance;
+    if (copy)
+        registers->de += advance;
+
+    // The last pass's flag-setting instructions, through the real ALU
+    switch (loop->counter)
+    {
+    case LoopCounter::B:
+        registers->b -= count - 1;
+        Dec(registers->b);
+        break;
+    case LoopCounter::C:
+        registers->c -= count - 1;
+        Dec(registers->c);
+        break;
+    case LoopCounter::BC:
+        registers->bc -= count;
+        registers->a = registers->b;
+        Or(registers->c);
+        break;
+    }
+
+    if (coverage)
+        CoverLoop(start, jump, count);
+
+    return count * iterationCycles;
+}
+
+template class CPU<MMU<FastCore>>;
+template class CPU<MMU<AccurateCore>>;
+template class CPU<FlatBus>;
@@ -0,0 +1,120 @@
+#include "debugger.h"
+#include "cpu.h"
+#include "mmu.h"
+#include <algorithm>
+#include <cstdio>
+
+Debugger::Debugger(Status *status) : status(status) {}
+
+void Debugger::Attach(CPUBase *cpu, MMUBase *memory)
+{
+    this->cpu = cpu;
+    this->memory = memory;
+    resumeAt = -1;
+    Rebuild();
+}
+
+void Debugger::AddBreakpoint(uint16_t address)
+{
+    breakpoints.insert(address);
+    Rebuild();
+}
+
+void Debugger::RemoveBreakpoint(uint16_t address)
+{
+    breakpoints.erase(address);
+    Rebuild();
+}
+
+void Debugger::AddWatchpoint(uint16_t start, uint16_t end, uint8_t kind)
+{
+    watchpoints.push_back({start, end, kind});
+    Rebuild();
+}
+
+void Debugger::RemoveWatchpoint(uint16_t start, uint16_t end)
+{
+    watchpoints.erase(std::remove_if(watchpoints.begin(), watchpoints.end(), [&](const Watchpoint &watch)
+                                     { return watch.start == start && watch.end == end; }),
+                      watchpoints.end());
+    Rebuild();
+}
+
+void Debugger::Clear()
+{
+    breakpoints.clear();
+    watchpoints.clear();
+    Rebuild();
+}
+
+void Debugger::SetTrace(bool enabled)
+{
+    trace = enabled;
+    Rebuild();
+}
+
+void Debugger::Rebuild()
+{
+    std::fill(std::begin(pageFlags), std::end(pageFlags), 0);
+
+    for (uint16_t address : breakpoints)
+        pageFlags[address >> 8] |= WATCH_EXEC;
+
+    for (const Watchpoint &watch : watchpoints)
+    {
+        for (int page = watch.start >> 8; page <= watch.end >> 8; page++)
+            pageFlags[page] |= watch.kind;
+    }
+
+    // Only hand ourselves to the hot path while there is something to check
+    bool armed = trace || !breakpoints.empty() || !watchpoints.empty();
+    if (cpu)
+        cpu->debugger = armed ? this : nullptr;
+    if (memory)
+        memory->debugger = armed && !watchpoints.empty() ? this : nullptr;
+}
+
+bool Debugger::CheckBreakpoint(uint16_t pc)
+{
+    if (!breakpoints.count(pc))
+        return false;
+
+    if (resumeAt == pc)
+    {
+        resumeAt = -1;
+        return false;
+    }
+
+    printf("Breakpoint at %04X\n", pc);
+    resumeAt = pc;
+    status->isPaused = true;
+    return true;
+}
+
+bool Debugger::Matches(uint16_t address, uint8_t kind) const
+{
+    for (const Watchpoint &watch : watchpoints)
+    {
+        if ((watch.kind & kind) && address >= watch.start && address <= watch.end)
+            return true;
+    }
+    return false;
+}
+
+void Debugger::CheckRead(uint16_t address)
+{
+    if (!Matches(address, WATCH_READ))
+        return;
+
+    printf("Watchpoint read %04X at PC %04X\n", address, cpu ? cpu->registers->pc : 0);
+    status->isPaused = true;
+}
+
+void Debugger::CheckWrite(uint16_t address, uint8_t value)
+{
+    if (!Matches(address, WATCH_WRITE))
+        return;
+
+    printf("Watchpoint write %04X = %02X at PC %04X\n", address, value, cpu ? cpu->registers->pc : 0);
+    status->isPaused = true;
+}
@@ -1,8 +1,12 @@
 #include "emulator.h"
+#include "perf.h"
+#include "timeline.h"
+#include <algorithm>
+#include <cstring>
 #include <iostream>
 #include <string>
 
-Emulator::Emulator() : window(nullptr), renderer(nullptr), screen(nullptr), isEmulatorWindowOpen(false), cartridge(nullptr), memory(nullptr), cpu(nullptr), ppu(nullptr) {}
+Emulator::Emulator() : window(nullptr), renderer(nullptr), screen(nullptr), texture(nullptr), isEmulatorWindowOpen(false), debugger(&status), cartridge(nullptr), machine(nullptr), runAheadState(nullptr) {}
 
 Emulator::~Emulator()
 {
@@ -11,7 +15,7 @@ Emulator::~Emulator()
 
 bool Emulator::ConfigureWindow()
 {
-    if (SDL_Init(SDL_INIT_VIDEO) < 0)
+    if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_GAMEPAD) < 0)
     {
         std::cout << "SDL could not initialize! SDL_Error: " << SDL_GetError() << std::endl;
         return false;
@@ -35,6 +39,17 @@ bool Emulator::ConfigureWindow()
         return false;
     }
 
+    texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, SCREEN_WIDTH, SCREEN_HEIGHT);
+    if (!texture)
+    {
+        std::cout << "Texture could not be created! SDL_Error: " << SDL_GetError() << std::endl;
+        return false;
+    }
+
+    // Nearest-neighbour, integer multiples of 160x144 only
+    SDL_SetTextureScaleMode(texture, SDL_SCALEMODE_NEAREST);
+    SDL_SetRenderLogicalPresentation(renderer, SCREEN_WIDTH, SCREEN_HEIGHT, SDL_LOGICAL_PRESENTATION_INTEGER_SCALE);
+
     return true;
 }
 
@@ -42,81 +57,309 @@ void Emulator::OnFileAdded(void *userdata, const char *const *filelist, int filt
 {
     if (filelist && filelist[0])
     {
-        std::string rom = filelist[0];
-        std::cout << "Loading ROM from: " << rom << std::endl;
-
+        // The dialog may call back from another thread, so only record the
+        // path here and let the main thread swap the hardware out
         Emulator *emulator = static_cast<Emulator *>(userdata);
-        Cartridge *cartridge = new Cartridge(rom);
-        emulator->LoadCartridge(cartridge);
+        emulator->QueueRom(filelist[0]);
     }
 }
 
-void Emulator::LoadCartridge(Cartridge *cartridge)
+void Emulator::QueueRom(const std::string &rom)
 {
-    // Cleanup previous components
-    if (cartridge)
+    std::lock_guard<std::mutex> lock(pendingRomMutex);
+    pendingRom = rom;
+}
+
+void Emulator::LoadPendingCartridge()
+{
+    std::string rom;
     {
-        delete this->cartridge;
-        this->cartridge = nullptr;
+        std::lock_guard<std::mutex> lock(pendingRomMutex);
+        rom.swap(pendingRom);
+    }
+
+    if (rom.empty())
+        return;
+
+    std::cout << "Loading ROM from: " << rom << std::endl;
+
+    try
+    {
+        LoadCartridge(new Cartridge(rom));
+    }
+    catch (const std::exception &e)
+    {
+        std::cout << "Could not load ROM: " << e.what() << std::endl;
     }
-    if (memory)
+}
+
+void Emulator::LoadCartridge(Cartridge *cartridge)
+{
+    StopEmulation();
+    FinishProfiling();
+    debugger.Attach(nullptr, nullptr);
+
+    // Cleanup previous components
+    if (runAheadState)
     {
-        delete memory;
-        memory = nullptr;
+        delete runAheadState;
+        runAheadState = nullptr;
     }
-    if (cpu)
+    if (machine)
     {
-        delete cpu;
-        cpu = nullptr;
+        delete machine;
+        machine = nullptr;
     }
-    if (ppu)
+    if (this->cartridge)
     {
-        delete ppu;
-        ppu = nullptr;
+        delete this->cartridge;
+        this->cartridge = nullptr;
     }
 
     this->cartridge = cartridge;
-    memory = new MMU(cartridge);
-    cpu = new CPU(memory, &registers);
-    ppu = new PPU(memory, renderer);
+    machine = Machine::Create(core, cartridge, &frames);
+    machine->pause = &status.isPaused;
+    runAheadState = machine->Fork();
+    machine->cpu->bulkLoops = runAheadState->cpu->bulkLoops = bulkLoops;
+    if (renderThread && std::thread::hardware_concurrency() > 2)
+        machine->ppu->renderer.StartThread();
+    debugger.Attach(machine->cpu, machine->memory);
+    timeline.SetClock(&machine->state->cycles);
+    StartProfiling();
 
     SDL_SetWindowTitle(window, cartridge->GetTitle().c_str());
 
     status.isRunning = true;
+    StartEmulation();
 }
 
-void Emulator::RunStep()
+int Emulator::RunFrame(bool draw)
 {
-    if (!status.isPaused || status.doStep)
+    TimelineSpan span("CPU batch");
+    machine->ppu->drawFrame = draw;
+
+    // Run up to the start of the next VBlank, so every hidden or shown frame
+    // is a whole frame from line 0 to 143. Pausing, breakpoints and
+    // watchpoints end it early through machine->pause.
+    RunResult result = machine->RunUntilVBlank();
+    status.doStep = false;
+
+    machine->ppu->drawFrame = true;
+    perfBatch.instructions += result.instructions;
+    perfBatch.cycles += result.cycles;
+    return static_cast<int>(result.cycles);
+}
+
+void Emulator::StartEmulation()
+{
+    if (isEmulationThreadRunning)
+        return;
+
+    isEmulationThreadRunning = true;
+    emulationThread = std::thread(&Emulator::EmulationLoop, this);
+}
+
+void Emulator::StopEmulation()
+{
+    isEmulationThreadRunning = false;
+    if (emulationThread.joinable())
     {
-        int cycle = cpu->Step();
-        cpu->CheckInterrupts();
+        emulationThread.join();
     }
+}
+
+void Emulator::EmulationLoop()
+{
+    const uint64_t frameDurationNs = static_cast<uint64_t>(frameDurationMs * 1000000.0);
+    timeline.NameThread("Emulation");
+
+    while (isEmulationThreadRunning)
+    {
+        if (!status.isRunning || (status.isPaused && !status.doStep))
+        {
+            SDL_Delay(1);
+            continue;
+        }
+
+        uint64_t frameStart = PerfCounters::Now();
+        uint64_t ppuStart = perfBatch.timerNs[TIMER_PPU];
+        machine->ppu->showPerfOverlay = status.showPerfOverlay;
+        machine->SetColorMode(status.colorMode);
 
-    ppu->Step(cpu->cycles);
+        machine->SetJoypad(joypad.GetButtons(), joypad.TakeInputTimestamp());
+
+        // Emulate one frame worth of cycles, frames are published by the PPU.
+        // Skipped frames keep exact timing but produce no pixels at all.
+        bool draw = ShouldDrawFrame(frameStart, frameDurationNs);
+        int runAhead = std::min<int>(status.runAhead, MAX_RUN_AHEAD);
+        if (runAhead == 0 || status.isPaused || !draw)
+        {
+            RunFrame(draw);
+            if (!draw)
+                perfBatch.framesSkipped++;
+        }
+        else
+        {
+            // Run-ahead: advance the real state by one hidden frame, then show
+            // the frame that is runAhead frames further along and roll back.
+            // Games that take a few frames to react to input appear to react
+            // on the very next one.
+            RunFrame(false);
+            runAheadState->CopyFrom(*machine);
+            for (int i = 1; i < runAhead; i++)
+                RunFrame(false);
+            RunFrame(true);
+            machine->CopyFrom(*runAheadState);
+        }
+
+        // CPU and PPU run interleaved, so CPU time is the frame minus scanline rendering
+        uint64_t elapsed = PerfCounters::Now() - frameStart;
+        perfBatch.timerNs[TIMER_CPU] += elapsed - (perfBatch.timerNs[TIMER_PPU] - ppuStart);
+        perf.RecordFrameTime(elapsed);
+        lastFrameNs = elapsed;
+
+        if (!status.isFastForward && elapsed < frameDurationNs)
+        {
+            PerfScope scope(TIMER_SLEEP);
+            TimelineSpan span("Pacing sleep");
+            SDL_DelayNS(frameDurationNs - elapsed);
+        }
+
+        perf.Flush();
+    }
 }
 
-void Emulator::Run()
+bool Emulator::ShouldDrawFrame(uint64_t now, uint64_t frameDurationNs)
 {
-    isEmulatorWindowOpen = true;
-    while (isEmulatorWindowOpen)
+    int frameSkip = status.frameSkip;
+    bool draw;
+    if (frameSkip == FRAME_SKIP_AUTO)
+    {
+        // Fast-forward: the display can't show more than one frame per refresh.
+        // Normal speed: skip while the last frame ran over its time budget.
+        if (status.isFastForward)
+            draw = now - lastDrawnFrame >= frameDurationNs;
+        else
+            draw = lastFrameNs <= frameDurationNs;
+        draw = draw || skippedFrames >= MAX_FRAME_SKIP;
+    }
+    else
+    {
+        draw = skippedFrames >= frameSkip;
+    }
+
+    if (draw)
+    {
+        skippedFrames = 0;
+        lastDrawnFrame = now;
+    }
+    else
     {
-        uint32_t frameStart = SDL_GetTicks();
+        skippedFrames++;
+    }
+    return draw;
+}
+
+void Emulator::StartProfiling()
+{
+#ifdef SIGMABOY_PROFILER
+    if (profilePath.empty())
+        return;
+
+    profiler = new Profiler(cartridge, machine->state);
+    if (!symbolPath.empty())
+        profiler->LoadSymbols(symbolPath);
+    machine->cpu->profiler = profiler;
+#endif
+}
+
+void Emulator::FinishProfiling()
+{
+#ifdef SIGMABOY_PROFILER
+    if (!profiler)
+        return;
+
+    profiler->WriteReport(profilePath + ".txt");
+    profiler->WriteCallgrind(profilePath + ".callgrind");
+    profiler->WriteFoldedStacks(profilePath + ".folded");
+
+    if (machine)
+        machine->cpu->profiler = nullptr;
+    delete profiler;
+    profiler = nullptr;
+#endif
+}
+
+void Emulator::Present()
+{
+    uint64_t inputTimestamp = 0;
+    const uint32_t *pixels = frames.AcquireLatest(&inputTimestamp);
+    if (!pixels)
+        return;
 
-        HandleEvents(); // Window inputs
+    PerfScope scope(TIMER_PRESENT);
+    TimelineSpan span("Present");
 
-        if (status.isRunning) // Emulator Running
+    // Single pass from the published frame into the texture memory
+    void *texturePixels;
+    int pitch;
+    if (SDL_LockTexture(texture, nullptr, &texturePixels, &pitch))
+    {
+        const int rowBytes = SCREEN_WIDTH * sizeof(uint32_t);
+        if (pitch == rowBytes)
+        {
+            std::memcpy(texturePixels, pixels, rowBytes * SCREEN_HEIGHT);
+        }
+        else
         {
-            this->RunStep();
+            uint8_t *row = static_cast<uint8_t *>(texturePixels);
+            for (int y = 0; y < SCREEN_HEIGHT; y++, row += pitch)
+            {
+                std::memcpy(row, pixels + y * SCREEN_WIDTH, rowBytes);
+            }
         }
+        SDL_UnlockTexture(texture);
+    }
+
+    SDL_RenderClear(renderer);
+    SDL_RenderTexture(renderer, texture, nullptr, nullptr);
 
-        uint32_t frameEnd = SDL_GetTicks();
-        uint32_t elapsed = frameEnd - frameStart;
-        if (elapsed < frameDurationMs)
+    TimelineSpan presentSpan("SDL_RenderPresent");
+    SDL_RenderPresent(renderer);
+
+    if (inputTimestamp)
+        perf.RecordInputLatency(PerfCounters::Now() - inputTimestamp);
+}
+
+void Emulator::Run()
+{
+    if (!timelinePath.empty())
+        timeline.Start(timelinePath);
+    timeline.NameThread("Main");
+
+    isEmulatorWindowOpen = true;
+    while (isEmulatorWindowOpen)
+    {
         {
-            uint32_t remaining = frameDurationMs - elapsed;
-            SDL_Delay(remaining);
+            TimelineSpan span("HandleEvents");
+            HandleEvents(); // Window inputs
         }
+        LoadPendingCartridge();
+
+        // Presentation never waits on the core, it just shows the newest frame
+        Present();
+        perf.Flush();
+        SDL_Delay(1);
+    }
+
+    StopEmulation();
+    timeline.Stop();
+
+    PerfSnapshot snapshot = perf.Snapshot();
+    if (snapshot.inputSamples)
+    {
+        std::cout << "Input latency over " << snapshot.inputSamples << " inputs: min " << snapshot.inputMinMs
+                  << " ms, mean " << snapshot.inputMeanMs << " ms, p99 " << snapshot.inputP99Ms << " ms" << std::endl;
     }
 }
 
@@ -125,11 +368,49 @@ void Emulator::HandleEvents()
     SDL_Event event;
     while (SDL_PollEvent(&event))
     {
+        if (joypad.HandleEvent(event))
+            continue;
+
         switch (event.type)
         {
         case SDL_EVENT_QUIT:
             isEmulatorWindowOpen = false;
             break;
+        case SDL_EVENT_KEY_DOWN:
+        case SDL_EVENT_KEY_UP:
+            if (event.key.key == SDLK_TAB) // Hold to fast-forward
+            {
+                status.isFastForward = event.type == SDL_EVENT_KEY_DOWN;
+            }
+            else if (event.type == SDL_EVENT_KEY_DOWN && event.key.key == SDLK_P) // Pause / resume
+            {
+                status.isPaused = !status.isPaused;
+            }
+            else if (event.type == SDL_EVENT_KEY_DOWN && event.key.key == SDLK_N) // Step one instruction
+            {
+                status.doStep = true;
+            }
+            else if (event.type == SDL_EVENT_KEY_DOWN && event.key.key == SDLK_F1) // Perf overlay
+            {
+                status.showPerfOverlay = !status.showPerfOverlay;
+            }
+            else if (event.type == SDL_EVENT_KEY_DOWN && event.key.key == SDLK_F2) // Perf snapshot
+            {
+                std::cout << perf.SnapshotJSON() << std::endl;
+            }
+            else if (event.type == SDL_EVENT_KEY_DOWN && (event.key.key == SDLK_F3 || event.key.key == SDLK_F4)) // Run-ahead frames
+            {
+                int runAhead = status.runAhead + (event.key.key == SDLK_F4 ? 1 : -1);
+                status.runAhead = std::clamp(runAhead, 0, MAX_RUN_AHEAD);
+                std::cout << "Run-ahead: " << status.runAhead << " frames" << std::endl;
+            }
+            else if (event.type == SDL_EVENT_KEY_DOWN && event.key.key == SDLK_F5) // CGB colour preset
+            {
+                static const char *names[COLOR_MODE_COUNT] = {"normal", "retro", "gray", "sigma", "raw"};
+                status.colorMode = (status.colorMode + 1) % COLOR_MODE_COUNT;
+                std::cout << "Colors: " << names[status.colorMode] << std::endl;
+            }
+            break;
         case SDL_EVENT_MOUSE_BUTTON_DOWN:
             if (event.button.button == SDL_BUTTON_RIGHT) // Right-click
             {
@@ -143,27 +424,33 @@ void Emulator::HandleEvents()
 
 void Emulator::Cleanup()
 {
-    if (this->cartridge)
+    StopEmulation();
+    FinishProfiling();
+    debugger.Attach(nullptr, nullptr);
+    timeline.Stop();
+    timeline.SetClock(nullptr);
+
+    if (runAheadState)
     {
-        delete this->cartridge;
-        this->cartridge = nullptr;
+        delete runAheadState;
+        runAheadState = nullptr;
     }
-    if (cpu)
+    if (machine)
     {
-        delete cpu;
-        cpu = nullptr;
+        delete machine;
+        machine = nullptr;
     }
-    if (memory)
+    if (this->cartridge)
     {
-        delete memory;
-        memory = nullptr;
+        delete this->cartridge;
+        this->cartridge = nullptr;
     }
-    if (ppu)
+
+    if (texture)
     {
-        delete ppu;
-        ppu = nullptr;
+        SDL_DestroyTexture(texture);
+        texture = nullptr;
     }
-
     if (renderer)
     {
         SDL_DestroyRenderer(renderer);
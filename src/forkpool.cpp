@@ -0,0 +1,66 @@
+#include "forkpool.h"
+
+ForkPool::ForkPool(unsigned threads)
+{
+    if (threads == 0)
+        threads = 1;
+
+    for (unsigned i = 0; i < threads; i++)
+        workers.emplace_back(&ForkPool::Work, this);
+}
+
+ForkPool::~ForkPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+
+    for (std::thread &worker : workers)
+        worker.join();
+}
+
+void ForkPool::Submit(Machine *machine, std::function<void(Machine &)> task)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        jobs.push_back({machine, std::move(task)});
+    }
+    wake.notify_one();
+}
+
+void ForkPool::Wait()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    idle.wait(lock, [this]
+              { return jobs.empty() && running == 0; });
+}
+
+void ForkPool::Work()
+{
+    while (true)
+    {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [this]
+                      { return stopping || !jobs.empty(); });
+            if (jobs.empty())
+                return;
+
+            job = std::move(jobs.front());
+            jobs.pop_front();
+            running++;
+        }
+
+        job.task(*job.machine);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            running--;
+            if (jobs.empty() && running == 0)
+                idle.notify_all();
+        }
+    }
+}
@@ -0,0 +1,274 @@
+#include "fuzzer.h"
+#include "forkpool.h"
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+
+// AFL hit-count buckets, so loops only count as new when their trip count
+// changes by an order of magnitude
+static uint8_t Bucket(uint8_t hits)
+{
+    if (hits == 0)
+        return 0;
+    if (hits <= 3)
+        return 1 << (hits - 1);
+    if (hits <= 7)
+        return 8;
+    if (hits <= 15)
+        return 16;
+    if (hits <= 31)
+        return 32;
+    if (hits <= 127)
+        return 64;
+    return 128;
+}
+
+Fuzzer::Fuzzer(Cartridge *cartridge, const FuzzOptions &options) : cartridge(cartridge), options(options)
+{
+    if (this->options.threads == 0)
+        this->options.threads = std::max(1u, std::thread::hardware_concurrency());
+    hangFrames = options.frames / HANG_FRACTION;
+
+    corpus.push_back(std::vector<uint8_t>(options.frames, 0));
+}
+
+void Fuzzer::Run()
+{
+    std::cout << "Fuzzing " << cartridge->GetTitle().c_str() << " on " << options.threads << " threads for "
+              << options.seconds << "s, " << options.frames << " frames per input" << std::endl;
+
+    // Every worker replays from its own fork of a freshly booted machine
+    std::unique_ptr<Machine> base(Machine::Create(options.core, cartridge, nullptr));
+    std::vector<Machine *> bases;
+    for (unsigned i = 0; i < options.threads; i++)
+        bases.push_back(base->Fork());
+
+    auto start = std::chrono::steady_clock::now();
+    {
+        ForkPool pool(options.threads);
+        for (unsigned i = 0; i < options.threads; i++)
+        {
+            pool.Submit(bases[i], [this, i](Machine &machine)
+                        { Worker(machine, 0x5EED + i); });
+        }
+
+        uint64_t lastExecutions = 0;
+        while (true)
+        {
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+            double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            uint64_t total = executions;
+            size_t corpusSize;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                corpusSize = corpus.size();
+            }
+            printf("[%6.0fs] execs %llu (%llu/s)  corpus %zu  edges %llu  hangs %llu  illegal %llu\n", elapsed,
+                   (unsigned long long)total, (unsigned long long)(total - lastExecutions), corpusSize,
+                   (unsigned long long)edges.load(), (unsigned long long)hangs.load(),
+                   (unsigned long long)illegalOpcodes.load());
+            lastExecutions = total;
+
+            if (elapsed >= options.seconds)
+                break;
+        }
+
+        stopping = true;
+        pool.Wait();
+    }
+
+    for (Machine *machine : bases)
+        delete machine;
+
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("Done: %llu executions, %.1f execs/s across all threads\n", (unsigned long long)executions.load(),
+           executions / elapsed);
+}
+
+void Fuzzer::Worker(Machine &base, unsigned seed)
+{
+    std::mt19937 random(seed);
+    std::unique_ptr<Machine> machine(Machine::Create(options.core, cartridge, nullptr));
+    std::vector<uint8_t> trace(COVERAGE_SIZE);
+    std::vector<uint8_t> seen(COVERAGE_SIZE);
+    std::vector<uint8_t> input;
+
+    while (!stopping)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            input = corpus[random() % corpus.size()];
+        }
+        Mutate(input, random);
+
+        machine->CopyFrom(base);
+        Result result = Execute(*machine, input, trace.data());
+        executions++;
+
+        if (MergeCoverage(trace.data(), seen.data()))
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            corpus.push_back(input);
+        }
+
+        if (result.outcome != Outcome::OK)
+            SaveFinding(input, result);
+    }
+}
+
+Fuzzer::Result Fuzzer::Replay(const std::vector<uint8_t> &input)
+{
+    std::unique_ptr<Machine> machine(Machine::Create(options.core, cartridge, nullptr));
+    std::vector<uint8_t> trace(COVERAGE_SIZE);
+    return Execute(*machine, input, trace.data());
+}
+
+Fuzzer::Result Fuzzer::Execute(Machine &machine, const std::vector<uint8_t> &input, uint8_t *trace)
+{
+    Result result;
+    CPUBase &cpu = *machine.cpu;
+
+    std::memset(trace, 0, COVERAGE_SIZE);
+    cpu.coverage = trace;
+    cpu.previousLocation = 0;
+
+    uint64_t lastPath = 0;
+    int samePathFrames = 0;
+    int inputChanges = 0;
+
+    for (int frame = 0; frame < static_cast<int>(input.size()); frame++)
+    {
+        if (input[frame] != machine.state->joypad)
+            inputChanges++;
+        machine.SetJoypad(input[frame]);
+        cpu.coveragePath = 0;
+
+        // Counted in PPU time, so double speed frames run twice the instructions
+        if (machine.Run(machine.state->cycles + CYCLES_PER_FRAME).stopped)
+        {
+            // Illegal or unknown opcode, the CPU would lock up here
+            result.outcome = Outcome::ILLEGAL_OPCODE;
+            result.pc = machine.state->registers.pc - 1;
+            result.bank = result.pc >= 0x4000 && result.pc < 0x8000 ? machine.state->romBank : 0;
+            result.frame = frame;
+            cpu.coverage = nullptr;
+            return result;
+        }
+
+        // Same code path frame after frame no matter what is pressed
+        if (cpu.coveragePath == lastPath)
+        {
+            if (++samePathFrames >= hangFrames && inputChanges >= HANG_INPUT_CHANGES)
+            {
+                result.outcome = Outcome::HANG;
+                result.pc = machine.state->registers.pc;
+                result.bank = result.pc >= 0x4000 && result.pc < 0x8000 ? machine.state->romBank : 0;
+                result.frame = frame;
+                break;
+            }
+        }
+        else
+        {
+            samePathFrames = 0;
+            inputChanges = 0;
+        }
+        lastPath = cpu.coveragePath;
+    }
+
+    cpu.coverage = nullptr;
+    return result;
+}
+
+bool Fuzzer::MergeCoverage(const uint8_t *trace, uint8_t *seen)
+{
+    // The worker's own copy of the buckets it knows the shared map holds, so
+    // the lock is only taken when this worker has never seen one of them
+    int first = 0;
+    while (first < COVERAGE_SIZE && !(Bucket(trace[first]) & ~seen[first]))
+        first++;
+    if (first == COVERAGE_SIZE)
+        return false;
+
+    bool found = false;
+    uint64_t newEdges = 0;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    for (int i = first; i < COVERAGE_SIZE; i++)
+    {
+        if (!trace[i])
+            continue;
+
+        uint8_t bucket = Bucket(trace[i]);
+        if (bucket & ~virgin[i])
+        {
+            if (!virgin[i])
+                newEdges++;
+            virgin[i] |= bucket;
+            found = true;
+        }
+        seen[i] = virgin[i];
+    }
+
+    edges += newEdges;
+    return found;
+}
+
+void Fuzzer::Mutate(std::vector<uint8_t> &input, std::mt19937 &random)
+{
+    int size = static_cast<int>(input.size());
+    int mutations = 1 + random() % 4;
+
+    for (int i = 0; i < mutations; i++)
+    {
+        int at = random() % size;
+        int length = std::min<int>(1 + random() % 60, size - at);
+
+        switch (random() % 4)
+        {
+        case 0: // Hold one button combination for a while
+        {
+            uint8_t buttons = random();
+            std::fill(input.begin() + at, input.begin() + at + length, buttons);
+            break;
+        }
+        case 1: // Toggle a single button on a single frame
+            input[at] ^= 1 << (random() % 8);
+            break;
+        case 2: // Release everything for a while
+            std::fill(input.begin() + at, input.begin() + at + length, 0);
+            break;
+        case 3: // Splice in a section of another corpus entry
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            const std::vector<uint8_t> &other = corpus[random() % corpus.size()];
+            std::copy(other.begin() + at, other.begin() + at + length, input.begin() + at);
+            break;
+        }
+        }
+    }
+}
+
+void Fuzzer::SaveFinding(const std::vector<uint8_t> &input, const Result &result)
+{
+    bool illegal = result.outcome == Outcome::ILLEGAL_OPCODE;
+    (illegal ? illegalOpcodes : hangs)++;
+
+    uint32_t key = (illegal ? 1u << 24 : 0) | (result.bank << 16) | result.pc;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!findings.insert(key).second)
+            return;
+    }
+
+    char name[64];
+    std::snprintf(name, sizeof(name), "/%s-%02X-%04X.input", illegal ? "illegal" : "hang", result.bank, result.pc);
+    std::string path = options.outputDir + name;
+
+    std::ofstream out(path, std::ios::binary);
+    out.write(reinterpret_cast<const char *>(input.data()), input.size());
+
+    printf("%s at %02X:%04X on frame %d, input saved to %s\n", illegal ? "Illegal opcode" : "Hang", result.bank,
+           result.pc, result.frame, path.c_str());
+}
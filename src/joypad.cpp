@@ -0,0 +1,96 @@
+#include "joypad.h"
+#include <algorithm>
+#include <iostream>
+
+Joypad::Joypad()
+{
+    keyBindings = {
+        {SDLK_RIGHT, JOYPAD_RIGHT},
+        {SDLK_LEFT, JOYPAD_LEFT},
+        {SDLK_UP, JOYPAD_UP},
+        {SDLK_DOWN, JOYPAD_DOWN},
+        {SDLK_X, JOYPAD_A},
+        {SDLK_Z, JOYPAD_B},
+        {SDLK_BACKSPACE, JOYPAD_SELECT},
+        {SDLK_RETURN, JOYPAD_START},
+    };
+
+    gamepadBindings = {
+        {SDL_GAMEPAD_BUTTON_DPAD_RIGHT, JOYPAD_RIGHT},
+        {SDL_GAMEPAD_BUTTON_DPAD_LEFT, JOYPAD_LEFT},
+        {SDL_GAMEPAD_BUTTON_DPAD_UP, JOYPAD_UP},
+        {SDL_GAMEPAD_BUTTON_DPAD_DOWN, JOYPAD_DOWN},
+        {SDL_GAMEPAD_BUTTON_SOUTH, JOYPAD_A},
+        {SDL_GAMEPAD_BUTTON_EAST, JOYPAD_B},
+        {SDL_GAMEPAD_BUTTON_BACK, JOYPAD_SELECT},
+        {SDL_GAMEPAD_BUTTON_START, JOYPAD_START},
+    };
+}
+
+Joypad::~Joypad()
+{
+    for (SDL_Gamepad *gamepad : gamepads)
+        SDL_CloseGamepad(gamepad);
+}
+
+bool Joypad::HandleEvent(const SDL_Event &event)
+{
+    switch (event.type)
+    {
+    case SDL_EVENT_KEY_DOWN:
+    case SDL_EVENT_KEY_UP:
+    {
+        auto binding = keyBindings.find(event.key.key);
+        if (binding == keyBindings.end())
+            return false;
+
+        SetButton(keyboardButtons, binding->second, event.type == SDL_EVENT_KEY_DOWN, event.common.timestamp);
+        return true;
+    }
+    case SDL_EVENT_GAMEPAD_BUTTON_DOWN:
+    case SDL_EVENT_GAMEPAD_BUTTON_UP:
+    {
+        auto binding = gamepadBindings.find(event.gbutton.button);
+        if (binding == gamepadBindings.end())
+            return false;
+
+        SetButton(gamepadButtons, binding->second, event.type == SDL_EVENT_GAMEPAD_BUTTON_DOWN, event.common.timestamp);
+        return true;
+    }
+    case SDL_EVENT_GAMEPAD_ADDED:
+    {
+        SDL_Gamepad *gamepad = SDL_OpenGamepad(event.gdevice.which);
+        if (gamepad)
+        {
+            gamepads.push_back(gamepad);
+            std::cout << "Gamepad connected" << std::endl;
+        }
+        return true;
+    }
+    case SDL_EVENT_GAMEPAD_REMOVED:
+    {
+        auto it = std::find_if(gamepads.begin(), gamepads.end(), [&](SDL_Gamepad *gamepad)
+                               { return SDL_GetGamepadID(gamepad) == event.gdevice.which; });
+        if (it != gamepads.end())
+        {
+            SDL_CloseGamepad(*it);
+            gamepads.erase(it);
+            gamepadButtons = 0;
+        }
+        return true;
+    }
+    }
+    return false;
+}
+
+void Joypad::SetButton(std::atomic<uint8_t> &buttons, JoypadButton button, bool down, uint64_t timestamp)
+{
+    uint8_t previous = down ? buttons.fetch_or(button) : buttons.fetch_and(~button);
+
+    // Key repeats don't change anything and aren't timed
+    if (((previous & button) != 0) == down)
+        return;
+
+    uint64_t expected = 0;
+    inputTimestamp.compare_exchange_strong(expected, timestamp, std::memory_order_relaxed);
+}
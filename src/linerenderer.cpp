@@ -0,0 +1,336 @@
+#include "linerenderer.h"
+#include "perf.h"
+#include "timeline.h"
+#include <cstring>
+
+const uint32_t dmgShades[4] = {0xFFFFFFFF, 0xFFAAAAAA, 0xFF555555, 0xFF000000};
+
+void VramView::Release()
+{
+    if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    {
+        for (MemoryPage *page : pages)
+            page->Release();
+        delete this;
+    }
+}
+
+// Added to a VRAM address to read CGB bank 1
+static const uint16_t VRAM_BANK_1 = 0x2000;
+
+static uint8_t ReadVram(const LineRecord &record, uint16_t address)
+{
+    uint16_t offset = address - 0x8000;
+    return record.vram[offset >> 8]->data[offset & 0xFF];
+}
+
+// One row of the tile a background or window map entry selects, flipped and
+// banked as its CGB attributes say
+static uint16_t TileRowAddress(const LineRecord &record, uint16_t mapAddress, uint8_t attributes, int row)
+{
+    uint8_t tile = ReadVram(record, mapAddress);
+    uint16_t tileAddress = (record.lcdc & 0x10) ? 0x8000 + tile * 16 : 0x9000 + static_cast<int8_t>(tile) * 16;
+    if (attributes & 0x08)
+        tileAddress += VRAM_BANK_1;
+    if (attributes & 0x40)
+        row = 7 - row;
+    return tileAddress + row * 2;
+}
+
+// Two bitplanes per tile row, bit 7 is the leftmost pixel
+static uint8_t TilePixel(const LineRecord &record, uint16_t rowAddress, int x)
+{
+    uint8_t low = ReadVram(record, rowAddress);
+    uint8_t high = ReadVram(record, rowAddress + 1);
+    int bit = 7 - x;
+    return ((low >> bit) & 1) | (((high >> bit) & 1) << 1);
+}
+
+LineRenderer::LineRenderer(TripleBuffer *frames) : frames(frames), framebuffer(frames ? frames->BackBuffer() : nullptr) {}
+
+LineRenderer::~LineRenderer()
+{
+    if (!IsThreaded())
+        return;
+
+    // Whatever is queued still gets drawn so pinned views are released
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_one();
+    worker.join();
+}
+
+void LineRenderer::StartThread()
+{
+    if (IsThreaded() || !frames)
+        return;
+
+    queue.resize(QUEUE_SIZE);
+    worker = std::thread(&LineRenderer::Work, this);
+}
+
+void LineRenderer::Submit(const LineRecord &record)
+{
+    if (!IsThreaded())
+    {
+        Render(record);
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    space.wait(lock, [this]
+               { return count < queue.size(); });
+    queue[(head + count) % queue.size()] = record;
+    count++;
+    submitted++;
+
+    // Only pay for a wake-up when the worker actually sleeps
+    if (workerWaiting)
+        wake.notify_one();
+}
+
+void LineRenderer::Finish()
+{
+    while (rendered.load(std::memory_order_acquire) != submitted)
+        std::this_thread::yield();
+}
+
+void LineRenderer::Work()
+{
+    timeline.NameThread("Render");
+
+    while (true)
+    {
+        LineRecord record;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            if (count == 0)
+            {
+                workerWaiting = true;
+                wake.wait(lock, [this]
+                          { return stopping || count > 0; });
+                workerWaiting = false;
+                if (count == 0)
+                    return;
+            }
+
+            record = queue[head];
+            head = (head + 1) % queue.size();
+            count--;
+        }
+        space.notify_one();
+
+        Render(record);
+        if (record.view)
+            record.view->Release();
+        rendered.fetch_add(1, std::memory_order_release);
+
+        if (record.line == 143)
+            perf.Flush();
+    }
+}
+
+void LineRenderer::Render(const LineRecord &record)
+{
+    PerfScope scope(TIMER_PPU);
+    TimelineSpan span("RenderScanline");
+
+    int line = record.line;
+    uint32_t *row = framebuffer + line * 160;
+
+    lineReused[line] = record.reuse;
+    if (!record.reuse)
+    {
+        if (!(record.lcdc & 0x80))
+        {
+            // LCD off shows a blank screen
+            for (int x = 0; x < 160; x++)
+                row[x] = dmgShades[0];
+        }
+        else if (record.prerendered)
+            std::memcpy(row, record.pixels, sizeof(record.pixels));
+        else
+        {
+            ExpandPalettes(record);
+            RenderBackground(record, row);
+            if (record.window)
+                RenderWindow(record, row);
+            if (record.lcdc & 0x02)
+                RenderSprites(record, row);
+        }
+    }
+
+    if (line == 143)
+        FinishFrame(record);
+}
+
+void LineRenderer::FinishFrame(const LineRecord &record)
+{
+    if (!inputTimestamp)
+        inputTimestamp = record.inputTimestamp;
+
+    // Identical to what is already on screen, nothing to hand over
+    if (!record.publish)
+        return;
+
+    for (int y = 0; y < 144; y++)
+    {
+        if (lineReused[y])
+            std::memcpy(framebuffer + y * 160, previousFrame + y * 160, 160 * sizeof(uint32_t));
+    }
+
+    // Input the game read is credited to the first frame that looks different
+    uint64_t frameInput = 0;
+    if (inputTimestamp &&
+        (record.showPerfOverlay || !previousFrame || std::memcmp(framebuffer, previousFrame, 160 * 144 * sizeof(uint32_t)) != 0))
+    {
+        frameInput = inputTimestamp;
+        inputTimestamp = 0;
+    }
+
+    if (record.showPerfOverlay)
+        perf.DrawOverlay(framebuffer);
+
+    previousFrame = framebuffer;
+    framebuffer = frames->Publish(frameInput);
+}
+
+void LineRenderer::ExpandPalettes(const LineRecord &record)
+{
+    if (record.cgb)
+    {
+        bgColors = record.bgColors;
+        objColors = record.objColors;
+        return;
+    }
+
+    for (int color = 0; color < 4; color++)
+    {
+        dmgColors[color] = dmgShades[(record.bgp >> (color * 2)) & 3];
+        dmgColors[4 + color] = dmgShades[(record.obp0 >> (color * 2)) & 3];
+        dmgColors[8 + color] = dmgShades[(record.obp1 >> (color * 2)) & 3];
+    }
+    bgColors = dmgColors;
+    objColors = dmgColors + 4;
+}
+
+void LineRenderer::RenderBackground(const LineRecord &record, uint32_t *row)
+{
+    uint8_t lcdc = record.lcdc;
+
+    // LCDC bit 0 off blanks the background (and window) on DMG, on CGB it
+    // only takes away the background's priority over sprites
+    if (!(lcdc & 0x01) && !record.cgb)
+    {
+        for (int x = 0; x < 160; x++)
+        {
+            lineColors[x] = 0;
+            row[x] = bgColors[0];
+        }
+        return;
+    }
+
+    uint16_t map = (lcdc & 0x08) ? 0x9C00 : 0x9800;
+    uint8_t y = record.line + record.scy;
+    uint8_t scx = record.scx;
+
+    uint16_t mapRow = map + (y >> 3) * 32;
+    int x = 0;
+    while (x < 160)
+    {
+        // One tile row fetch covers up to eight pixels
+        uint8_t column = (x + scx) & 0xFF;
+        uint16_t mapAddress = mapRow + (column >> 3);
+        uint8_t attributes = record.cgb ? ReadVram(record, mapAddress + VRAM_BANK_1) : 0;
+        uint16_t rowAddress = TileRowAddress(record, mapAddress, attributes, y & 7);
+        uint8_t low = ReadVram(record, rowAddress);
+        uint8_t high = ReadVram(record, rowAddress + 1);
+        const uint32_t *colors = bgColors + (attributes & 0x07) * 4;
+
+        for (int px = column & 7; px < 8 && x < 160; px++, x++)
+        {
+            int bit = (attributes & 0x20) ? px : 7 - px;
+            uint8_t color = ((low >> bit) & 1) | (((high >> bit) & 1) << 1);
+            lineColors[x] = color | (attributes & 0x80);
+            row[x] = colors[color];
+        }
+    }
+}
+
+void LineRenderer::RenderWindow(const LineRecord &record, uint32_t *row)
+{
+    uint8_t lcdc = record.lcdc;
+    int wx = record.wx - 7;
+    uint16_t map = (lcdc & 0x40) ? 0x9C00 : 0x9800;
+
+    // The window keeps its own line counter, it only advances on lines it was drawn
+    uint8_t y = record.windowLine;
+    uint16_t mapRow = map + (y >> 3) * 32;
+
+    for (int x = wx < 0 ? 0 : wx; x < 160; x++)
+    {
+        int column = x - wx;
+        uint16_t mapAddress = mapRow + (column >> 3);
+        uint8_t attributes = record.cgb ? ReadVram(record, mapAddress + VRAM_BANK_1) : 0;
+        uint16_t rowAddress = TileRowAddress(record, mapAddress, attributes, y & 7);
+        uint8_t color = TilePixel(record, rowAddress, (attributes & 0x20) ? 7 - (column & 7) : column & 7);
+        lineColors[x] = color | (attributes & 0x80);
+        row[x] = bgColors[(attributes & 0x07) * 4 + color];
+    }
+}
+
+void LineRenderer::RenderSprites(const LineRecord &record, uint32_t *row)
+{
+    int height = record.spriteHeight;
+
+    // Background colours 1-3 cover a sprite that asks for it, or on CGB
+    // where the tile asks for it; LCDC bit 0 off there puts sprites on top
+    bool backgroundPriority = !record.cgb || (record.lcdc & 0x01);
+
+    // The list is in priority order, the first sprite to claim a pixel keeps it
+    bool claimed[160] = {};
+    for (int i = 0; i < record.spriteCount; i++)
+    {
+        const uint8_t *sprite = record.sprites[i];
+        int top = sprite[0] - 16;
+        int left = sprite[1] - 8;
+        uint8_t tile = sprite[2];
+        uint8_t attributes = sprite[3];
+
+        int y = record.line - top;
+        if (attributes & 0x40)
+            y = height - 1 - y;
+        if (height == 16)
+            tile &= 0xFE;
+
+        uint16_t rowAddress = 0x8000 + tile * 16 + y * 2;
+        const uint32_t *colors;
+        if (record.cgb)
+        {
+            if (attributes & 0x08)
+                rowAddress += VRAM_BANK_1;
+            colors = objColors + (attributes & 0x07) * 4;
+        }
+        else
+            colors = objColors + ((attributes >> 4) & 1) * 4;
+        bool behindBackground = attributes & 0x80;
+
+        for (int px = 0; px < 8; px++)
+        {
+            int x = left + px;
+            if (x < 0 || x >= 160 || claimed[x])
+                continue;
+
+            uint8_t color = TilePixel(record, rowAddress, (attributes & 0x20) ? 7 - px : px);
+            if (color == 0)
+                continue;
+
+            claimed[x] = true;
+            if (backgroundPriority && (lineColors[x] & 0x03) && (behindBackground || (lineColors[x] & 0x80)))
+                continue;
+            row[x] = colors[color];
+        }
+    }
+}
@@ -0,0 +1,28 @@
+#include "loops.h"
+#include <cstring>
+
+const LoopSignature loopSignatures[] = {
+    {{0x2A, 0x12, 0x13, 0x0B, 0x78, 0xB1, 0x20, 0xF8}, 8, LoopKind::COPY_HL_TO_DE, LoopCounter::BC, 1, 40},
+    {{0x1A, 0x22, 0x13, 0x0B, 0x78, 0xB1, 0x20, 0xF8}, 8, LoopKind::COPY_DE_TO_HL, LoopCounter::BC, 1, 40},
+    {{0x2A, 0x12, 0x13, 0x05, 0x20, 0xFA}, 6, LoopKind::COPY_HL_TO_DE, LoopCounter::B, 1, 28},
+    {{0x2A, 0x12, 0x13, 0x0D, 0x20, 0xFA}, 6, LoopKind::COPY_HL_TO_DE, LoopCounter::C, 1, 28},
+    {{0x1A, 0x22, 0x13, 0x05, 0x20, 0xFA}, 6, LoopKind::COPY_DE_TO_HL, LoopCounter::B, 1, 28},
+    {{0x1A, 0x22, 0x13, 0x0D, 0x20, 0xFA}, 6, LoopKind::COPY_DE_TO_HL, LoopCounter::C, 1, 28},
+    {{0xAF, 0x22, 0x0B, 0x78, 0xB1, 0x20, 0xF9}, 7, LoopKind::CLEAR, LoopCounter::BC, 1, 28},
+    {{0x22, 0x05, 0x20, 0xFC}, 4, LoopKind::FILL, LoopCounter::B, 1, 12},
+    {{0x22, 0x0D, 0x20, 0xFC}, 4, LoopKind::FILL, LoopCounter::C, 1, 12},
+    {{0x32, 0x05, 0x20, 0xFC}, 4, LoopKind::FILL, LoopCounter::B, -1, 12},
+    {{0x32, 0x0D, 0x20, 0xFC}, 4, LoopKind::FILL, LoopCounter::C, -1, 12},
+};
+
+const int loopSignatureCount = sizeof(loopSignatures) / sizeof(loopSignatures[0]);
+
+const LoopSignature *FindLoop(const uint8_t *code, int length)
+{
+    for (const LoopSignature &signature : loopSignatures)
+    {
+        if (signature.length == length && std::memcmp(signature.code, code, length) == 0)
+            return &signature;
+    }
+    return nullptr;
+}
@@ -0,0 +1,220 @@
+#include "machine.h"
+#include <cstring>
+
+MemoryPage MemoryPage::zero = {{1}, {}};
+
+void MemoryPage::Release()
+{
+    if (this != &zero && refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        delete this;
+}
+
+template <typename Policy>
+class CoreMachine final : public Machine
+{
+public:
+    CoreMachine(Cartridge *cartridge, TripleBuffer *frames)
+        : Machine(Policy::TYPE, cartridge), mmu(cartridge, state, &interrupts, &sprites), cpuCore(&mmu, state, &interrupts), ppuCore(&mmu, state, &interrupts, &sprites, frames)
+    {
+        mmu.ppu = &ppuCore;
+        memory = &mmu;
+        cpu = &cpuCore;
+        ppu = &ppuCore;
+    }
+
+    RunResult Run(uint64_t until, bool vblank) override
+    {
+        RunResult result;
+        bool inVBlank = state->ppuMode == 1;
+        while (state->cycles < until)
+        {
+            int cycles = cpuCore.Step();
+            if (!cycles)
+            {
+                result.stopped = true;
+                break;
+            }
+            if (state->cycles >= state->ppuNextEvent)
+                ppuCore.CatchUp();
+
+            // VRAM DMA holds the CPU up while the PPU carries on
+            if (state->dmaStall)
+            {
+                cycles += state->dmaStall << state->doubleSpeed;
+                state->cycles += state->dmaStall;
+                state->dmaStall = 0;
+                if (state->cycles >= state->ppuNextEvent)
+                    ppuCore.CatchUp();
+            }
+
+            result.cycles += cycles;
+            result.instructions++;
+
+            bool nowVBlank = state->ppuMode == 1;
+            if (vblank && nowVBlank && !inVBlank)
+                break;
+            inVBlank = nowVBlank;
+
+            if (pause && pause->load(std::memory_order_relaxed))
+                break;
+        }
+        return result;
+    }
+
+private:
+    MMU<Policy> mmu;
+    CPU<MMU<Policy>> cpuCore;
+    PPU<Policy> ppuCore;
+};
+
+Machine *Machine::Create(CoreType core, Cartridge *cartridge, TripleBuffer *frames)
+{
+    if (core == CoreType::ACCURATE)
+        return new CoreMachine<AccurateCore>(cartridge, frames);
+    return new CoreMachine<FastCore>(cartridge, frames);
+}
+
+Machine::Machine(CoreType core, Cartridge *cartridge)
+    : core(core), cartridge(cartridge), state(new MachineState()), interrupts(state), sprites(state)
+{
+    Reset();
+}
+
+Machine::~Machine()
+{
+    ReleasePages();
+    delete state;
+}
+
+static void ReleaseAll(MemoryPage **pages, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (pages[i])
+            pages[i]->Release();
+        pages[i] = nullptr;
+    }
+}
+
+static void RetainAll(MemoryPage **pages, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (pages[i])
+            pages[i]->Retain();
+    }
+}
+
+void Machine::ReleasePages()
+{
+    ReleaseAll(state->pages, MachineState::PAGE_COUNT);
+    ReleaseAll(&state->vramBanks[0][0], 2 * MachineState::VRAM_PAGES);
+    ReleaseAll(&state->wramBanks[0][0], 8 * MachineState::WRAM_BANK_PAGES);
+}
+
+void Machine::Reset()
+{
+    ReleasePages();
+    std::memset(state, 0, sizeof(MachineState));
+
+    // RAM reads as zero until first written. VRAM bank 0 and WRAM bank 1
+    // start out mapped, the other banks wait in their slots.
+    for (MemoryPage *&page : state->pages)
+        page = MemoryPage::Zero();
+    for (int page = 0; page < MachineState::VRAM_PAGES; page++)
+        state->vramBanks[1][page] = MemoryPage::Zero();
+    for (int bank = 2; bank < 8; bank++)
+    {
+        for (MemoryPage *&page : state->wramBanks[bank])
+            page = MemoryPage::Zero();
+    }
+    state->wramBank = 1;
+    state->cgb = cartridge->IsColor();
+
+    // Register values left behind by the DMG or CGB boot ROM
+    Registers &registers = state->registers;
+    registers.af = state->cgb ? 0x1180 : 0x01B0;
+    registers.bc = state->cgb ? 0x0000 : 0x0013;
+    registers.de = state->cgb ? 0xFF56 : 0x00D8;
+    registers.hl = state->cgb ? 0x000D : 0x014D;
+    registers.sp = 0xFFFE;
+    registers.pc = 0x0100;
+
+    state->romBank = 1;
+    state->ppuMode = 2;
+    state->ppuNextEvent = PPUBase::OAM_SCAN_CYCLES;
+
+    state->io[0x00] = 0xCF; // P1
+    state->io[0x0F] = 0xE1; // IF
+    state->io[0x40] = 0x91; // LCDC
+    state->io[0x41] = 0x85; // STAT
+    state->io[0x47] = 0xFC; // BGP
+    if (state->cgb)
+    {
+        state->io[0x4D] = 0x7E; // KEY1
+        state->io[0x4F] = 0xFE; // VBK
+        state->io[0x55] = 0xFF; // HDMA5
+        state->io[0x68] = 0xC0; // BCPS
+        state->io[0x6A] = 0xC0; // OCPS
+        state->io[0x70] = 0xF9; // SVBK
+
+        // The boot ROM leaves every background colour white
+        for (int i = 0; i < 64; i += 2)
+        {
+            state->bgPalettes[i] = 0xFF;
+            state->bgPalettes[i + 1] = 0x7F;
+        }
+        state->io[0x69] = state->bgPalettes[0];
+    }
+    // The MMU expands the palettes itself while the machine is being built
+    if (memory)
+        memory->ExpandPalettes();
+    interrupts.Update();
+    sprites.Rebuild();
+}
+
+void Machine::CopyFrom(Machine &other)
+{
+    if (&other == this)
+        return;
+
+    ReleasePages();
+    std::memcpy(state, other.state, sizeof(MachineState));
+
+    // Neither side may write a shared page in place any more
+    RetainAll(state->pages, MachineState::PAGE_COUNT);
+    RetainAll(&state->vramBanks[0][0], 2 * MachineState::VRAM_PAGES);
+    RetainAll(&state->wramBanks[0][0], 8 * MachineState::WRAM_BANK_PAGES);
+    std::memset(state->ownedPages, 0, sizeof(state->ownedPages));
+    std::memset(other.state->ownedPages, 0, sizeof(other.state->ownedPages));
+
+    // VRAM may have changed behind the PPU's back
+    memory->ExpandPalettes();
+    ppu->VramReplaced();
+}
+
+Machine *Machine::Fork()
+{
+    Machine *child = Create(core, cartridge, nullptr);
+    child->CopyFrom(*this);
+    return child;
+}
+
+
+void Machine::SetColorMode(int colorMode)
+{
+    // Line signatures include the table, lines drawn with the old one are not reused
+    const uint32_t *table = ColorTable(colorMode);
+    if (table != memory->colorTable)
+        memory->SetColorTable(table);
+}
+
+void Machine::SetJoypad(uint8_t buttons, uint64_t inputTimestamp)
+{
+    if (inputTimestamp && !memory->pendingInputTimestamp)
+        memory->pendingInputTimestamp = inputTimestamp;
+
+    if (buttons & ~state->joypad)
+        interrupts.Request(INTERRUPT_JOYPAD);
+    state->joypad = buttons;
+}
@@ -1,8 +1,156 @@
 #include "emulator.h"
+#include "fuzzer.h"
+#include <algorithm>
 
 int main(int argc, char *argv[])
 {
     Emulator emulator;
+    std::string rom;
+    bool fuzz = false;
+    FuzzOptions fuzzOptions;
+
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--profile" && i + 1 < argc)
+        {
+            emulator.profilePath = argv[++i];
+#ifndef SIGMABOY_PROFILER
+            std::cout << "Built without SIGMABOY_PROFILER, --profile is ignored" << std::endl;
+#endif
+        }
+        else if (arg == "--sym" && i + 1 < argc)
+        {
+            emulator.symbolPath = argv[++i];
+        }
+        else if (arg == "--break" && i + 1 < argc)
+        {
+            emulator.debugger.AddBreakpoint(std::stoul(argv[++i], nullptr, 16));
+        }
+        else if (arg == "--watch" && i + 1 < argc)
+        {
+            // START[-END][:r|w|rw], addresses in hex
+            std::string spec = argv[++i];
+            uint8_t kind = WATCH_READ | WATCH_WRITE;
+            size_t colon = spec.find(':');
+            if (colon != std::string::npos)
+            {
+                std::string mode = spec.substr(colon + 1);
+                kind = (mode.find('r') != std::string::npos ? WATCH_READ : 0) |
+                       (mode.find('w') != std::string::npos ? WATCH_WRITE : 0);
+                spec = spec.substr(0, colon);
+            }
+            size_t dash = spec.find('-');
+            uint16_t start = std::stoul(spec.substr(0, dash), nullptr, 16);
+            uint16_t end = dash == std::string::npos ? start : std::stoul(spec.substr(dash + 1), nullptr, 16);
+            emulator.debugger.AddWatchpoint(start, end, kind);
+        }
+        else if (arg == "--timeline" && i + 1 < argc)
+        {
+            emulator.timelinePath = argv[++i];
+        }
+        else if (arg == "--run-ahead" && i + 1 < argc)
+        {
+            emulator.status.runAhead = std::max(std::stoi(argv[++i]), 0);
+        }
+        else if (arg == "--frame-skip" && i + 1 < argc)
+        {
+            // N, or "auto"
+            std::string skip = argv[++i];
+            emulator.status.frameSkip = skip == "auto" ? FRAME_SKIP_AUTO : std::max(std::stoi(skip), 0);
+        }
+        else if (arg == "--colors" && i + 1 < argc)
+        {
+            // CGB colour preset: normal, retro, gray, sigma or raw
+            std::string colors = argv[++i];
+            if (colors == "normal")
+                emulator.status.colorMode = NORMAL;
+            else if (colors == "retro")
+                emulator.status.colorMode = RETRO;
+            else if (colors == "gray")
+                emulator.status.colorMode = GRAY;
+            else if (colors == "sigma")
+                emulator.status.colorMode = SIGMA;
+            else if (colors == "raw")
+                emulator.status.colorMode = RAW;
+            else
+                std::cout << "Unknown colors " << colors << ", using normal" << std::endl;
+        }
+        else if (arg == "--core" && i + 1 < argc)
+        {
+            // fast or accurate, applies to the fuzzer as well
+            std::string core = argv[++i];
+            if (core == "accurate")
+                emulator.core = fuzzOptions.core = CoreType::ACCURATE;
+            else if (core == "fast")
+                emulator.core = fuzzOptions.core = CoreType::FAST;
+            else
+                std::cout << "Unknown core " << core << ", using fast" << std::endl;
+        }
+        else if (arg == "--no-render-thread")
+        {
+            emulator.renderThread = false;
+        }
+        else if (arg == "--no-bulk-loops")
+        {
+            emulator.bulkLoops = false;
+        }
+        else if (arg == "--trace")
+        {
+            emulator.debugger.SetTrace(true);
+        }
+        else if (arg == "--fuzz" && i + 1 < argc)
+        {
+            fuzz = true;
+            fuzzOptions.seconds = std::stod(argv[++i]);
+        }
+        else if (arg == "--fuzz-threads" && i + 1 < argc)
+        {
+            fuzzOptions.threads = std::stoul(argv[++i]);
+        }
+        else if (arg == "--fuzz-frames" && i + 1 < argc)
+        {
+            fuzzOptions.frames = std::stoi(argv[++i]);
+        }
+        else if (arg == "--fuzz-out" && i + 1 < argc)
+        {
+            fuzzOptions.outputDir = argv[++i];
+        }
+        else
+        {
+            rom = arg;
+        }
+    }
+
+    // Headless, no window needed
+    if (fuzz)
+    {
+        if (rom.empty())
+        {
+            std::cout << "--fuzz needs a ROM" << std::endl;
+            return 1;
+        }
+        if (fuzzOptions.frames < FuzzOptions::MIN_FRAMES)
+        {
+            std::cout << "--fuzz-frames must be at least " << FuzzOptions::MIN_FRAMES << std::endl;
+            return 1;
+        }
+
+        try
+        {
+            Cartridge cartridge(rom);
+            Fuzzer(&cartridge, fuzzOptions).Run();
+        }
+        catch (const std::exception &e)
+        {
+            std::cout << "Could not load ROM: " << e.what() << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    if (!rom.empty())
+        emulator.QueueRom(rom);
 
     if (!emulator.ConfigureWindow())
     {
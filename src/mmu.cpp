@@ -1,50 +1,485 @@
 #include "mmu.h"
+#include "ppu.h"
+#include <algorithm>
+#include <cstring>
+#include "perf.h"
+#include "timeline.h"
 
-MMU::MMU(Cartridge *cartridge) : cartridge(cartridge) {}
+MMUBase::MMUBase(Cartridge *cartridge, MachineState *state, InterruptController *interrupts, SpriteIndex *sprites)
+    : cartridge(cartridge), state(state), interrupts(interrupts), sprites(sprites)
+{
+    ExpandPalettes();
+}
 
-uint8_t MMU::Read(uint16_t address)
+uint8_t MMUBase::Load(uint16_t address)
 {
+    if (debugger && debugger->IsWatched(address, WATCH_READ))
+        debugger->CheckRead(address);
+
     if (address <= 0x7FFF)
-        return cartridge->ReadROM(address);
+    {
+        CountAccess(REGION_ROM);
+        return cartridge->ReadROM(address, state->romBank);
+    }
     else if (address >= 0x8000 && address <= 0x9FFF)
-        return vram[address - 0x8000];
+    {
+        CountAccess(REGION_VRAM);
+        return ReadPaged(address);
+    }
     else if (address >= 0xA000 && address <= 0xBFFF)
-        return eram[address - 0xA000];
+    {
+        CountAccess(REGION_ERAM);
+        return ReadPaged(address);
+    }
     else if (address >= 0xC000 && address <= 0xDFFF)
-        return wram[address - 0xC000];
+    {
+        CountAccess(REGION_WRAM);
+        return ReadPaged(address);
+    }
     else if (address >= 0xE000 && address <= 0xFDFF)
-        return wram[address - 0xE000];
+    {
+        CountAccess(REGION_WRAM);
+        return ReadPaged(address - 0x2000);
+    }
     else if (address >= 0xFE00 && address <= 0xFE9F)
-        return oam[address - 0xFE00];
+    {
+        CountAccess(REGION_OAM);
+        return state->oam[address - 0xFE00];
+    }
     else if (address >= 0xFF00 && address <= 0xFF7F)
-        return io[address - 0xFF00];
+    {
+        CountAccess(REGION_IO);
+        if (address == 0xFF00)
+            return ReadJoypad();
+        if (address == 0xFF41)
+            return ReadSTAT();
+        if (address == 0xFF44)
+            return state->io[0x40] & 0x80 ? state->ppuLine : 0;
+        return state->io[address - 0xFF00];
+    }
     else if (address >= 0xFF80 && address <= 0xFFFE)
-        return hram[address - 0xFF80];
+    {
+        CountAccess(REGION_HRAM);
+        return state->hram[address - 0xFF80];
+    }
     else if (address == 0xFFFF)
-        return ie;
+    {
+        CountAccess(REGION_IE);
+        return state->ie;
+    }
     return 0xFF;
 }
 
-void MMU::Write(uint16_t address, uint8_t value)
+void MMUBase::Store(uint16_t address, uint8_t value)
 {
+    if (debugger && debugger->IsWatched(address, WATCH_WRITE))
+        debugger->CheckWrite(address, value);
+
     if (address <= 0x7FFF)
     {
-        // cartridge->WriteROM(address, value); // for MBC
+        CountAccess(REGION_ROM);
+        if (address >= 0x2000 && address <= 0x3FFF)
+        {
+            uint8_t bank = cartridge->SelectBank(value, state->romBank);
+            if (bank != state->romBank)
+                timeline.Emulated("Bank switch", TRACK_CARTRIDGE, bank);
+            state->romBank = bank;
+        }
     }
     else if (address >= 0x8000 && address <= 0x9FFF)
-        vram[address - 0x8000] = value;
+    {
+        CountAccess(REGION_VRAM);
+        vramVersions[state->vramBank << 9 | (address - 0x8000) >> 4]++;
+        vramGeneration++;
+        WritePaged(address, value);
+    }
     else if (address >= 0xA000 && address <= 0xBFFF)
-        eram[address - 0xA000] = value;
+    {
+        CountAccess(REGION_ERAM);
+        WritePaged(address, value);
+    }
     else if (address >= 0xC000 && address <= 0xDFFF)
-        wram[address - 0xC000] = value;
+    {
+        CountAccess(REGION_WRAM);
+        WritePaged(address, value);
+    }
     else if (address >= 0xE000 && address <= 0xFDFF)
-        wram[address - 0xE000] = value;
+    {
+        CountAccess(REGION_WRAM);
+        WritePaged(address - 0x2000, value);
+    }
     else if (address >= 0xFE00 && address <= 0xFE9F)
-        oam[address - 0xFE00] = value;
+    {
+        CountAccess(REGION_OAM);
+        sprites->WriteOAM(address - 0xFE00, value);
+    }
     else if (address >= 0xFF00 && address <= 0xFF7F)
-        io[address - 0xFF00] = value;
+    {
+        CountAccess(REGION_IO);
+        uint8_t previous = state->io[address - 0xFF00];
+        state->io[address - 0xFF00] = value;
+        if (address == 0xFF46)
+            TransferOAM(value);
+        else if (address == 0xFF0F)
+            interrupts->WriteIF(value);
+        else if (address == 0xFF40)
+        {
+            sprites->SetHeight(value & 0x04 ? 16 : 8);
+            if ((previous ^ value) & 0x80)
+                ppu->SetLcdEnabled(value & 0x80);
+        }
+        else if (address == 0xFF41 || address == 0xFF45)
+            ppu->UpdateStatLine();
+        else if (state->cgb)
+            StoreColorRegister(address, value);
+    }
     else if (address >= 0xFF80 && address <= 0xFFFE)
-        hram[address - 0xFF80] = value;
+    {
+        CountAccess(REGION_HRAM);
+        state->hram[address - 0xFF80] = value;
+    }
     else if (address == 0xFFFF)
-        ie = value;
-}
\ No newline at end of file
+    {
+        CountAccess(REGION_IE);
+        interrupts->WriteIE(value);
+    }
+}
+
+void MMUBase::MakePrivate(int page)
+{
+    MemoryPage *shared = state->pages[page];
+
+    // The last machine holding a page can just take it over
+    if (shared->refs.load(std::memory_order_acquire) > 1 || shared == MemoryPage::Zero())
+    {
+        MemoryPage *copy = new MemoryPage;
+        copy->refs = 1;
+        std::memcpy(copy->data, shared->data, MemoryPage::SIZE);
+        state->pages[page] = copy;
+        shared->Release();
+    }
+
+    state->ownedPages[page >> 5] |= 1u << (page & 31);
+}
+
+void MMUBase::StoreColorRegister(uint16_t address, uint8_t value)
+{
+    // Registers keep what they read back as in io[], so Load needs no CGB cases
+    uint8_t *io = state->io;
+    switch (address)
+    {
+    case 0xFF4D: // KEY1, the switch itself happens on STOP
+        io[0x4D] = 0x7E | (state->doubleSpeed ? 0x80 : 0) | (value & 0x01);
+        break;
+    case 0xFF4F: // VBK
+        if ((value & 0x01) != state->vramBank)
+        {
+            uint8_t bank = value & 0x01;
+            SwapBank(0, state->vramBanks[state->vramBank], state->vramBanks[bank], MachineState::VRAM_PAGES);
+            state->vramBank = bank;
+        }
+        io[0x4F] = 0xFE | state->vramBank;
+        break;
+    case 0xFF51: // HDMA1-HDMA4 read back as 0xFF
+        state->hdmaSource = (state->hdmaSource & 0x00FF) | value << 8;
+        io[0x51] = 0xFF;
+        break;
+    case 0xFF52:
+        state->hdmaSource = (state->hdmaSource & 0xFF00) | (value & 0xF0);
+        io[0x52] = 0xFF;
+        break;
+    case 0xFF53:
+        state->hdmaDestination = (state->hdmaDestination & 0x00FF) | (value & 0x1F) << 8;
+        io[0x53] = 0xFF;
+        break;
+    case 0xFF54:
+        state->hdmaDestination = (state->hdmaDestination & 0xFF00) | (value & 0xF0);
+        io[0x54] = 0xFF;
+        break;
+    case 0xFF55: // HDMA5
+        StartVramTransfer(value);
+        break;
+    case 0xFF68: // BCPS
+        io[0x68] = value | 0x40;
+        io[0x69] = state->bgPalettes[value & 0x3F];
+        break;
+    case 0xFF69: // BCPD
+        WritePalette(state->bgPalettes, bgColors, 0x68, value);
+        break;
+    case 0xFF6A: // OCPS
+        io[0x6A] = value | 0x40;
+        io[0x6B] = state->objPalettes[value & 0x3F];
+        break;
+    case 0xFF6B: // OCPD
+        WritePalette(state->objPalettes, objColors, 0x6A, value);
+        break;
+    case 0xFF70: // SVBK, bank 0 selects 1
+    {
+        uint8_t bank = (value & 0x07) ? value & 0x07 : 1;
+        if (bank != state->wramBank)
+        {
+            SwapBank(0x5000 / MemoryPage::SIZE, state->wramBanks[state->wramBank], state->wramBanks[bank], MachineState::WRAM_BANK_PAGES);
+            state->wramBank = bank;
+        }
+        io[0x70] = 0xF8 | bank;
+        break;
+    }
+    }
+}
+
+void MMUBase::WritePalette(uint8_t *palettes, uint32_t *colors, uint8_t specification, uint8_t value)
+{
+    // Index in the low six bits, bit 7 steps it after every data write
+    uint8_t &index = state->io[specification];
+    int entry = (index & 0x3F) >> 1;
+    palettes[index & 0x3F] = value;
+    colors[entry] = colorTable[(palettes[entry * 2] | palettes[entry * 2 + 1] << 8) & 0x7FFF];
+    if (index & 0x80)
+        index = (index & 0xC0) | ((index + 1) & 0x3F);
+    state->io[specification + 1] = palettes[index & 0x3F];
+}
+
+void MMUBase::SetColorTable(const uint32_t *table)
+{
+    colorTable = table;
+    ExpandPalettes();
+}
+
+void MMUBase::ExpandPalettes()
+{
+    for (int entry = 0; entry < 32; entry++)
+    {
+        bgColors[entry] = colorTable[(state->bgPalettes[entry * 2] | state->bgPalettes[entry * 2 + 1] << 8) & 0x7FFF];
+        objColors[entry] = colorTable[(state->objPalettes[entry * 2] | state->objPalettes[entry * 2 + 1] << 8) & 0x7FFF];
+    }
+}
+
+void MMUBase::SwapBank(int first, MemoryPage **unmapped, MemoryPage **mapped, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        int page = first + i;
+        unmapped[i] = state->pages[page];
+        state->pages[page] = mapped[i];
+        mapped[i] = nullptr;
+
+        // The incoming page may be shared with a fork, the next write checks again
+        state->ownedPages[page >> 5] &= ~(1u << (page & 31));
+    }
+}
+
+// Region of an address a plain run may touch
+static PerfRegion PlainRegion(uint16_t address)
+{
+    if (address <= 0x7FFF)
+        return REGION_ROM;
+    if (address <= 0x9FFF)
+        return REGION_VRAM;
+    if (address <= 0xBFFF)
+        return REGION_ERAM;
+    if (address <= 0xDFFF)
+        return REGION_WRAM;
+    return REGION_HRAM;
+}
+
+bool MMUBase::IsPlainRun(uint16_t start, int count, int step, bool write) const
+{
+    if (debugger || count <= 0)
+        return false;
+
+    int end = start + (count - 1) * step;
+    if (end < 0 || end > 0xFFFF)
+        return false;
+
+    int low = std::min<int>(start, end);
+    int high = std::max<int>(start, end);
+    if (high <= 0x7FFF)
+        return !write;
+    return (low >= 0x8000 && high <= 0xDFFF) || (low >= 0xFF80 && high <= 0xFFFE);
+}
+
+uint8_t MMUBase::CopyRun(uint16_t destination, uint16_t source, int count, int step)
+{
+    CountAccess(PlainRegion(source), count);
+    CountAccess(PlainRegion(destination), count);
+
+    uint8_t value = 0;
+    for (int i = 0; i < count; i++)
+    {
+        value = Peek(source);
+        Poke(destination, value);
+        source += step;
+        destination += step;
+    }
+    return value;
+}
+
+void MMUBase::FillRun(uint16_t destination, uint8_t value, int count, int step)
+{
+    CountAccess(PlainRegion(destination), count);
+
+    for (int i = 0; i < count; i++)
+    {
+        Poke(destination, value);
+        destination += step;
+    }
+}
+
+void MMUBase::Poke(uint16_t address, uint8_t value)
+{
+    if (address >= 0xFF80)
+    {
+        state->hram[address - 0xFF80] = value;
+        return;
+    }
+    if (address <= 0x9FFF)
+    {
+        vramVersions[state->vramBank << 9 | (address - 0x8000) >> 4]++;
+        vramGeneration++;
+    }
+    WritePaged(address, value);
+}
+
+void MMUBase::StartVramTransfer(uint8_t value)
+{
+    // Bit 7 clear stops a running HBlank DMA, which then reads back as
+    // inactive with the blocks it had left
+    if (state->hdmaActive && !(value & 0x80))
+    {
+        state->hdmaActive = false;
+        state->io[0x55] = 0x80 | state->hdmaBlocks;
+        return;
+    }
+
+    state->hdmaBlocks = value & 0x7F;
+    if (value & 0x80)
+    {
+        // HBlank DMA, one block at the start of every HBlank from now on
+        state->hdmaActive = true;
+        state->io[0x55] = state->hdmaBlocks;
+        return;
+    }
+
+    // General purpose DMA copies everything at once, with the CPU halted
+    // for 32 dots per block in either speed
+    timeline.Emulated("GDMA", TRACK_DMA, state->hdmaSource, (state->hdmaBlocks + 1) * 32);
+    bool more = true;
+    while (more)
+    {
+        more = TransferBlock();
+        state->dmaStall += 32;
+    }
+    state->io[0x55] = 0xFF;
+}
+
+void MMUBase::TransferHBlankBlock()
+{
+    timeline.Emulated("HDMA", TRACK_DMA, state->hdmaSource, 32);
+    state->dmaStall += 32;
+    if (TransferBlock())
+        state->io[0x55] = state->hdmaBlocks;
+    else
+    {
+        state->hdmaActive = false;
+        state->io[0x55] = 0xFF;
+    }
+}
+
+bool MMUBase::TransferBlock()
+{
+    // Both ends are 16 byte aligned, so each sits inside a single page and
+    // the block is one copy. Only ROM, ERAM and WRAM are meant as sources.
+    uint16_t source = state->hdmaSource;
+    uint8_t block[16];
+    if (source >= 0x8000 && source <= 0xDFFF)
+        std::memcpy(block, &state->pages[(source - 0x8000) >> 8]->data[source & 0xFF], sizeof(block));
+    else
+    {
+        for (int i = 0; i < 16; i++)
+            block[i] = Peek(source + i);
+    }
+
+    uint16_t offset = state->hdmaDestination;
+    int page = offset >> 8;
+    if (!(state->ownedPages[page >> 5] & (1u << (page & 31))))
+        MakePrivate(page);
+    std::memcpy(&state->pages[page]->data[offset & 0xFF], block, sizeof(block));
+    vramVersions[state->vramBank << 9 | offset >> 4]++;
+    vramGeneration++;
+
+    CountAccess(PlainRegion(source), 16);
+    CountAccess(REGION_VRAM, 16);
+
+    // The source wraps around, running off the end of VRAM ends the transfer
+    state->hdmaSource = source + 16;
+    state->hdmaDestination = offset + 16;
+    if (state->hdmaDestination >= 0x2000)
+    {
+        state->hdmaDestination &= 0x1FF0;
+        state->hdmaBlocks = 0x7F;
+        return false;
+    }
+    return state->hdmaBlocks-- > 0;
+}
+
+uint8_t MMUBase::ReadSTAT() const
+{
+    // Mode and LY=LYC come straight from the PPU state, bit 7 is unused. With
+    // the LCD off the PPU reports line 0 in mode 0.
+    bool on = state->io[0x40] & 0x80;
+    uint8_t value = 0x80 | (state->io[0x41] & 0x78) | (on ? state->ppuMode : 0);
+    if ((on ? state->ppuLine : 0) == state->io[0x45])
+        value |= 0x04;
+    return value;
+}
+
+uint8_t MMUBase::ReadJoypad()
+{
+    if (pendingInputTimestamp)
+    {
+        if (!observedInputTimestamp)
+            observedInputTimestamp = pendingInputTimestamp;
+        pendingInputTimestamp = 0;
+    }
+
+    // Bits 4 and 5 select directions and buttons, pressed keys read as 0
+    uint8_t select = state->io[0x00] & 0x30;
+    uint8_t value = 0xC0 | select | 0x0F;
+
+    if (!(select & 0x10))
+        value &= ~(state->joypad & 0x0F);
+    if (!(select & 0x20))
+        value &= ~(state->joypad >> 4);
+
+    return value;
+}
+
+void MMUBase::TransferOAM(uint8_t source)
+{
+    // Copies 160 bytes from XX00 at once, the hardware spreads it over 160 M-cycles
+    uint16_t base = source << 8;
+    for (int i = 0; i < 0xA0; i++)
+    {
+        state->oam[i] = Load(base + i);
+    }
+    sprites->Rebuild();
+
+    timeline.Emulated("OAM DMA", TRACK_DMA, base, 640);
+}
+
+template <typename Policy>
+void MMU<Policy>::Tick()
+{
+    if (state->cycles >= state->ppuNextEvent)
+        static_cast<PPU<Policy> *>(ppu)->CatchUp();
+    state->cycles += 4 >> state->doubleSpeed;
+}
+
+template <typename Policy>
+void MMU<Policy>::SyncFifo()
+{
+    ppu->SyncFifo();
+}
+
+template class MMU<FastCore>;
+template class MMU<AccurateCore>;
@@ -0,0 +1,229 @@
+#include "perf.h"
+#include <SDL3/SDL_timer.h>
+#include <cstdio>
+#include <sstream>
+
+thread_local PerfBatch perfBatch;
+PerfCounters perf;
+
+#ifdef SIGMABOY_REGION_COUNTERS
+static const char *regionNames[REGION_COUNT] = {"rom", "vram", "eram", "wram", "oam", "io", "hram", "ie"};
+#endif
+static const char *timerNames[TIMER_COUNT] = {"cpu", "ppu", "present", "sleep"};
+
+PerfCounters::PerfCounters()
+{
+    for (auto &timer : timerNs)
+        timer = 0;
+    for (auto &region : memoryAccesses)
+        region = 0;
+    for (auto &bucket : frameHistogram)
+        bucket = 0;
+    for (auto &bucket : latencyHistogram)
+        bucket = 0;
+}
+
+uint64_t PerfCounters::Now()
+{
+    return SDL_GetTicksNS();
+}
+
+void PerfCounters::Flush()
+{
+    PerfBatch &batch = perfBatch;
+
+    instructions.fetch_add(batch.instructions, std::memory_order_relaxed);
+    cycles.fetch_add(batch.cycles, std::memory_order_relaxed);
+    frames.fetch_add(batch.frames, std::memory_order_relaxed);
+    framesSkipped.fetch_add(batch.framesSkipped, std::memory_order_relaxed);
+    for (int i = 0; i < TIMER_COUNT; i++)
+        timerNs[i].fetch_add(batch.timerNs[i], std::memory_order_relaxed);
+    for (int i = 0; i < REGION_COUNT; i++)
+        memoryAccesses[i].fetch_add(batch.memoryAccesses[i], std::memory_order_relaxed);
+
+    batch = PerfBatch();
+}
+
+void PerfCounters::AddToHistogram(std::atomic<uint64_t> *histogram, uint64_t bucketNs, uint64_t ns)
+{
+    uint64_t bucket = ns / bucketNs;
+    if (bucket >= HISTOGRAM_BUCKETS)
+        bucket = HISTOGRAM_BUCKETS - 1;
+    histogram[bucket].fetch_add(1, std::memory_order_relaxed);
+}
+
+void PerfCounters::RecordFrameTime(uint64_t ns)
+{
+    AddToHistogram(frameHistogram, BUCKET_NS, ns);
+}
+
+void PerfCounters::RecordInputLatency(uint64_t ns)
+{
+    AddToHistogram(latencyHistogram, LATENCY_BUCKET_NS, ns);
+    latencySumNs.fetch_add(ns, std::memory_order_relaxed);
+    uint64_t least = latencyMinNs.load(std::memory_order_relaxed);
+    while (ns < least && !latencyMinNs.compare_exchange_weak(least, ns, std::memory_order_relaxed))
+        ;
+    latencyCount.fetch_add(1, std::memory_order_relaxed);
+}
+
+double PerfCounters::Percentile(const std::atomic<uint64_t> *histogram, uint64_t bucketNs, double fraction)
+{
+    uint64_t total = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+        total += histogram[i].load(std::memory_order_relaxed);
+    if (total == 0)
+        return 0.0;
+
+    uint64_t target = static_cast<uint64_t>(fraction * (total - 1)) + 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        seen += histogram[i].load(std::memory_order_relaxed);
+        if (seen >= target)
+            return (i + 1) * bucketNs / 1e6; // upper edge of the bucket
+    }
+    return HISTOGRAM_BUCKETS * bucketNs / 1e6;
+}
+
+PerfSnapshot PerfCounters::Snapshot()
+{
+    PerfSnapshot snapshot;
+    snapshot.instructions = instructions.load(std::memory_order_relaxed);
+    snapshot.cycles = cycles.load(std::memory_order_relaxed);
+    snapshot.frames = frames.load(std::memory_order_relaxed);
+    snapshot.framesSkipped = framesSkipped.load(std::memory_order_relaxed);
+    for (int i = 0; i < TIMER_COUNT; i++)
+        snapshot.timerNs[i] = timerNs[i].load(std::memory_order_relaxed);
+    for (int i = 0; i < REGION_COUNT; i++)
+        snapshot.memoryAccesses[i] = memoryAccesses[i].load(std::memory_order_relaxed);
+
+    {
+        std::lock_guard<std::mutex> lock(sampleMutex);
+        uint64_t now = Now();
+        uint64_t elapsed = now - sampleTime;
+        if (elapsed >= RATE_WINDOW_NS)
+        {
+            emulatedMhz = (snapshot.cycles - sampleCycles) * 1000.0 / elapsed;
+            fps = (snapshot.frames - sampleFrames) * 1e9 / elapsed;
+            sampleTime = now;
+            sampleCycles = snapshot.cycles;
+            sampleFrames = snapshot.frames;
+        }
+        snapshot.emulatedMhz = emulatedMhz;
+        snapshot.fps = fps;
+    }
+
+    snapshot.frameP50Ms = Percentile(frameHistogram, BUCKET_NS, 0.50);
+    snapshot.frameP99Ms = Percentile(frameHistogram, BUCKET_NS, 0.99);
+
+    snapshot.inputSamples = latencyCount.load(std::memory_order_relaxed);
+    if (snapshot.inputSamples)
+    {
+        snapshot.inputMinMs = latencyMinNs.load(std::memory_order_relaxed) / 1e6;
+        snapshot.inputMeanMs = latencySumNs.load(std::memory_order_relaxed) / 1e6 / snapshot.inputSamples;
+        snapshot.inputP99Ms = Percentile(latencyHistogram, LATENCY_BUCKET_NS, 0.99);
+    }
+    return snapshot;
+}
+
+std::string PerfCounters::SnapshotJSON()
+{
+    PerfSnapshot snapshot = Snapshot();
+
+    std::ostringstream json;
+    json << "{\"instructions\":" << snapshot.instructions
+         << ",\"cycles\":" << snapshot.cycles
+         << ",\"frames\":" << snapshot.frames
+         << ",\"frames_skipped\":" << snapshot.framesSkipped
+         << ",\"emulated_mhz\":" << snapshot.emulatedMhz
+         << ",\"fps\":" << snapshot.fps
+         << ",\"frame_ms\":{\"p50\":" << snapshot.frameP50Ms << ",\"p99\":" << snapshot.frameP99Ms << "}"
+         << ",\"input_latency_ms\":{\"samples\":" << snapshot.inputSamples << ",\"min\":" << snapshot.inputMinMs
+         << ",\"mean\":" << snapshot.inputMeanMs << ",\"p99\":" << snapshot.inputP99Ms << "}";
+
+    json << ",\"host_ms\":{";
+    for (int i = 0; i < TIMER_COUNT; i++)
+        json << (i ? "," : "") << "\"" << timerNames[i] << "\":" << snapshot.timerNs[i] / 1e6;
+    json << "}";
+
+#ifdef SIGMABOY_REGION_COUNTERS
+    json << ",\"memory_accesses\":{";
+    for (int i = 0; i < REGION_COUNT; i++)
+        json << (i ? "," : "") << "\"" << regionNames[i] << "\":" << snapshot.memoryAccesses[i];
+    json << "}";
+#endif
+    json << "}";
+
+    return json.str();
+}
+
+// 3x5 glyphs, one row per entry, bit 2 is the leftmost pixel
+struct Glyph
+{
+    char c;
+    uint8_t rows[5];
+};
+
+static const Glyph font[] = {
+    {'0', {0b111, 0b101, 0b101, 0b101, 0b111}},
+    {'1', {0b010, 0b110, 0b010, 0b010, 0b111}},
+    {'2', {0b111, 0b001, 0b111, 0b100, 0b111}},
+    {'3', {0b111, 0b001, 0b111, 0b001, 0b111}},
+    {'4', {0b101, 0b101, 0b111, 0b001, 0b001}},
+    {'5', {0b111, 0b100, 0b111, 0b001, 0b111}},
+    {'6', {0b111, 0b100, 0b111, 0b101, 0b111}},
+    {'7', {0b111, 0b001, 0b001, 0b001, 0b001}},
+    {'8', {0b111, 0b101, 0b111, 0b101, 0b111}},
+    {'9', {0b111, 0b101, 0b111, 0b001, 0b111}},
+    {'.', {0b000, 0b000, 0b000, 0b000, 0b010}},
+    {'C', {0b111, 0b100, 0b100, 0b100, 0b111}},
+    {'F', {0b111, 0b100, 0b111, 0b100, 0b100}},
+    {'H', {0b101, 0b101, 0b111, 0b101, 0b101}},
+    {'M', {0b101, 0b111, 0b111, 0b101, 0b101}},
+    {'P', {0b111, 0b101, 0b111, 0b100, 0b100}},
+    {'S', {0b111, 0b100, 0b111, 0b001, 0b111}},
+    {'U', {0b101, 0b101, 0b101, 0b101, 0b111}},
+    {'Z', {0b111, 0b001, 0b010, 0b100, 0b111}},
+};
+
+static void DrawText(uint32_t *framebuffer, int x, int y, const char *text)
+{
+    for (; *text; text++, x += 4)
+    {
+        for (const Glyph &glyph : font)
+        {
+            if (glyph.c != *text)
+                continue;
+
+            for (int row = 0; row < 5; row++)
+                for (int col = 0; col < 3; col++)
+                    if (glyph.rows[row] & (0x4 >> col))
+                        framebuffer[(y + row) * 160 + x + col] = 0xFFFFFFFF;
+            break;
+        }
+    }
+}
+
+void PerfCounters::DrawOverlay(uint32_t *framebuffer)
+{
+    PerfSnapshot snapshot = Snapshot();
+
+    char lines[4][16];
+    std::snprintf(lines[0], sizeof(lines[0]), "MHZ %5.2f", snapshot.emulatedMhz);
+    std::snprintf(lines[1], sizeof(lines[1]), "FPS %5.1f", snapshot.fps);
+    std::snprintf(lines[2], sizeof(lines[2]), "P50 %5.2f", snapshot.frameP50Ms);
+    std::snprintf(lines[3], sizeof(lines[3]), "P99 %5.2f", snapshot.frameP99Ms);
+
+    // Darken the area behind the text so it stays readable
+    const int width = 40, height = 4 * 6 + 2;
+    for (int y = 0; y < height; y++)
+        for (int x = 0; x < width; x++)
+        {
+            uint32_t &pixel = framebuffer[y * 160 + x];
+            pixel = 0xFF000000 | ((pixel >> 2) & 0x3F3F3F);
+        }
+
+    for (int i = 0; i < 4; i++)
+        DrawText(framebuffer, 2, 2 + i * 6, lines[i]);
+}
@@ -0,0 +1,288 @@
+#include "pixelfifo.h"
+#include "linerenderer.h"
+#include <cstring>
+
+PixelFifo::PixelFifo(MMUBase *memory, MachineState *state, SpriteIndex *sprites) : memory(memory), state(state), sprites(sprites) {}
+
+// Horizontally flipped tiles are pushed mirrored
+static uint8_t Reverse(uint8_t value)
+{
+    value = (value & 0xF0) >> 4 | (value & 0x0F) << 4;
+    value = (value & 0xCC) >> 2 | (value & 0x33) << 2;
+    return (value & 0xAA) >> 1 | (value & 0x55) << 1;
+}
+
+void PixelFifo::Start(uint64_t cycle)
+{
+    FifoState &fifo = state->fifo;
+    fifo = FifoState();
+    fifo.active = true;
+    fifo.start = cycle;
+    // The first tile is fetched twice, the first time for nothing
+    fifo.stall = 6;
+    fifo.discard = state->io[0x43] & 7;
+
+    int line = state->ppuLine;
+    if (line == 0)
+        state->windowLine = 0;
+
+    // Sprites are fetched left to right whatever their priority, the rank
+    // decides who keeps a pixel two of them cover
+    int count;
+    const uint8_t *list = sprites->Line(line, count);
+    for (int i = 0; i < count; i++)
+    {
+        uint8_t x = state->oam[list[i] * 4 + 1];
+        int j = fifo.spriteCount++;
+        while (j > 0 && state->oam[fifo.sprites[j - 1] * 4 + 1] > x)
+        {
+            fifo.sprites[j] = fifo.sprites[j - 1];
+            fifo.spriteRanks[j] = fifo.spriteRanks[j - 1];
+            j--;
+        }
+        fifo.sprites[j] = list[i];
+        fifo.spriteRanks[j] = i;
+    }
+}
+
+bool PixelFifo::Run(uint64_t cycle)
+{
+    FifoState &fifo = state->fifo;
+    while (!fifo.done && fifo.start + fifo.dot < cycle)
+    {
+        fifo.dot++;
+        if (Dot())
+        {
+            fifo.done = true;
+            // The window keeps its own line counter, it only advances on lines it was drawn
+            if (fifo.window)
+                state->windowLine++;
+        }
+    }
+    return fifo.done;
+}
+
+uint64_t PixelFifo::EarliestEnd() const
+{
+    const FifoState &fifo = state->fifo;
+    uint64_t end = fifo.start + fifo.dot;
+    if (!fifo.done)
+        end += fifo.stall + fifo.spriteWait + fifo.discard + (160 - fifo.x);
+    return end;
+}
+
+bool PixelFifo::Dot()
+{
+    FifoState &fifo = state->fifo;
+    const uint8_t *io = state->io;
+    uint8_t lcdc = io[0x40];
+
+    // Switched off part way, the rest of the line is never drawn
+    if (!(lcdc & 0x80))
+    {
+        fifo.x = 160;
+        return true;
+    }
+
+    // A sprite the LCD has reached lets the background fetch get to its
+    // last byte, then takes six dots of its own. With sprites off it is
+    // passed over.
+    if (!fifo.spriteWait && !fifo.stall && fifo.nextSprite < fifo.spriteCount &&
+        state->oam[fifo.sprites[fifo.nextSprite] * 4 + 1] <= fifo.x + 8)
+    {
+        int index = fifo.nextSprite++;
+        if (lcdc & 0x02)
+        {
+            FetchSprite(index);
+            fifo.spriteWait = fifo.fetchStep < 5 ? 5 - fifo.fetchStep : 0;
+            fifo.stall = 6;
+        }
+    }
+
+    if (fifo.spriteWait)
+    {
+        fifo.spriteWait--;
+        Fetch();
+        return false;
+    }
+    if (fifo.stall)
+    {
+        fifo.stall--;
+        return false;
+    }
+
+    // WX is the window's left edge plus seven; LCDC bit 0 only hides it on DMG
+    if (!fifo.window && (lcdc & 0x20) && ((lcdc & 0x01) || state->cgb) && state->ppuLine >= io[0x4A] && fifo.x + 7 >= io[0x4B])
+        StartWindow();
+
+    Fetch();
+    if (!fifo.bgCount)
+        return false;
+
+    uint8_t color = (fifo.bgLow >> 7) | (fifo.bgHigh >> 7) << 1;
+    fifo.bgLow <<= 1;
+    fifo.bgHigh <<= 1;
+    fifo.bgCount--;
+    if (fifo.discard)
+    {
+        fifo.discard--;
+        return false;
+    }
+
+    uint8_t objColor = 0;
+    uint8_t objAttributes = 0;
+    if (fifo.objCount)
+    {
+        objColor = fifo.objColor[0];
+        objAttributes = fifo.objAttributes[0];
+        std::memmove(fifo.objColor, fifo.objColor + 1, 7);
+        std::memmove(fifo.objAttributes, fifo.objAttributes + 1, 7);
+        std::memmove(fifo.objRank, fifo.objRank + 1, 7);
+        fifo.objColor[7] = 0;
+        fifo.objCount--;
+    }
+
+    if (drawing)
+        pixels[fifo.x] = Mix(color, fifo.bgAttributes, objColor, objAttributes);
+    return ++fifo.x == 160;
+}
+
+void PixelFifo::Fetch()
+{
+    FifoState &fifo = state->fifo;
+    const uint8_t *io = state->io;
+
+    switch (fifo.fetchStep)
+    {
+    case 1:
+    {
+        // Scroll is read per tile, so writes during the line move the rest of it
+        uint8_t lcdc = io[0x40];
+        uint16_t address;
+        if (fifo.window)
+            address = ((lcdc & 0x40) ? 0x9C00 : 0x9800) + (state->windowLine >> 3) * 32 + (fifo.fetchX & 31);
+        else
+        {
+            uint8_t y = state->ppuLine + io[0x42];
+            address = ((lcdc & 0x08) ? 0x9C00 : 0x9800) + (y >> 3) * 32 + (((io[0x43] >> 3) + fifo.fetchX) & 31);
+        }
+        fifo.tile = memory->ReadVram(0, address);
+        fifo.tileAttributes = state->cgb ? memory->ReadVram(1, address) : 0;
+        break;
+    }
+    case 3:
+        fifo.tileLow = memory->ReadVram((fifo.tileAttributes >> 3) & 1, TileRowAddress());
+        break;
+    case 5:
+        fifo.tileHigh = memory->ReadVram((fifo.tileAttributes >> 3) & 1, TileRowAddress() + 1);
+        break;
+    case 6:
+        // Waits for the FIFO to run dry, then refills it in one go
+        if (fifo.bgCount)
+            return;
+        if (fifo.tileAttributes & 0x20)
+        {
+            fifo.bgLow = Reverse(fifo.tileLow);
+            fifo.bgHigh = Reverse(fifo.tileHigh);
+        }
+        else
+        {
+            fifo.bgLow = fifo.tileLow;
+            fifo.bgHigh = fifo.tileHigh;
+        }
+        fifo.bgAttributes = fifo.tileAttributes;
+        fifo.bgCount = 8;
+        fifo.fetchX++;
+        fifo.fetchStep = 0;
+        return;
+    }
+    fifo.fetchStep++;
+}
+
+uint16_t PixelFifo::TileRowAddress() const
+{
+    const FifoState &fifo = state->fifo;
+    int row = (fifo.window ? state->windowLine : state->ppuLine + state->io[0x42]) & 7;
+    if (fifo.tileAttributes & 0x40)
+        row = 7 - row;
+    uint16_t tileAddress = (state->io[0x40] & 0x10) ? 0x8000 + fifo.tile * 16 : 0x9000 + static_cast<int8_t>(fifo.tile) * 16;
+    return tileAddress + row * 2;
+}
+
+void PixelFifo::FetchSprite(int index)
+{
+    FifoState &fifo = state->fifo;
+    const uint8_t *sprite = &state->oam[fifo.sprites[index] * 4];
+    int height = (state->io[0x40] & 0x04) ? 16 : 8;
+    int y = state->ppuLine - (sprite[0] - 16);
+    if (y < 0 || y >= height)
+        return;
+
+    uint8_t attributes = sprite[3];
+    if (attributes & 0x40)
+        y = height - 1 - y;
+    uint8_t tile = height == 16 ? sprite[2] & 0xFE : sprite[2];
+    int bank = state->cgb ? (attributes >> 3) & 1 : 0;
+    uint16_t address = 0x8000 + tile * 16 + y * 2;
+    uint8_t low = memory->ReadVram(bank, address);
+    uint8_t high = memory->ReadVram(bank, address + 1);
+    if (attributes & 0x20)
+    {
+        low = Reverse(low);
+        high = Reverse(high);
+    }
+
+    // Pixels left of the screen edge are gone already; a pixel another
+    // sprite filled stays unless this one ranks higher
+    int skipped = fifo.x + 8 - sprite[1];
+    uint8_t rank = fifo.spriteRanks[index];
+    for (int i = skipped; i < 8; i++)
+    {
+        uint8_t color = ((low >> (7 - i)) & 1) | ((high >> (7 - i)) & 1) << 1;
+        int slot = i - skipped;
+        if (color && (!fifo.objColor[slot] || rank < fifo.objRank[slot]))
+        {
+            fifo.objColor[slot] = color;
+            fifo.objAttributes[slot] = attributes;
+            fifo.objRank[slot] = rank;
+            if (fifo.objCount <= slot)
+                fifo.objCount = slot + 1;
+        }
+    }
+}
+
+void PixelFifo::StartWindow()
+{
+    // The background pixels still queued are dropped and the fetcher starts
+    // over on the window's first tile; WX below 7 cuts its left edge off
+    FifoState &fifo = state->fifo;
+    fifo.window = true;
+    fifo.discard = state->io[0x4B] < 7 ? 7 - state->io[0x4B] : 0;
+    fifo.fetchX = 0;
+    fifo.fetchStep = 0;
+    fifo.bgCount = 0;
+}
+
+uint32_t PixelFifo::Mix(uint8_t color, uint8_t attributes, uint8_t objColor, uint8_t objAttributes) const
+{
+    const uint8_t *io = state->io;
+    uint8_t lcdc = io[0x40];
+    bool cgb = state->cgb;
+
+    // LCDC bit 0 off blanks the background on DMG, on CGB it only takes away
+    // its priority over sprites
+    if (!(lcdc & 0x01) && !cgb)
+        color = 0;
+    bool backgroundPriority = !cgb || (lcdc & 0x01);
+
+    if (objColor && (lcdc & 0x02) && !(backgroundPriority && color && ((objAttributes & 0x80) || (attributes & 0x80))))
+    {
+        if (cgb)
+            return memory->objColors[(objAttributes & 0x07) * 4 + objColor];
+        return dmgShades[(io[0x48 + ((objAttributes >> 4) & 1)] >> (objColor * 2)) & 3];
+    }
+
+    if (cgb)
+        return memory->bgColors[(attributes & 0x07) * 4 + color];
+    return dmgShades[(io[0x47] >> (color * 2)) & 3];
+}
@@ -1,101 +1,387 @@
 #include "ppu.h"
 #include "mmu.h"
+#include "perf.h"
+#include "timeline.h"
+#include <cstring>
 
-PPU::PPU(MMU *memory, SDL_Renderer *renderer) : memory(memory), renderer(renderer)
+PPUBase::PPUBase(MMUBase *memory, MachineState *state, InterruptController *interrupts, SpriteIndex *sprites, TripleBuffer *frames)
+    : memory(memory), state(state), interrupts(interrupts), sprites(sprites), frames(frames), renderer(frames),
+      fifo(memory, state, sprites) {}
+
+PPUBase::~PPUBase()
 {
-    lcdc = 0x00;
-    stat = 0x00;
-    scy = 0x00;
-    scx = 0x00;
-    ly = 0x00;
-    lyc = 0x00;
+    if (vramView)
+        vramView->Release();
+    if (frameView)
+        frameView->Release();
+}
 
-    texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, 160, 144);
+void PPUBase::VramReplaced()
+{
+    // Shared pages are never written in place, so the same pointers mean
+    // the same contents. Palettes are hashed from the state itself.
+    bool same = frameView != nullptr;
+    for (int i = 0; same && i < VramView::PAGES; i++)
+        same = frameView->pages[i] == memory->VramPage(i / MachineState::VRAM_PAGES, i % MachineState::VRAM_PAGES);
+    if (!same)
+        linesValid = false;
 
-    for (int i = 0; i < 160 * 144; i++)
+    // The write generation didn't see the swap, pin again on the next line
+    if (vramView)
     {
-        framebuffer[i] = 0xFF000000;
+        vramView->Release();
+        vramView = nullptr;
     }
 }
 
-PPU::~PPU()
+template <typename Policy>
+void PPU<Policy>::CatchUp()
 {
-    if (texture)
-        SDL_DestroyTexture(texture);
-}
-
-void PPU::Step(int cycles)
-{
-    modeClock += cycles;
-
-    switch (mode)
+    // Each mode's deadline is set when it is entered, so the PPU state is
+    // exact whenever it is looked at without being advanced on every
+    // instruction. Interrupts are raised here, on the transitions.
+    while (state->cycles >= state->ppuNextEvent)
     {
-    case 2:
-        if (modeClock >= 80)
+        switch (state->ppuMode)
         {
-            mode = 3;
-            modeClock = 0;
-        }
-        break;
-
-    case 3:
-        if (modeClock >= 172)
-        {
-            RenderScanline();
-            mode = 0;
-            modeClock = 0;
-        }
-        break;
+        case 2:
+            state->ppuMode = 3;
+            state->ppuDrawingCycles = DRAWING_CYCLES;
+            if (Policy::PIXEL_FIFO && (state->io[0x40] & 0x80))
+            {
+                fifo.drawing = frames && drawFrame;
+                fifo.Start(state->ppuNextEvent);
+                state->ppuDrawingCycles = fifo.EarliestEnd() - state->ppuNextEvent;
+            }
+            state->ppuNextEvent += state->ppuDrawingCycles;
+            break;
 
-    case 0:
-        if (modeClock >= 204)
-        {
-            line++;
-            modeClock = 0;
+        case 3:
+            // With the FIFO the deadline is only the earliest the line can
+            // end; run it and move the deadline on until it does. A register
+            // write may have run it to the end already.
+            if (Policy::PIXEL_FIFO && state->fifo.active)
+            {
+                uint64_t start = state->fifo.start;
+                bool done = fifo.Run(state->cycles);
+                state->ppuNextEvent = fifo.EarliestEnd();
+                state->ppuDrawingCycles = static_cast<int32_t>(state->ppuNextEvent - start);
+                if (!done)
+                    break;
+                state->fifo.active = false;
+                RenderScanline(fifo.pixels);
+            }
+            else
+                RenderScanline(nullptr);
+            if (state->hdmaActive && (state->io[0x40] & 0x80))
+                memory->TransferHBlankBlock();
+            state->ppuMode = 0;
+            state->ppuNextEvent += LINE_CYCLES - OAM_SCAN_CYCLES - state->ppuDrawingCycles;
+            break;
 
-            if (line == 144)
+        case 0:
+            state->ppuLine++;
+            if (state->ppuLine == 144)
             {
-                mode = 1;
-                uint8_t iflag = memory->Read(0xFF0F);
-                memory->Write(0xFF0F, iflag | 0x01);
+                timeline.Emulated("VBlank", TRACK_PPU, state->ppuLine);
+                state->ppuMode = 1;
+                state->ppuNextEvent += LINE_CYCLES;
+                if (state->io[0x40] & 0x80)
+                    interrupts->Request(INTERRUPT_VBLANK);
             }
             else
             {
-                mode = 2;
+                state->ppuMode = 2;
+                state->ppuNextEvent += OAM_SCAN_CYCLES;
             }
-        }
-        break;
-
-    case 1:
-        if (modeClock >= 456)
-        {
-            line++;
-            modeClock = 0;
+            break;
 
-            if (line > 153)
+        case 1:
+            state->ppuLine++;
+            if (state->ppuLine > 153)
             {
-                line = 0;
-                mode = 2;
+                state->ppuLine = 0;
+                state->ppuMode = 2;
+                state->ppuNextEvent += OAM_SCAN_CYCLES;
             }
+            else
+            {
+                state->ppuNextEvent += LINE_CYCLES;
+            }
+            break;
         }
-        break;
+
+        UpdateStatLine();
     }
+}
 
-    memory->Write(0xFF44, line);
+void PPUBase::UpdateStatLine()
+{
+    // Sources are ORed into one line, so a source that becomes active while
+    // another still holds the line high raises nothing
+    uint8_t stat = state->io[0x41];
+    bool line = false;
+    if (state->io[0x40] & 0x80)
+    {
+        line = ((stat & 0x08) && state->ppuMode == 0) || ((stat & 0x10) && state->ppuMode == 1) ||
+               ((stat & 0x20) && state->ppuMode == 2) || ((stat & 0x40) && state->ppuLine == state->io[0x45]);
+    }
+
+    if (line && !state->statLine)
+        interrupts->Request(INTERRUPT_STAT);
+    state->statLine = line;
 }
 
-void PPU::RenderScanline()
+void PPUBase::SetLcdEnabled(bool enabled)
 {
-    for (int x = 0; x < 160; x++)
+    if (enabled)
+    {
+        state->ppuLine = 0;
+        state->ppuMode = 2;
+        state->ppuNextEvent = state->cycles + OAM_SCAN_CYCLES;
+    }
+    UpdateStatLine();
+}
+
+uint64_t PPUBase::NextInterruptEvent(const MachineState *state)
+{
+    if (!(state->io[0x40] & 0x80))
+        return UINT64_MAX;
+
+    // Any enabled STAT source may go high on the next transition
+    if (state->io[0x41] & 0x78)
+        return state->ppuNextEvent;
+
+    // Otherwise VBlank. Lines are always LINE_CYCLES long, whatever mode 3 took
+    uint64_t nextLine = state->ppuNextEvent;
+    if (state->ppuMode == 2)
+        nextLine += LINE_CYCLES - OAM_SCAN_CYCLES;
+    else if (state->ppuMode == 3)
+        nextLine += LINE_CYCLES - OAM_SCAN_CYCLES - state->ppuDrawingCycles;
+
+    int lines = state->ppuLine < 144 ? 143 - state->ppuLine : 153 - state->ppuLine + 144;
+    return nextLine + static_cast<uint64_t>(lines) * LINE_CYCLES;
+}
+
+void PPUBase::SyncFifo()
+{
+    if (state->ppuMode == 3 && state->fifo.active)
+        fifo.Run(state->cycles);
+}
+
+void PPUBase::RenderScanline(const uint32_t *pixels)
+{
+    // Headless machines (forks) have nowhere to draw
+    if (!frames || !drawFrame)
+        return;
+
+    int line = state->ppuLine;
+    const uint8_t *io = state->io;
+
+    // The FIFO keeps the window line counter itself
+    if (line == 0)
+    {
+        if (!pixels)
+            state->windowLine = 0;
+        frameChanged = false;
+    }
+
+    LineRecord record;
+    record.line = line;
+    record.lcdc = io[0x40];
+    record.scy = io[0x42];
+    record.scx = io[0x43];
+    record.wy = io[0x4A];
+    record.wx = io[0x4B];
+    record.bgp = io[0x47];
+    record.obp0 = io[0x48];
+    record.obp1 = io[0x49];
+    record.windowLine = state->windowLine;
+    record.window = WindowVisible(line);
+    record.view = nullptr;
+    record.prerendered = pixels != nullptr;
+    if (pixels)
+        std::memcpy(record.pixels, pixels, sizeof(record.pixels));
+    record.cgb = state->cgb;
+    if (record.cgb)
+    {
+        std::memcpy(record.bgColors, memory->bgColors, sizeof(record.bgColors));
+        std::memcpy(record.objColors, memory->objColors, sizeof(record.objColors));
+    }
+
+    // The overlay is drawn over the picture, so lines with it can't be reused
+    uint64_t signature = pixels ? PixelSignature(pixels) : LineSignature(line);
+    record.reuse = linesValid && !showPerfOverlay && signature == lineSignatures[line];
+    if (!record.reuse)
     {
-        uint32_t color = (line % 2 == 0) ? 0xFFFFFFFF : 0xFFAAAAAA;
-        framebuffer[line * 160 + x] = color;
+        lineSignatures[line] = signature;
+        frameChanged = true;
     }
 
+    if (record.window && !pixels)
+        state->windowLine++;
+
+    int count = 0;
+    const uint8_t *list = sprites->Line(line, count);
+    record.spriteHeight = state->spriteLines.height;
+    record.spriteCount = (record.lcdc & 0x02) ? count : 0;
+    for (int i = 0; i < record.spriteCount; i++)
+        std::memcpy(record.sprites[i], &state->oam[list[i] * 4], 4);
+
+    // Inline rendering can read the live pages, the worker gets a pinned view.
+    // CGB needs both banks, whichever one VBK maps in.
+    if (renderer.IsThreaded())
+        record.vram = PinVram(record.view);
+    else if (record.cgb)
+    {
+        for (int i = 0; i < VramView::PAGES; i++)
+            linePages[i] = memory->VramPage(i / MachineState::VRAM_PAGES, i % MachineState::VRAM_PAGES);
+        record.vram = linePages;
+    }
+    else
+        record.vram = state->pages;
+
+    record.publish = false;
+    record.showPerfOverlay = showPerfOverlay;
+    record.inputTimestamp = 0;
     if (line == 143)
     {
-        SDL_UpdateTexture(texture, nullptr, framebuffer, 160 * sizeof(uint32_t));
-        SDL_RenderClear(renderer);
-        SDL_RenderPresent(renderer);
+        perfBatch.frames++;
+        record.publish = frameChanged;
+        record.inputTimestamp = memory->observedInputTimestamp;
+        memory->observedInputTimestamp = 0;
+        // A frame the overlay was drawn over can't lend its lines to the next one
+        linesValid = !showPerfOverlay;
+
+        if (frameView)
+            frameView->Release();
+        PinVram(frameView);
+    }
+
+    renderer.Submit(record);
+}
+
+MemoryPage *const *PPUBase::PinVram(VramView *&view)
+{
+    if (!vramView || vramViewGeneration != memory->vramGeneration)
+    {
+        if (vramView)
+            vramView->Release();
+
+        vramView = new VramView;
+        vramView->refs = 1;
+        for (int i = 0; i < VramView::PAGES; i++)
+            vramView->pages[i] = memory->VramPage(i / MachineState::VRAM_PAGES, i % MachineState::VRAM_PAGES)->Retain();
+        vramViewGeneration = memory->vramGeneration;
+
+        // The mapped VRAM bank is the first 32 pages, the CPU has to copy any
+        // of them it writes now; the other bank is checked when VBK maps it
+        state->ownedPages[0] = 0;
     }
-}
\ No newline at end of file
+
+    view = vramView->Retain();
+    return vramView->pages;
+}
+
+bool PPUBase::WindowVisible(int line) const
+{
+    uint8_t lcdc = state->io[0x40];
+    // LCDC bit 0 only hides the window on DMG
+    return (lcdc & 0x80) && (lcdc & 0x20) && ((lcdc & 0x01) || state->cgb) && line >= state->io[0x4A] && state->io[0x4B] < 167;
+}
+
+static uint64_t Mix(uint64_t hash, uint64_t value)
+{
+    return (hash ^ value) * 0x100000001B3ull;
+}
+
+uint64_t PPUBase::LineSignature(int line)
+{
+    const uint8_t *io = state->io;
+    uint8_t lcdc = io[0x40];
+
+    // LCDC, palettes, scroll and window position
+    uint64_t hash = Mix(0xCBF29CE484222325ull, lcdc | io[0x47] << 8 | io[0x48] << 16 | static_cast<uint64_t>(io[0x49]) << 24 |
+                                                   static_cast<uint64_t>(io[0x42]) << 32 | static_cast<uint64_t>(io[0x43]) << 40 |
+                                                   static_cast<uint64_t>(io[0x4A]) << 48 | static_cast<uint64_t>(io[0x4B]) << 56);
+    if (!(lcdc & 0x80))
+        return hash;
+
+    bool unsignedTiles = lcdc & 0x10;
+
+    // Every tile the line touches, with how often its data was written
+    if ((lcdc & 0x01) || state->cgb)
+    {
+        uint8_t y = line + io[0x42];
+        uint16_t mapRow = ((lcdc & 0x08) ? 0x9C00 : 0x9800) + (y >> 3) * 32;
+        for (int column = io[0x43] >> 3, end = column + 21; column < end; column++)
+            hash = MixMapEntry(hash, mapRow + (column & 31), unsignedTiles);
+    }
+
+    if (WindowVisible(line))
+    {
+        uint8_t y = state->windowLine;
+        uint16_t mapRow = ((lcdc & 0x40) ? 0x9C00 : 0x9800) + (y >> 3) * 32;
+        hash = Mix(hash, y);
+        for (int column = 0, end = (166 - io[0x4B]) >> 3; column <= end; column++)
+            hash = MixMapEntry(hash, mapRow + column, unsignedTiles);
+    }
+
+    if (lcdc & 0x02)
+    {
+        const uint32_t *versions = memory->vramVersions;
+        int count;
+        const uint8_t *list = sprites->Line(line, count);
+        for (int i = 0; i < count; i++)
+        {
+            const uint8_t *sprite = &state->oam[list[i] * 4];
+            int block = state->spriteLines.height == 16 ? sprite[2] & 0xFE : sprite[2];
+            if (state->cgb && (sprite[3] & 0x08))
+                block += 0x200;
+            uint32_t bytes;
+            std::memcpy(&bytes, sprite, sizeof(bytes));
+            hash = Mix(hash, bytes | static_cast<uint64_t>(versions[block]) << 32);
+            if (state->spriteLines.height == 16)
+                hash = Mix(hash, versions[block + 1]);
+        }
+    }
+
+    // Colour palettes live outside the registers hashed above, and are shown
+    // through the current colour preset
+    if (state->cgb)
+    {
+        hash = Mix(hash, reinterpret_cast<uintptr_t>(memory->colorTable));
+        for (int i = 0; i < 64; i += 8)
+        {
+            uint64_t bg, obj;
+            std::memcpy(&bg, state->bgPalettes + i, sizeof(bg));
+            std::memcpy(&obj, state->objPalettes + i, sizeof(obj));
+            hash = Mix(Mix(hash, bg), obj);
+        }
+    }
+
+    return hash;
+}
+
+// A line the FIFO drew is reused only if it came out the same
+uint64_t PPUBase::PixelSignature(const uint32_t *pixels) const
+{
+    uint64_t hash = 0xCBF29CE484222325ull;
+    for (int x = 0; x < 160; x += 2)
+        hash = Mix(hash, pixels[x] | static_cast<uint64_t>(pixels[x + 1]) << 32);
+    return hash;
+}
+
+// A background or window map entry: the tile, on CGB its attributes, and
+// the version of the tile data in the bank they select
+uint64_t PPUBase::MixMapEntry(uint64_t hash, uint16_t mapAddress, bool unsignedTiles) const
+{
+    uint8_t tile = memory->ReadVram(0, mapAddress);
+    uint8_t attributes = state->cgb ? memory->ReadVram(1, mapAddress) : 0;
+    uint16_t tileAddress = unsignedTiles ? 0x8000 + tile * 16 : 0x9000 + static_cast<int8_t>(tile) * 16;
+    int block = (attributes & 0x08) << 6 | (tileAddress - 0x8000) >> 4;
+    return Mix(hash, tile | attributes << 8 | static_cast<uint64_t>(memory->vramVersions[block]) << 16);
+}
+
+template class PPU<FastCore>;
+template class PPU<AccurateCore>;
@@ -0,0 +1,258 @@
+#ifdef SIGMABOY_PROFILER
+#include "profiler.h"
+#include <algorithm>
+#include <cstdio>
+
+Profiler::Profiler(const Cartridge *cartridge, const MachineState *state) : cartridge(cartridge), state(state)
+{
+    romSize = std::max<uint32_t>(cartridge->GetBankCount(), 2) * 0x4000;
+    pcCount.assign(romSize + 0x8000, 0);
+    pcCycles.assign(romSize + 0x8000, 0);
+
+    nodes.push_back({0, 0, 0});
+    stack.push_back({0, 0xFFFF});
+}
+
+void Profiler::EnterCall(uint16_t target, uint16_t sp)
+{
+    // Frames at or below the new return address were abandoned, e.g. the
+    // game reloaded SP or dropped a return address and jumped out
+    while (stack.size() > 1 && stack.back().sp <= sp)
+        stack.pop_back();
+
+    if (stack.size() >= MAX_DEPTH)
+        return;
+
+    uint32_t parent = stack.back().node;
+    uint32_t location = Location(target);
+    uint64_t key = (static_cast<uint64_t>(parent) << 32) | location;
+
+    auto it = children.find(key);
+    uint32_t node;
+    if (it != children.end())
+    {
+        node = it->second;
+    }
+    else
+    {
+        node = static_cast<uint32_t>(nodes.size());
+        nodes.push_back({parent, location, 0});
+        children.emplace(key, node);
+    }
+
+    stack.push_back({node, sp});
+}
+
+void Profiler::LeaveCall(uint16_t sp)
+{
+    // Unwind frames the game skipped over, then pop the one being returned
+    // from. A RET that matches no frame (PUSH+RET jumps) leaves the stack be.
+    while (stack.size() > 1 && stack.back().sp < sp)
+        stack.pop_back();
+
+    if (stack.size() > 1 && stack.back().sp == sp)
+        stack.pop_back();
+}
+
+bool Profiler::LoadSymbols(const std::string &path)
+{
+    std::ifstream file(path);
+    if (!file)
+    {
+        std::cout << "Could not open symbol file: " << path << std::endl;
+        return false;
+    }
+
+    // RGBDS and no$gmb both use "BB:AAAA Label", ';' starts a comment
+    std::string line;
+    while (std::getline(file, line))
+    {
+        unsigned int bank, address;
+        char label[256];
+        if (line.empty() || line[0] == ';')
+            continue;
+        if (std::sscanf(line.c_str(), "%x:%x %255s", &bank, &address, label) != 3)
+            continue;
+
+        // Banked RAM labels still resolve against the flat 0x8000+ range
+        if (address < 0x4000 || address >= 0x8000)
+            bank = 0;
+        symbols[(bank << 16) | address] = label;
+    }
+
+    std::cout << "Loaded " << symbols.size() << " symbols from " << path << std::endl;
+    return true;
+}
+
+uint32_t Profiler::Location(uint16_t pc) const
+{
+    return IndexToLocation(Index(pc));
+}
+
+uint32_t Profiler::IndexToLocation(uint32_t index) const
+{
+    if (index < 0x4000)
+        return index;
+    if (index < romSize)
+        return ((index / 0x4000) << 16) | (0x4000 + index % 0x4000);
+    return 0x8000 + (index - romSize);
+}
+
+std::string Profiler::Function(uint32_t location) const
+{
+    char name[32];
+    auto it = symbols.upper_bound(location);
+    if (it != symbols.begin())
+    {
+        --it;
+        if ((it->first >> 16) == (location >> 16))
+            return it->second;
+    }
+
+    std::snprintf(name, sizeof(name), "%02X:%04X", location >> 16, location & 0xFFFF);
+    return name;
+}
+
+std::string Profiler::Label(uint32_t location) const
+{
+    char offset[16];
+    auto it = symbols.upper_bound(location);
+    if (it != symbols.begin())
+    {
+        --it;
+        if ((it->first >> 16) == (location >> 16))
+        {
+            if (it->first == location)
+                return it->second;
+            std::snprintf(offset, sizeof(offset), "+0x%X", location - it->first);
+            return it->second + offset;
+        }
+    }
+    return "";
+}
+
+void Profiler::WriteReport(const std::string &path) const
+{
+    std::ofstream out(path);
+    if (!out)
+    {
+        std::cout << "Could not write profile report: " << path << std::endl;
+        return;
+    }
+
+    uint64_t totalCycles = 0;
+    uint64_t totalCount = 0;
+    std::vector<uint32_t> hot;
+    for (uint32_t i = 0; i < pcCount.size(); i++)
+    {
+        if (pcCount[i] == 0)
+            continue;
+        hot.push_back(i);
+        totalCycles += pcCycles[i];
+        totalCount += pcCount[i];
+    }
+    std::sort(hot.begin(), hot.end(), [this](uint32_t a, uint32_t b)
+              { return pcCycles[a] > pcCycles[b]; });
+
+    char line[160];
+    out << "Instructions: " << totalCount << "  Cycles: " << totalCycles << "\n\n";
+    out << "Hot spots by cycles\n";
+    out << "  location        count       cycles      %  label\n";
+    for (size_t i = 0; i < hot.size() && i < 200; i++)
+    {
+        uint32_t location = IndexToLocation(hot[i]);
+        std::snprintf(line, sizeof(line), "  %02X:%04X  %12llu %12llu %6.2f  ", location >> 16, location & 0xFFFF,
+                      (unsigned long long)pcCount[hot[i]], (unsigned long long)pcCycles[hot[i]],
+                      totalCycles ? 100.0 * pcCycles[hot[i]] / totalCycles : 0.0);
+        out << line << Label(location) << "\n";
+    }
+
+    std::vector<uint16_t> opcodes;
+    for (uint16_t i = 0; i < 0x200; i++)
+    {
+        if (opcodeCount[i])
+            opcodes.push_back(i);
+    }
+    std::sort(opcodes.begin(), opcodes.end(), [this](uint16_t a, uint16_t b)
+              { return opcodeCycles[a] > opcodeCycles[b]; });
+
+    out << "\nOpcodes by cycles\n";
+    out << "  opcode        count       cycles      %\n";
+    for (uint16_t opcode : opcodes)
+    {
+        std::snprintf(line, sizeof(line), "  %s%02X  %12llu %12llu %6.2f\n", opcode >= 0x100 ? "CB " : "   ", opcode & 0xFF,
+                      (unsigned long long)opcodeCount[opcode], (unsigned long long)opcodeCycles[opcode],
+                      totalCycles ? 100.0 * opcodeCycles[opcode] / totalCycles : 0.0);
+        out << line;
+    }
+
+    std::cout << "Wrote profile report to " << path << std::endl;
+}
+
+void Profiler::WriteFoldedStacks(const std::string &path) const
+{
+    std::ofstream out(path);
+    if (!out)
+    {
+        std::cout << "Could not write folded stacks: " << path << std::endl;
+        return;
+    }
+
+    // One "root;caller;callee cycles" line per call path, as read by flamegraph.pl
+    std::vector<std::string> names(nodes.size());
+    names[0] = "root";
+    for (uint32_t i = 1; i < nodes.size(); i++)
+    {
+        // Parents are always created before their children
+        names[i] = names[nodes[i].parent] + ";" + Function(nodes[i].location);
+    }
+
+    for (uint32_t i = 0; i < nodes.size(); i++)
+    {
+        if (nodes[i].cycles)
+            out << names[i] << " " << nodes[i].cycles << "\n";
+    }
+
+    std::cout << "Wrote folded stacks to " << path << std::endl;
+}
+
+void Profiler::WriteCallgrind(const std::string &path) const
+{
+    std::ofstream out(path);
+    if (!out)
+    {
+        std::cout << "Could not write callgrind profile: " << path << std::endl;
+        return;
+    }
+
+    // Group instruction costs by the function they resolve to
+    std::map<std::string, std::vector<uint32_t>> functions;
+    for (uint32_t i = 0; i < pcCount.size(); i++)
+    {
+        if (pcCount[i])
+            functions[Function(IndexToLocation(i))].push_back(i);
+    }
+
+    out << "# callgrind format\n";
+    out << "version: 1\n";
+    out << "creator: SigmaBoy\n";
+    out << "positions: instr\n";
+    out << "events: Instructions Cycles\n\n";
+    out << "ob=" << cartridge->GetTitle().c_str() << "\n";
+
+    char line[64];
+    for (const auto &function : functions)
+    {
+        out << "fn=" << function.first << "\n";
+        for (uint32_t index : function.second)
+        {
+            std::snprintf(line, sizeof(line), "0x%X %llu %llu\n", IndexToLocation(index),
+                          (unsigned long long)pcCount[index], (unsigned long long)pcCycles[index]);
+            out << line;
+        }
+    }
+
+    std::cout << "Wrote callgrind profile to " << path << std::endl;
+}
+
+#endif
@@ -0,0 +1,109 @@
+#include "sprites.h"
+
+void SpriteIndex::WriteOAM(uint8_t offset, uint8_t value)
+{
+    uint8_t previous = state->oam[offset];
+    state->oam[offset] = value;
+    if (previous == value)
+        return;
+
+    int sprite = offset >> 2;
+    switch (offset & 3)
+    {
+    case 0: // Y
+        SetCoverage(sprite, previous, false);
+        SetCoverage(sprite, value, true);
+        break;
+    case 1: // X only changes the order within the lines
+        MarkDirty(sprite);
+        break;
+    }
+}
+
+void SpriteIndex::SetHeight(uint8_t height)
+{
+    if (state->spriteLines.height == height)
+        return;
+
+    state->spriteLines.height = height;
+    Rebuild();
+}
+
+void SpriteIndex::Rebuild()
+{
+    SpriteLines &lines = state->spriteLines;
+    if (!lines.height)
+        lines.height = 8;
+
+    for (int line = 0; line < SpriteLines::LINES; line++)
+    {
+        lines.covering[line] = 0;
+        lines.dirty[line] = true;
+    }
+
+    for (int sprite = 0; sprite < 40; sprite++)
+        SetCoverage(sprite, state->oam[sprite * 4], true);
+}
+
+const uint8_t *SpriteIndex::Line(int line, int &count)
+{
+    SpriteLines &lines = state->spriteLines;
+    if (lines.dirty[line])
+    {
+        // The first ten in OAM order are picked, then sorted by X. Insertion
+        // keeps OAM order for equal X. CGB goes by OAM order alone.
+        bool byX = !state->cgb;
+        uint64_t covering = lines.covering[line];
+        uint8_t *list = lines.sprites[line];
+        int n = 0;
+        for (int sprite = 0; covering && n < MAX_PER_LINE; sprite++, covering >>= 1)
+        {
+            if (!(covering & 1))
+                continue;
+
+            uint8_t x = state->oam[sprite * 4 + 1];
+            int i = n++;
+            while (byX && i > 0 && state->oam[list[i - 1] * 4 + 1] > x)
+            {
+                list[i] = list[i - 1];
+                i--;
+            }
+            list[i] = sprite;
+        }
+        lines.count[line] = n;
+        lines.dirty[line] = false;
+    }
+
+    count = lines.count[line];
+    return lines.sprites[line];
+}
+
+void SpriteIndex::SetCoverage(int sprite, uint8_t y, bool covered)
+{
+    SpriteLines &lines = state->spriteLines;
+
+    // OAM Y is the screen line plus 16
+    int top = y - 16;
+    for (int line = top; line < top + lines.height; line++)
+    {
+        if (line < 0 || line >= SpriteLines::LINES)
+            continue;
+
+        if (covered)
+            lines.covering[line] |= 1ull << sprite;
+        else
+            lines.covering[line] &= ~(1ull << sprite);
+        lines.dirty[line] = true;
+    }
+}
+
+void SpriteIndex::MarkDirty(int sprite)
+{
+    SpriteLines &lines = state->spriteLines;
+    int top = state->oam[sprite * 4] - 16;
+    for (int line = top; line < top + lines.height; line++)
+    {
+        if (line >= 0 && line < SpriteLines::LINES)
+            lines.dirty[line] = true;
+    }
+}
@@ -0,0 +1,139 @@
+#include "timeline.h"
+#include "perf.h"
+#include <fstream>
+#include <iostream>
+
+Timeline timeline;
+
+// Identifies which buffers belong to the current thread, reset by Start
+static thread_local void *threadBuffer = nullptr;
+static thread_local uint32_t threadGeneration = 0;
+static std::atomic<uint32_t> generation{1};
+
+static const char *trackNames[TRACK_COUNT] = {"Host", "PPU", "Interrupts", "DMA", "Cartridge"};
+static const double CYCLES_PER_US = 4.194304;
+
+void Timeline::Start(const std::string &path)
+{
+    std::lock_guard<std::mutex> lock(buffersMutex);
+    buffers.clear();
+    this->path = path;
+    startTime = PerfCounters::Now();
+    generation++;
+    enabled = true;
+}
+
+Timeline::Buffer *Timeline::ThreadBuffer()
+{
+    if (threadBuffer && threadGeneration == generation.load(std::memory_order_relaxed))
+        return static_cast<Buffer *>(threadBuffer);
+
+    std::lock_guard<std::mutex> lock(buffersMutex);
+    buffers.push_back(std::unique_ptr<Buffer>(new Buffer()));
+    Buffer *buffer = buffers.back().get();
+    buffer->events.resize(EVENTS_PER_THREAD);
+    buffer->tid = static_cast<uint32_t>(buffers.size());
+    buffer->name = "Thread " + std::to_string(buffer->tid);
+
+    threadBuffer = buffer;
+    threadGeneration = generation;
+    return buffer;
+}
+
+void Timeline::NameThread(const char *name)
+{
+    if (IsEnabled())
+        ThreadBuffer()->name = name;
+}
+
+void Timeline::Record(const TimelineEvent &event)
+{
+    Buffer *buffer = ThreadBuffer();
+    if (buffer->count == buffer->events.size())
+    {
+        buffer->dropped++;
+        return;
+    }
+    buffer->events[buffer->count++] = event;
+}
+
+void Timeline::Stop()
+{
+    if (!IsEnabled())
+        return;
+    enabled = false;
+
+    std::lock_guard<std::mutex> lock(buffersMutex);
+    std::ofstream out(path);
+    if (!out)
+    {
+        std::cout << "Could not write timeline: " << path << std::endl;
+        return;
+    }
+
+    // Host threads live in pid 1, emulated-time tracks in pid 2
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    out << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"Host\"}},\n";
+    out << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":2,\"args\":{\"name\":\"Emulated time\"}}";
+    for (int track = TRACK_HOST + 1; track < TRACK_COUNT; track++)
+    {
+        out << ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":2,\"tid\":" << track
+            << ",\"args\":{\"name\":\"" << trackNames[track] << "\"}}";
+    }
+
+    uint64_t dropped = 0;
+    for (const auto &buffer : buffers)
+    {
+        out << ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buffer->tid
+            << ",\"args\":{\"name\":\"" << buffer->name << "\"}}";
+
+        for (size_t i = 0; i < buffer->count; i++)
+        {
+            const TimelineEvent &event = buffer->events[i];
+            double ts, dur;
+            int pid, tid;
+            if (event.track == TRACK_HOST)
+            {
+                ts = (event.start - startTime) / 1000.0;
+                dur = event.duration / 1000.0;
+                pid = 1;
+                tid = buffer->tid;
+            }
+            else
+            {
+                ts = event.start / CYCLES_PER_US;
+                dur = event.duration / CYCLES_PER_US;
+                pid = 2;
+                tid = event.track;
+            }
+
+            out << ",\n{\"name\":\"" << event.name << "\",\"pid\":" << pid << ",\"tid\":" << tid << ",\"ts\":" << ts;
+            if (event.track != TRACK_HOST && event.duration == 0)
+                out << ",\"ph\":\"i\",\"s\":\"t\"";
+            else
+                out << ",\"ph\":\"X\",\"dur\":" << dur;
+            out << ",\"args\":{\"value\":" << event.arg << "}}";
+        }
+        dropped += buffer->dropped;
+    }
+    out << "\n]}\n";
+
+    std::cout << "Wrote timeline to " << path;
+    if (dropped)
+        std::cout << " (" << dropped << " events dropped, buffers full)";
+    std::cout << std::endl;
+
+    buffers.clear();
+}
+
+TimelineSpan::TimelineSpan(const char *name) : name(name)
+{
+    if (timeline.IsEnabled())
+        start = PerfCounters::Now();
+}
+
+TimelineSpan::~TimelineSpan()
+{
+    if (start && timeline.IsEnabled())
+        timeline.Record({name, start, PerfCounters::Now() - start, 0, TRACK_HOST});
+}
@@ -0,0 +1,39 @@
+#include "triplebuffer.h"
+
+TripleBuffer::TripleBuffer()
+{
+    for (auto &buffer : buffers)
+    {
+        for (uint32_t &pixel : buffer)
+        {
+            pixel = 0xFF000000;
+        }
+    }
+}
+
+uint32_t *TripleBuffer::Publish(uint64_t inputTimestamp)
+{
+    if (droppedInputTimestamp && (!inputTimestamp || droppedInputTimestamp < inputTimestamp))
+        inputTimestamp = droppedInputTimestamp;
+    inputTimestamps[back] = inputTimestamp;
+
+    // Hand the back slot over and take whatever sat in the middle
+    uint8_t previous = middle.exchange(back | FRESH, std::memory_order_acq_rel);
+    back = previous & 0x3;
+
+    // Still fresh means the consumer never saw it, its input carries over
+    droppedInputTimestamp = (previous & FRESH) ? inputTimestamps[back] : 0;
+    return buffers[back];
+}
+
+const uint32_t *TripleBuffer::AcquireLatest(uint64_t *inputTimestamp)
+{
+    if (!(middle.load(std::memory_order_relaxed) & FRESH))
+        return nullptr;
+
+    uint8_t previous = middle.exchange(front, std::memory_order_acq_rel);
+    front = previous & 0x3;
+    if (inputTimestamp)
+        *inputTimestamp = inputTimestamps[front];
+    return buffers[front];
+}
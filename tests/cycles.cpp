@@ -0,0 +1,85 @@
+#include <memory>
+#include "test.h"
+#include "cpu.h"
+#include "flatbus.h"
+
+// Every M-cycle an instruction takes must be a bus access or an explicit
+// idle cycle, or the accurate core lets the PPU fall behind mid-instruction
+static const uint8_t ILLEGAL[] = {0xD3, 0xDB, 0xDD, 0xE3, 0xE4, 0xEB, 0xEC, 0xED, 0xF4, 0xFC, 0xFD};
+
+struct Harness
+{
+    std::unique_ptr<FlatBus> bus{new FlatBus()};
+    std::unique_ptr<MachineState> state{new MachineState()};
+    InterruptController interrupts{state.get()};
+    CPU<FlatBus> cpu{bus.get(), state.get(), &interrupts};
+
+    Harness() { cpu.bulkLoops = false; }
+
+    // HALT, STOP and EI leave state behind that would change the next fetch
+    void Reset() { *state = MachineState(); }
+
+    // Runs one instruction at 0xC000 and returns its cycles and bus M-cycles
+    std::pair<int, uint64_t> Run(std::initializer_list<uint8_t> code, uint8_t flags)
+    {
+        std::copy(code.begin(), code.end(), bus->data + 0xC000);
+        Registers &registers = *cpu.registers;
+        registers.pc = 0xC000;
+        registers.sp = 0xD000;
+        registers.hl = 0xC800;
+        registers.f = flags;
+        bus->mCycles = 0;
+        int cycles = cpu.Step();
+        return {cycles, bus->mCycles};
+    }
+};
+
+static void CheckOpcodes()
+{
+    Harness harness;
+    for (int opcode = 0; opcode < 0x100; opcode++)
+    {
+        if (opcode == 0xCB || std::find(std::begin(ILLEGAL), std::end(ILLEGAL), opcode) != std::end(ILLEGAL))
+            continue;
+        // All flags clear and all set, so conditional branches go both ways
+        for (uint8_t flags : {0x00, 0xF0})
+        {
+            harness.Reset();
+            auto result = harness.Run({static_cast<uint8_t>(opcode), 0x00, 0x00}, flags);
+            if (result.first != static_cast<int>(result.second * 4))
+                std::cout << "opcode " << std::hex << opcode << std::dec << ": " << result.first
+                          << " cycles, " << result.second << " M-cycles" << std::endl;
+            CHECK(result.first == static_cast<int>(result.second * 4));
+        }
+    }
+
+    for (int opcode = 0; opcode < 0x100; opcode++)
+    {
+        harness.Reset();
+        auto result = harness.Run({0xCB, static_cast<uint8_t>(opcode)}, 0x00);
+        if (result.first != static_cast<int>(result.second * 4))
+            std::cout << "CB opcode " << std::hex << opcode << std::dec << ": " << result.first
+                      << " cycles, " << result.second << " M-cycles" << std::endl;
+        CHECK(result.first == static_cast<int>(result.second * 4));
+    }
+}
+
+// Dispatch is two idle M-cycles, the two pushes and one more idle
+static void CheckInterruptDispatch()
+{
+    Harness harness;
+    harness.interrupts.WriteIE(0x01);
+    harness.interrupts.SetIME(true);
+    harness.interrupts.Request(0x01);
+    auto result = harness.Run({0x00}, 0x00);
+    CHECK(result.first == 20);
+    CHECK(result.second == 5);
+    CHECK(harness.cpu.registers->pc == 0x0040);
+}
+
+int main()
+{
+    CheckOpcodes();
+    CheckInterruptDispatch();
+    return TestResult();
+}
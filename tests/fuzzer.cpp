@@ -0,0 +1,47 @@
+#include "test.h"
+#include "cartridge.h"
+#include "fuzzer.h"
+
+// A spin loop must be reported as a hang at the default input length, a
+// loop that branches on the buttons must not
+int main()
+{
+    TestRom spin;
+    spin.Place(0x0150, {0x18, 0xFE}); // JR 0150h
+    TestRom poll;
+    poll.Place(0x0150, {
+                           0x3E, 0x00,       // LD A, 00h
+                           0xE0, 0x00,       // LDH (00h), A
+                           0xF0, 0x00,       // LDH A, (00h)
+                           0xCB, 0x47,       // BIT 0, A
+                           0x28, 0x01,       // JR Z, +1
+                           0x00,             // NOP
+                           0x18, 0xF7,       // JR 0154h
+                       });
+
+    FuzzOptions options;
+    std::vector<uint8_t> idle(options.frames, 0x00);
+    std::vector<uint8_t> mashing(options.frames);
+    for (int frame = 0; frame < options.frames; frame++)
+        mashing[frame] = frame & 1 ? 0xFF : 0x00;
+
+    for (CoreType core : {CoreType::FAST, CoreType::ACCURATE})
+    {
+        options.core = core;
+
+        Cartridge spinning(spin.Save("fuzzer-spin"));
+        Fuzzer spinFuzzer(&spinning, options);
+        Fuzzer::Result hang = spinFuzzer.Replay(mashing);
+        CHECK(hang.outcome == Fuzzer::Outcome::HANG);
+        CHECK(hang.pc == 0x0150);
+        CHECK(hang.frame < options.frames);
+
+        // Without input changes nothing says the loop ignores the buttons
+        CHECK(spinFuzzer.Replay(idle).outcome == Fuzzer::Outcome::OK);
+
+        Cartridge polling(poll.Save("fuzzer-poll"));
+        CHECK(Fuzzer(&polling, options).Replay(mashing).outcome == Fuzzer::Outcome::OK);
+    }
+
+    return TestResult();
+}
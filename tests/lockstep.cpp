@@ -0,0 +1,293 @@
+#include <cstring>
+#include <memory>
+#include "test.h"
+#include "cartridge.h"
+#include "flatbus.h"
+#include "loops.h"
+#include "machine.h"
+
+// Bulk loops must be invisible: a machine running every known copy and
+// fill idiom in bulk stays in lockstep with one running it an instruction
+// at a time, and RunLoop turns down the cases it can't keep that promise in
+static const int FRAMES = 6;
+
+struct Options
+{
+    bool vram = false;        // the loop writes VRAM with the LCD on
+    bool interrupts = false;  // VBlank and HBlank STAT handlers
+    bool doubleSpeed = false; // CGB, switched through KEY1 and STOP
+    bool hdma = false;        // an HBlank DMA runs under the loop
+};
+
+// Calls the loop over and over with a pass counter in HRAM as the count
+// (0 meaning 256), so short runs the CPU must not batch are mixed in
+static TestRom LoopRom(const LoopSignature &loop, const Options &options)
+{
+    TestRom rom;
+    rom.data[0x143] = options.doubleSpeed || options.hdma ? 0x80 : 0x00;
+    for (int i = 0; i < 0x800; i++)
+        rom.data[0x2000 + i] = i * 37 + 11;
+
+    // Both handlers count in HRAM, so a dispatch landing one instruction
+    // off shows up in the comparison
+    const uint8_t handler[] = {0xF5, 0xF0, 0x81, 0x3C, 0xE0, 0x81, 0xF1, 0xD9};
+    std::copy(std::begin(handler), std::end(handler), rom.data.begin() + 0x40);
+    std::copy(std::begin(handler), std::end(handler), rom.data.begin() + 0x48);
+
+    std::copy(loop.code, loop.code + loop.length, rom.data.begin() + 0x0300);
+    rom.data[0x0300 + loop.length] = 0xC9; // RET
+
+    std::vector<uint8_t> code = {0x31, 0xFE, 0xFF}; // LD SP, FFFEh
+    auto emit = [&code](std::initializer_list<uint8_t> bytes) { code.insert(code.end(), bytes); };
+    if (options.doubleSpeed)
+        emit({0x3E, 0x01, 0xE0, 0x4D, 0x10, 0x00}); // KEY1 armed; STOP
+    if (options.interrupts)
+        emit({0x3E, 0x08, 0xE0, 0x41, 0x3E, 0x03, 0xE0, 0xFF, 0xFB}); // STAT on HBlank; IE; EI
+    if (options.hdma)
+        emit({0x3E, 0x20, 0xE0, 0x51, 0xAF, 0xE0, 0x52, 0x3E, 0x10, 0xE0, 0x53, 0xAF, 0xE0, 0x54}); // 2000h to 9000h
+    emit({0xAF, 0xE0, 0x80}); // pass counter
+
+    size_t top = code.size();
+    if (options.hdma)
+        emit({0x3E, 0xFF, 0xE0, 0x55}); // HBlank DMA of 128 blocks, restarted every pass
+    emit({0xF0, 0x80, 0x3C, 0xE0, 0x80}); // A = ++pass
+
+    // Up to 1 KB for BC, so each target area holds any count
+    switch (loop.counter)
+    {
+    case LoopCounter::B:
+        emit({0x47}); // LD B, A
+        break;
+    case LoopCounter::C:
+        emit({0x4F}); // LD C, A
+        break;
+    case LoopCounter::BC:
+        emit({0x4F, 0xE6, 0x03, 0x47}); // LD C, A; AND 3; LD B, A
+        break;
+    }
+
+    uint16_t target = options.vram ? 0x8800 : 0xC800;
+    uint16_t hl = loop.step > 0 ? target : target + 0x7FF;
+    uint16_t de = 0x2000;
+    if (loop.kind == LoopKind::COPY_HL_TO_DE)
+        std::swap(hl, de);
+    emit({0x21, static_cast<uint8_t>(hl), static_cast<uint8_t>(hl >> 8)});
+    emit({0x11, static_cast<uint8_t>(de), static_cast<uint8_t>(de >> 8)});
+    emit({0xCD, 0x00, 0x03}); // CALL 0300h
+    emit({0x18, static_cast<uint8_t>(top - (code.size() + 2))});
+
+    std::copy(code.begin(), code.end(), rom.data.begin() + 0x0150);
+    return rom;
+}
+
+// The same copy run over its own code in RAM, source and destination alike,
+// so the bytes never change; only where it runs decides if it overlaps. The
+// 48 bytes from C0D8h end just past the code, so every pass that could still
+// be batched would write it.
+static TestRom SelfCopyRom(uint16_t area)
+{
+    TestRom rom;
+    const uint8_t loop[] = {0x2A, 0x12, 0x13, 0x05, 0x20, 0xFA, 0xC9};
+    std::copy(std::begin(loop), std::end(loop), rom.data.begin() + 0x0300);
+    rom.Place(0x0150, {
+                          0x31, 0xFE, 0xFF,       // LD SP, FFFEh
+                          0x21, 0x00, 0x03,       // LD HL, 0300h
+                          0x11, 0x00, 0xC1,       // LD DE, C100h
+                          0x06, 0x07,             // LD B, 7
+                          0x2A, 0x12, 0x1C, 0x05, // LD A, (HL+); LD (DE), A; INC E; DEC B
+                          0x20, 0xFA,             // JR NZ, not one of the idioms
+                          0x21, static_cast<uint8_t>(area), static_cast<uint8_t>(area >> 8),
+                          0x54, 0x5D,             // LD D, H; LD E, L
+                          0x06, 0x30,             // LD B, 48
+                          0xCD, 0x00, 0xC1,       // CALL C100h
+                          0x18, 0xF4,             // JR back to LD HL
+                      });
+    return rom;
+}
+
+struct LockstepResult
+{
+    int bulkSteps = 0;       // steps the plain machine needed more than one for
+    int bulkStepsInMode3 = 0;
+    int mismatches = 0;
+};
+
+static bool SameState(const MachineState *a, const MachineState *b)
+{
+    return a->cycles == b->cycles && a->doubleSpeed == b->doubleSpeed &&
+           std::memcmp(&a->registers, &b->registers, sizeof(Registers)) == 0 &&
+           std::memcmp(a->io, b->io, sizeof(a->io)) == 0 &&
+           std::memcmp(a->hram, b->hram, sizeof(a->hram)) == 0;
+}
+
+static bool SameMemory(const MachineState *a, const MachineState *b)
+{
+    for (int page = 0; page < MachineState::PAGE_COUNT; page++)
+    {
+        if (std::memcmp(a->pages[page]->data, b->pages[page]->data, MemoryPage::SIZE))
+            return false;
+    }
+    return true;
+}
+
+// Steps the bulk machine and brings the plain one to the same cycle after
+// every step; both must agree there on registers, IO, HRAM and memory
+static LockstepResult Lockstep(const std::string &path, CoreType core)
+{
+    Cartridge cartridge(path);
+    std::unique_ptr<Machine> bulk(Machine::Create(core, &cartridge, nullptr));
+    std::unique_ptr<Machine> plain(Machine::Create(core, &cartridge, nullptr));
+    plain->cpu->bulkLoops = false;
+
+    LockstepResult result;
+    for (int frame = 0; frame < FRAMES && !result.mismatches; frame++)
+    {
+        uint64_t end = (frame + 1) * 154 * PPUBase::LINE_CYCLES;
+        while (bulk->state->cycles < end && !result.mismatches)
+        {
+            // The accurate core's JR can reach mode 0 before RunLoop looks,
+            // the fast one only catches the PPU up after the step
+            bool mode3 = bulk->state->ppuMode == 3 && core == CoreType::FAST;
+            if (!bulk->Step())
+            {
+                result.mismatches++;
+                break;
+            }
+            int steps = 0;
+            while (plain->state->cycles < bulk->state->cycles && plain->Step())
+                steps++;
+            if (steps > 1)
+            {
+                result.bulkSteps++;
+                result.bulkStepsInMode3 += mode3;
+            }
+            if (!SameState(bulk->state, plain->state))
+                result.mismatches++;
+        }
+        if (!SameMemory(bulk->state, plain->state))
+            result.mismatches++;
+    }
+    return result;
+}
+
+static void CheckSignatures()
+{
+    for (int i = 0; i < loopSignatureCount; i++)
+    {
+        const LoopSignature &loop = loopSignatures[i];
+        for (CoreType core : {CoreType::FAST, CoreType::ACCURATE})
+        {
+            Options options;
+            LockstepResult result = Lockstep(LoopRom(loop, options).Save("lockstep"), core);
+            CHECK(result.mismatches == 0);
+            CHECK(result.bulkSteps > 0);
+
+            options.interrupts = true;
+            result = Lockstep(LoopRom(loop, options).Save("lockstep"), core);
+            CHECK(result.mismatches == 0);
+
+            options.doubleSpeed = true;
+            result = Lockstep(LoopRom(loop, options).Save("lockstep"), core);
+            CHECK(result.mismatches == 0);
+
+            options.interrupts = false;
+            result = Lockstep(LoopRom(loop, options).Save("lockstep"), core);
+            CHECK(result.mismatches == 0);
+            CHECK(result.bulkSteps > 0);
+
+            // VRAM is only written in bulk outside mode 3
+            options = Options();
+            options.vram = true;
+            result = Lockstep(LoopRom(loop, options).Save("lockstep"), core);
+            CHECK(result.mismatches == 0);
+            CHECK(result.bulkSteps > 0);
+            CHECK(result.bulkStepsInMode3 == 0);
+
+            options = Options();
+            options.hdma = true;
+            result = Lockstep(LoopRom(loop, options).Save("lockstep"), core);
+            CHECK(result.mismatches == 0);
+
+            if (result.mismatches)
+                std::cout << "signature " << i << " on the " << (core == CoreType::FAST ? "fast" : "accurate")
+                          << " core" << std::endl;
+        }
+    }
+}
+
+static void CheckSelfCopy()
+{
+    for (CoreType core : {CoreType::FAST, CoreType::ACCURATE})
+    {
+        LockstepResult over = Lockstep(SelfCopyRom(0xC0D8).Save("lockstep-self"), core);
+        CHECK(over.mismatches == 0);
+        CHECK(over.bulkSteps == 0);
+
+        LockstepResult apart = Lockstep(SelfCopyRom(0xC200).Save("lockstep-self"), core);
+        CHECK(apart.mismatches == 0);
+        CHECK(apart.bulkSteps > 0);
+    }
+}
+
+// RunLoop on its own, with a fill loop at C000h that has 128 passes left
+struct LoopHarness
+{
+    std::unique_ptr<FlatBus> bus{new FlatBus()};
+    std::unique_ptr<MachineState> state{new MachineState()};
+    InterruptController interrupts{state.get()};
+    CPU<FlatBus> cpu{bus.get(), state.get(), &interrupts};
+
+    LoopHarness(uint16_t hl)
+    {
+        const uint8_t loop[] = {0x22, 0x05, 0x20, 0xFC}; // LD (HL+), A; DEC B; JR NZ
+        std::copy(std::begin(loop), std::end(loop), bus->data + 0xC000);
+        cpu.registers->hl = hl;
+        cpu.registers->b = 0x80;
+    }
+
+    int Run() { return cpu.RunLoop(0xC000, 0xC002); }
+};
+
+static void CheckRefusals()
+{
+    CHECK(LoopHarness(0xD000).Run() > 0);
+
+    // A pending interrupt is taken before the next pass
+    LoopHarness pending(0xD000);
+    pending.interrupts.WriteIE(INTERRUPT_VBLANK);
+    pending.interrupts.SetIME(true);
+    pending.interrupts.Request(INTERRUPT_VBLANK);
+    CHECK(pending.Run() == 0);
+
+    // VRAM is locked in mode 3, outside it the loop runs up to the next mode
+    LoopHarness vram(0x8000);
+    vram.state->io[0x40] = 0x80;
+    vram.state->ppuMode = 3;
+    vram.state->ppuNextEvent = 1000;
+    CHECK(vram.Run() == 0);
+    vram.state->ppuMode = 0;
+    int cycles = vram.Run();
+    CHECK(cycles > 0 && cycles <= 1000 - 12);
+
+    // A HBlank DMA block comes at the next mode change, whatever the loop writes
+    LoopHarness hdma(0xD000);
+    hdma.state->io[0x40] = 0x80;
+    hdma.state->hdmaActive = true;
+    hdma.state->ppuNextEvent = 40;
+    CHECK(hdma.Run() == 0);
+    hdma.state->ppuNextEvent = 1000;
+    cycles = hdma.Run();
+    CHECK(cycles > 0 && cycles <= 1000 - 12);
+
+    // The fill would run over its own code
+    CHECK(LoopHarness(0xBFC0).Run() == 0);
+    CHECK(LoopHarness(0xC004).Run() > 0);
+}
+
+int main()
+{
+    CheckSignatures();
+    CheckSelfCopy();
+    CheckRefusals();
+    return TestResult();
+}
@@ -0,0 +1,165 @@
+#include <memory>
+#include <vector>
+#include "test.h"
+#include "cpu.h"
+#include "flatbus.h"
+
+// Opcode conformance on the flat bus: each case runs one instruction at
+// 0xC000 and checks every register, the flags, the memory it writes and
+// both the cycles it reports and the M-cycles it put on the bus
+struct RegisterSet
+{
+    uint16_t af, bc, de, hl, sp, pc;
+};
+
+struct Case
+{
+    const char *name;
+    std::vector<uint8_t> code;
+    RegisterSet in;
+    RegisterSet out;
+    int cycles;
+    std::vector<std::pair<uint16_t, uint8_t>> memoryIn;
+    std::vector<std::pair<uint16_t, uint8_t>> memoryOut;
+};
+
+// Flags are the low byte of AF: Z 80, N 40, H 20, C 10
+static const Case CASES[] = {
+    // Loads
+    {"NOP", {0x00}, {0, 0, 0, 0, 0xD000, 0xC000}, {0, 0, 0, 0, 0xD000, 0xC001}, 4, {}, {}},
+    {"LD BC, d16", {0x01, 0x34, 0x12}, {0, 0, 0, 0, 0xD000, 0xC000}, {0, 0x1234, 0, 0, 0xD000, 0xC003}, 12, {}, {}},
+    {"LD (BC), A", {0x02}, {0x5A00, 0xD000, 0, 0, 0xD000, 0xC000}, {0x5A00, 0xD000, 0, 0, 0xD000, 0xC001}, 8, {}, {{0xD000, 0x5A}}},
+    {"LD A, (BC)", {0x0A}, {0, 0xD000, 0, 0, 0xD000, 0xC000}, {0x9900, 0xD000, 0, 0, 0xD000, 0xC001}, 8, {{0xD000, 0x99}}, {}},
+    {"LD (a16), SP", {0x08, 0x00, 0xD0}, {0, 0, 0, 0, 0xBEEF, 0xC000}, {0, 0, 0, 0, 0xBEEF, 0xC003}, 20, {}, {{0xD000, 0xEF}, {0xD001, 0xBE}}},
+    {"LD (HL+), A", {0x22}, {0x7700, 0, 0, 0xD000, 0xD000, 0xC000}, {0x7700, 0, 0, 0xD001, 0xD000, 0xC001}, 8, {}, {{0xD000, 0x77}}},
+    {"LD A, (HL-)", {0x3A}, {0, 0, 0, 0xD001, 0xD000, 0xC000}, {0x9900, 0, 0, 0xD000, 0xD000, 0xC001}, 8, {{0xD001, 0x99}}, {}},
+    {"LD (HL), d8", {0x36, 0x42}, {0, 0, 0, 0xD000, 0xD000, 0xC000}, {0, 0, 0, 0xD000, 0xD000, 0xC002}, 12, {}, {{0xD000, 0x42}}},
+    {"LD D, (HL)", {0x56}, {0, 0, 0, 0xD000, 0xD000, 0xC000}, {0, 0, 0xAB00, 0xD000, 0xD000, 0xC001}, 8, {{0xD000, 0xAB}}, {}},
+    {"LD B, C", {0x41}, {0, 0x0012, 0, 0, 0xD000, 0xC000}, {0, 0x1212, 0, 0, 0xD000, 0xC001}, 4, {}, {}},
+    {"LDH (a8), A", {0xE0, 0x80}, {0x4200, 0, 0, 0, 0xD000, 0xC000}, {0x4200, 0, 0, 0, 0xD000, 0xC002}, 12, {}, {{0xFF80, 0x42}}},
+    {"LDH A, (C)", {0xF2}, {0, 0x0081, 0, 0, 0xD000, 0xC000}, {0x2400, 0x0081, 0, 0, 0xD000, 0xC001}, 8, {{0xFF81, 0x24}}, {}},
+    {"LD (a16), A", {0xEA, 0x00, 0xD0}, {0x3300, 0, 0, 0, 0xD000, 0xC000}, {0x3300, 0, 0, 0, 0xD000, 0xC003}, 16, {}, {{0xD000, 0x33}}},
+    {"LD A, (a16)", {0xFA, 0x00, 0xD0}, {0, 0, 0, 0, 0xD000, 0xC000}, {0x4400, 0, 0, 0, 0xD000, 0xC003}, 16, {{0xD000, 0x44}}, {}},
+    {"LD SP, HL", {0xF9}, {0, 0, 0, 0x1234, 0xD000, 0xC000}, {0, 0, 0, 0x1234, 0x1234, 0xC001}, 8, {}, {}},
+
+    // 8-bit arithmetic and logic
+    {"INC B overflow", {0x04}, {0x0010, 0xFF00, 0, 0, 0xD000, 0xC000}, {0x00B0, 0x0000, 0, 0, 0xD000, 0xC001}, 4, {}, {}},
+    {"INC A half carry", {0x3C}, {0x0F00, 0, 0, 0, 0xD000, 0xC000}, {0x1020, 0, 0, 0, 0xD000, 0xC001}, 4, {}, {}},
+    {"DEC B half borrow", {0x05}, {0x0000, 0x1000, 0, 0, 0xD000, 0xC000}, {0x0060, 0x0F00, 0, 0, 0xD000, 0xC001}, 4, {}, {}},
+    {"DEC B zero", {0x05}, {0x0000, 0x0100, 0, 0, 0xD000, 0xC000}, {0x00C0, 0x0000, 0, 0, 0xD000, 0xC001}, 4, {}, {}},
+    {"INC (HL)", {0x34}, {0, 0, 0, 0xD000, 0xD000, 0xC000}, {0x0020, 0, 0, 0xD000, 0xD000, 0xC001}, 12, {{0xD000, 0x0F}}, {{0xD000, 0x10}}},
+    {"DEC (HL)", {0x35}, {0, 0, 0, 0xD000, 0xD000, 0xC000}, {0x0060, 0, 0, 0xD000, 0xD000, 0xC001}, 12, {{0xD000, 0x00}}, {{0xD000, 0xFF}}},
+    {"ADD A, B", {0x80}, {0x3A00, 0xC600, 0, 0, 0xD000, 0xC000}, {0x00B0, 0xC600, 0, 0, 0xD000, 0xC001}, 4, {}, {}},
+    {"ADC A, C", {0x89}, {0xE110, 0x000F, 0, 0, 0xD000, 0xC000}, {0xF120, 0x000F, 0, 0, 0xD000, 0xC001}, 4, {}, {}},
+    {"SUB D", {0x92}, {0x3E00, 0, 0x3E00, 0, 0xD000, 0xC000}, {0x00C0, 0, 0x3E00, 0, 0xD000, 0xC001}, 4, {}, {}},
+    {"SBC A, E", {0x9B}, {0x3B10, 0, 0x002A, 0, 0xD000, 0xC000}, {0x1040, 0, 0x002A, 0, 0xD000, 0xC001}, 4, {}, {}},
+    {"SBC A, E borrow", {0x9B}, {0x3B10, 0, 0x004F, 0, 0xD000, 0xC000}, {0xEB70, 0, 0x004F, 0, 0xD000, 0xC001}, 4, {}, {}},
+    {"AND H", {0xA4}, {0x5A00, 0, 0, 0x3F00, 0xD000, 0xC000}, {0x1A20, 0, 0, 0x3F00, 0xD000, 0xC001}, 4, {}, {}},
+    {"XOR A", {0xAF}, {0x5A70, 0, 0, 0, 0xD000, 0xC000}, {0x0080, 0, 0, 0, 0xD000, 0xC001}, 4, {}, {}},
+    {"OR (HL)", {0xB6}, {0x5AF0, 0, 0, 0xD000, 0xD000, 0xC000}, {0x5F00, 0, 0, 0xD000, 0xD000, 0xC001}, 8, {{0xD000, 0x0F}}, {}},
+    {"CP B", {0xB8}, {0x3C00, 0x2F00, 0, 0, 0xD000, 0xC000}, {0x3C60, 0x2F00, 0, 0, 0xD000, 0xC001}, 4, {}, {}},
+    {"CP d8", {0xFE, 0x40}, {0x3C00, 0, 0, 0, 0xD000, 0xC000}, {0x3C50, 0, 0, 0, 0xD000, 0xC002}, 8, {}, {}},
+    {"ADD A, d8", {0xC6, 0xFF}, {0x0100, 0, 0, 0, 0xD000, 0xC000}, {0x00B0, 0, 0, 0, 0xD000, 0xC002}, 8, {}, {}},
+    {"ADC A, d8", {0xCE, 0x00}, {0xFF10, 0, 0, 0, 0xD000, 0xC000}, {0x00B0, 0, 0, 0, 0xD000, 0xC002}, 8, {}, {}},
+    {"SUB d8", {0xD6, 0x01}, {0x0000, 0, 0, 0, 0xD000, 0xC000}, {0xFF70, 0, 0, 0, 0xD000, 0xC002}, 8, {}, {}},
+    {"SBC A, d8", {0xDE, 0x00}, {0x0010, 0, 0, 0, 0xD000, 0xC000}, {0xFF70, 0, 0, 0, 0xD000, 0xC002}, 8, {}, {}},
+    {"AND d8", {0xE6, 0x00}, {0xFF00, 0, 0, 0, 0xD000, 0xC000}, {0x00A0, 0, 0, 0, 0xD000, 0xC002}, 8, {}, {}},
+    {"XOR d8", {0xEE, 0xFF}, {0x0F00, 0, 0, 0, 0xD000, 0xC000}, {0xF000, 0, 0, 0, 0xD000, 0xC002}, 8, {}, {}},
+    {"OR d8", {0xF6, 0x00}, {0x0000, 0, 0, 0, 0xD000, 0xC000}, {0x0080, 0, 0, 0, 0xD000, 0xC002}, 8, {}, {}},
+    {"DAA after ADD", {0x27}, {0x7D00, 0, 0, 0, 0xD000, 0xC000}, {0x8300, 0, 0, 0, 0xD000, 0xC001}, 4, {}, {}},
+    {"DAA after SUB", {0x27}, {0x0D60, 0, 0, 0, 0xD000, 0xC000}, {0x0740, 0, 0, 0, 0xD000, 0xC001}, 4, {}, {}},
+    {"DAA carry", {0x27}, {0x9A00, 0, 0, 0, 0xD000, 0xC000}, {0x0090, 0, 0, 0, 0xD000, 0xC001}, 4, {}, {}},
+    {"CPL", {0x2F}, {0x3500, 0, 0, 0, 0xD000, 0xC000}, {0xCA60, 0, 0, 0, 0xD000, 0xC001}, 4, {}, {}},
+    {"SCF", {0x37}, {0x00E0, 0, 0, 0, 0xD000, 0xC000}, {0x0090, 0, 0, 0, 0xD000, 0xC001}, 4, {}, {}},
+    {"CCF", {0x3F}, {0x0090, 0, 0, 0, 0xD000, 0xC000}, {0x0080, 0, 0, 0, 0xD000, 0xC001}, 4, {}, {}},
+
+    // Accumulator rotates always clear Z
+    {"RLCA", {0x07}, {0x8580, 0, 0, 0, 0xD000, 0xC000}, {0x0B10, 0, 0, 0, 0xD000, 0xC001}, 4, {}, {}},
+    {"RRCA", {0x0F}, {0x0100, 0, 0, 0, 0xD000, 0xC000}, {0x8010, 0, 0, 0, 0xD000, 0xC001}, 4, {}, {}},
+    {"RLA", {0x17}, {0x8000, 0, 0, 0, 0xD000, 0xC000}, {0x0010, 0, 0, 0, 0xD000, 0xC001}, 4, {}, {}},
+    {"RRA", {0x1F}, {0x0110, 0, 0, 0, 0xD000, 0xC000}, {0x8010, 0, 0, 0, 0xD000, 0xC001}, 4, {}, {}},
+
+    // 16-bit arithmetic
+    {"INC SP", {0x33}, {0x00F0, 0, 0, 0, 0xFFFF, 0xC000}, {0x00F0, 0, 0, 0, 0x0000, 0xC001}, 8, {}, {}},
+    {"DEC BC", {0x0B}, {0, 0x0000, 0, 0, 0xD000, 0xC000}, {0, 0xFFFF, 0, 0, 0xD000, 0xC001}, 8, {}, {}},
+    {"ADD HL, BC", {0x09}, {0x0080, 0x0001, 0, 0x0FFF, 0xD000, 0xC000}, {0x00A0, 0x0001, 0, 0x1000, 0xD000, 0xC001}, 8, {}, {}},
+    {"ADD HL, HL", {0x29}, {0, 0, 0, 0x8000, 0xD000, 0xC000}, {0x0010, 0, 0, 0x0000, 0xD000, 0xC001}, 8, {}, {}},
+    {"ADD SP, -1", {0xE8, 0xFF}, {0x00C0, 0, 0, 0, 0x0001, 0xC000}, {0x0030, 0, 0, 0, 0x0000, 0xC002}, 16, {}, {}},
+    {"ADD SP, 1", {0xE8, 0x01}, {0, 0, 0, 0, 0x000F, 0xC000}, {0x0020, 0, 0, 0, 0x0010, 0xC002}, 16, {}, {}},
+    {"LD HL, SP+2", {0xF8, 0x02}, {0x00F0, 0, 0, 0, 0xFFF8, 0xC000}, {0x0000, 0, 0, 0xFFFA, 0xFFF8, 0xC002}, 12, {}, {}},
+    {"LD HL, SP-1", {0xF8, 0xFF}, {0, 0, 0, 0, 0x00FF, 0xC000}, {0x0030, 0, 0, 0x00FE, 0x00FF, 0xC002}, 12, {}, {}},
+
+    // Stack; POP AF drops the low nibble of F
+    {"PUSH DE", {0xD5}, {0, 0, 0xABCD, 0, 0xD000, 0xC000}, {0, 0, 0xABCD, 0, 0xCFFE, 0xC001}, 16, {}, {{0xCFFF, 0xAB}, {0xCFFE, 0xCD}}},
+    {"POP BC", {0xC1}, {0, 0, 0, 0, 0xCFFE, 0xC000}, {0, 0x1234, 0, 0, 0xD000, 0xC001}, 12, {{0xCFFE, 0x34}, {0xCFFF, 0x12}}, {}},
+    {"POP AF", {0xF1}, {0, 0, 0, 0, 0xCFFE, 0xC000}, {0x12F0, 0, 0, 0, 0xD000, 0xC001}, 12, {{0xCFFE, 0xFF}, {0xCFFF, 0x12}}, {}},
+
+    // Jumps, calls and returns, taken and not
+    {"JR", {0x18, 0x05}, {0, 0, 0, 0, 0xD000, 0xC000}, {0, 0, 0, 0, 0xD000, 0xC007}, 12, {}, {}},
+    {"JR NZ taken", {0x20, 0xFE}, {0, 0, 0, 0, 0xD000, 0xC000}, {0, 0, 0, 0, 0xD000, 0xC000}, 12, {}, {}},
+    {"JR Z not taken", {0x28, 0x05}, {0, 0, 0, 0, 0xD000, 0xC000}, {0, 0, 0, 0, 0xD000, 0xC002}, 8, {}, {}},
+    {"JP a16", {0xC3, 0x00, 0x20}, {0, 0, 0, 0, 0xD000, 0xC000}, {0, 0, 0, 0, 0xD000, 0x2000}, 16, {}, {}},
+    {"JP NC not taken", {0xD2, 0x00, 0x20}, {0x0010, 0, 0, 0, 0xD000, 0xC000}, {0x0010, 0, 0, 0, 0xD000, 0xC003}, 12, {}, {}},
+    {"JP HL", {0xE9}, {0, 0, 0, 0x4321, 0xD000, 0xC000}, {0, 0, 0, 0x4321, 0xD000, 0x4321}, 4, {}, {}},
+    {"CALL a16", {0xCD, 0x00, 0x20}, {0, 0, 0, 0, 0xD000, 0xC000}, {0, 0, 0, 0, 0xCFFE, 0x2000}, 24, {}, {{0xCFFF, 0xC0}, {0xCFFE, 0x03}}},
+    {"CALL Z not taken", {0xCC, 0x00, 0x20}, {0, 0, 0, 0, 0xD000, 0xC000}, {0, 0, 0, 0, 0xD000, 0xC003}, 12, {}, {}},
+    {"RST 28h", {0xEF}, {0, 0, 0, 0, 0xD000, 0xC000}, {0, 0, 0, 0, 0xCFFE, 0x0028}, 16, {}, {{0xCFFF, 0xC0}, {0xCFFE, 0x01}}},
+    {"RET", {0xC9}, {0, 0, 0, 0, 0xCFFE, 0xC000}, {0, 0, 0, 0, 0xD000, 0x1234}, 16, {{0xCFFE, 0x34}, {0xCFFF, 0x12}}, {}},
+    {"RET NZ taken", {0xC0}, {0, 0, 0, 0, 0xCFFE, 0xC000}, {0, 0, 0, 0, 0xD000, 0x1234}, 20, {{0xCFFE, 0x34}, {0xCFFF, 0x12}}, {}},
+    {"RET Z not taken", {0xC8}, {0, 0, 0, 0, 0xCFFE, 0xC000}, {0, 0, 0, 0, 0xCFFE, 0xC001}, 8, {}, {}},
+
+    // CB prefix; BIT keeps C, the (HL) forms read and write back
+    {"RLC B", {0xCB, 0x00}, {0, 0x8500, 0, 0, 0xD000, 0xC000}, {0x0010, 0x0B00, 0, 0, 0xD000, 0xC002}, 8, {}, {}},
+    {"RRC (HL)", {0xCB, 0x0E}, {0, 0, 0, 0xD000, 0xD000, 0xC000}, {0x0010, 0, 0, 0xD000, 0xD000, 0xC002}, 16, {{0xD000, 0x01}}, {{0xD000, 0x80}}},
+    {"RL (HL)", {0xCB, 0x16}, {0, 0, 0, 0xD000, 0xD000, 0xC000}, {0x0090, 0, 0, 0xD000, 0xD000, 0xC002}, 16, {{0xD000, 0x80}}, {{0xD000, 0x00}}},
+    {"RR C", {0xCB, 0x19}, {0, 0x0001, 0, 0, 0xD000, 0xC000}, {0x0090, 0x0000, 0, 0, 0xD000, 0xC002}, 8, {}, {}},
+    {"SLA C", {0xCB, 0x21}, {0, 0x0080, 0, 0, 0xD000, 0xC000}, {0x0090, 0x0000, 0, 0, 0xD000, 0xC002}, 8, {}, {}},
+    {"SRA D", {0xCB, 0x2A}, {0, 0, 0x8100, 0, 0xD000, 0xC000}, {0x0010, 0, 0xC000, 0, 0xD000, 0xC002}, 8, {}, {}},
+    {"SWAP E", {0xCB, 0x33}, {0x00F0, 0, 0x00F0, 0, 0xD000, 0xC000}, {0x0000, 0, 0x000F, 0, 0xD000, 0xC002}, 8, {}, {}},
+    {"SRL A", {0xCB, 0x3F}, {0x0100, 0, 0, 0, 0xD000, 0xC000}, {0x0090, 0, 0, 0, 0xD000, 0xC002}, 8, {}, {}},
+    {"BIT 7, H", {0xCB, 0x7C}, {0x0010, 0, 0, 0x7F00, 0xD000, 0xC000}, {0x00B0, 0, 0, 0x7F00, 0xD000, 0xC002}, 8, {}, {}},
+    {"BIT 0, (HL)", {0xCB, 0x46}, {0x0040, 0, 0, 0xD000, 0xD000, 0xC000}, {0x0020, 0, 0, 0xD000, 0xD000, 0xC002}, 12, {{0xD000, 0x01}}, {}},
+    {"RES 3, (HL)", {0xCB, 0x9E}, {0, 0, 0, 0xD000, 0xD000, 0xC000}, {0, 0, 0, 0xD000, 0xD000, 0xC002}, 16, {{0xD000, 0xFF}}, {{0xD000, 0xF7}}},
+    {"SET 7, A", {0xCB, 0xFF}, {0, 0, 0, 0, 0xD000, 0xC000}, {0x8000, 0, 0, 0, 0xD000, 0xC002}, 8, {}, {}},
+};
+
+static void Check(const Case &test)
+{
+    std::unique_ptr<FlatBus> bus(new FlatBus());
+    std::unique_ptr<MachineState> state(new MachineState());
+    InterruptController interrupts(state.get());
+    CPU<FlatBus> cpu(bus.get(), state.get(), &interrupts);
+    cpu.bulkLoops = false;
+
+    std::copy(test.code.begin(), test.code.end(), bus->data + test.in.pc);
+    for (auto &byte : test.memoryIn)
+        bus->data[byte.first] = byte.second;
+    Registers &registers = *cpu.registers;
+    registers.af = test.in.af;
+    registers.bc = test.in.bc;
+    registers.de = test.in.de;
+    registers.hl = test.in.hl;
+    registers.sp = test.in.sp;
+    registers.pc = test.in.pc;
+
+    int cycles = cpu.Step();
+    RegisterSet out = {registers.af, registers.bc, registers.de, registers.hl, registers.sp, registers.pc};
+    bool passed = out.af == test.out.af && out.bc == test.out.bc && out.de == test.out.de &&
+                  out.hl == test.out.hl && out.sp == test.out.sp && out.pc == test.out.pc &&
+                  cycles == test.cycles && bus->mCycles * 4 == static_cast<uint64_t>(test.cycles);
+    for (auto &byte : test.memoryOut)
+        passed = passed && bus->data[byte.first] == byte.second;
+
+    if (!passed)
+        std::cout << test.name << std::hex << ": AF " << out.af << " BC " << out.bc << " DE " << out.de
+                  << " HL " << out.hl << " SP " << out.sp << " PC " << out.pc << std::dec << ", "
+                  << cycles << " cycles, " << bus->mCycles << " M-cycles" << std::endl;
+    CHECK(passed);
+}
+
+int main()
+{
+    for (const Case &test : CASES)
+        Check(test);
+    return TestResult();
+}
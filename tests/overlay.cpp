@@ -0,0 +1,67 @@
+#include "test.h"
+#include "cartridge.h"
+#include "machine.h"
+#include <cstring>
+
+// The perf overlay is drawn over the published picture, so once it is
+// switched off on a screen that doesn't change, the next frame must be drawn
+// and published in full rather than made of lines from under the overlay
+static const int FRAMES = 10;
+
+// Striped tiles over the whole map, then nothing changes
+static TestRom StaticRom()
+{
+    TestRom rom;
+    for (int i = 0; i < 16; i++)
+        rom.data[0x1000 + i] = (i & 2) ? 0xF0 : 0x0F;
+    rom.Place(0x0150, {
+                          0xAF, 0xE0, 0x40,                   // LCD off
+                          0x21, 0x00, 0x10, 0x11, 0x10, 0x80, // tile 1
+                          0x06, 0x10,
+                          0x2A, 0x12, 0x13, 0x05, 0x20, 0xFA, // LD A, (HL+); LD (DE), A; INC DE; DEC B; JR NZ
+                          0x21, 0x00, 0x98, 0x01, 0x00, 0x04, // map of tile 1
+                          0x3E, 0x01, 0x22, 0x0B, 0x78, 0xB1, // LD A, 1; LD (HL+), A; DEC BC; LD A, B; OR C
+                          0x20, 0xF8,                         // JR NZ
+                          0x3E, 0xE4, 0xE0, 0x47,             // BGP
+                          0x3E, 0x91, 0xE0, 0x40,             // LCD and BG on
+                          0x18, 0xFE,                         // JR to itself
+                      });
+    return rom;
+}
+
+// The picture shown after the given frames, the overlay on for the first
+// overlayFrames of them
+static std::vector<uint32_t> LastShown(const std::string &path, CoreType core, int overlayFrames, int count)
+{
+    Cartridge cartridge(path);
+    TripleBuffer frames;
+    Machine *machine = Machine::Create(core, &cartridge, &frames);
+
+    std::vector<uint32_t> shown(TripleBuffer::WIDTH * TripleBuffer::HEIGHT);
+    for (int frame = 0; frame < count; frame++)
+    {
+        machine->ppu->showPerfOverlay = frame < overlayFrames;
+        machine->RunUntilVBlank();
+        if (const uint32_t *published = frames.AcquireLatest())
+            std::memcpy(shown.data(), published, shown.size() * sizeof(uint32_t));
+    }
+
+    delete machine;
+    return shown;
+}
+
+int main()
+{
+    std::string path = StaticRom().Save("overlay");
+    for (CoreType core : {CoreType::FAST, CoreType::ACCURATE})
+    {
+        std::vector<uint32_t> plain = LastShown(path, core, 0, 2 * FRAMES);
+        std::vector<uint32_t> withOverlay = LastShown(path, core, FRAMES, FRAMES);
+        std::vector<uint32_t> afterOverlay = LastShown(path, core, FRAMES, 2 * FRAMES);
+
+        // The overlay really was on screen, and left nothing behind
+        CHECK(withOverlay != plain);
+        CHECK(afterOverlay == plain);
+    }
+    return TestResult();
+}
@@ -0,0 +1,156 @@
+#include "test.h"
+#include "cartridge.h"
+#include "machine.h"
+#include <cstring>
+
+// The accurate profile draws with a pixel FIFO: the picture matches the
+// scanline renderer when nothing changes mid-line, a palette write during
+// mode 3 splits the line, and mode 3 lasts as long as the FIFO takes
+static const int WIDTH = TripleBuffer::WIDTH;
+static const uint32_t BLACK = 0xFF000000;
+static const uint32_t WHITE = 0xFFFFFFFF;
+
+// The scene copies its tables with the LCD off, and the frame it is turned
+// on in starts at a different point on each core
+static const int WARMUP = 8;
+
+// A black screen; on line 72 BGP goes white as soon as mode 3 is seen,
+// and back to black on line 100
+static TestRom MidLineRom()
+{
+    TestRom rom;
+    for (int i = 0; i < 16; i++)
+        rom.data[0x1010 + i] = 0xFF;
+    for (int i = 0; i < 0x400; i++)
+        rom.data[0x2000 + i] = 0x01;
+
+    rom.Place(0x0150, {
+                          0xAF, 0xE0, 0x40,                   // LCD off
+                          0x21, 0x00, 0x10, 0x11, 0x00, 0x80, // tiles 0 and 1
+                          0x01, 0x20, 0x00, 0xCD, 0x00, 0x03,
+                          0x21, 0x00, 0x20, 0x11, 0x00, 0x98, // map of tile 1
+                          0x01, 0x00, 0x04, 0xCD, 0x00, 0x03,
+                          0x3E, 0xE4, 0xE0, 0x47,             // BGP
+                          0x3E, 0x91, 0xE0, 0x40,             // LCD and BG on
+                          0xF0, 0x44, 0xFE, 0x48, 0x20, 0xFA, // wait for LY 72
+                          0xF0, 0x41, 0xE6, 0x03,             // wait for mode 3
+                          0xFE, 0x03, 0x20, 0xF8,
+                          0xAF, 0xE0, 0x47,                   // BGP white
+                          0xF0, 0x44, 0xFE, 0x64, 0x20, 0xFA, // wait for LY 100
+                          0x3E, 0xE4, 0xE0, 0x47,             // BGP black
+                          0x18, 0xE3,                         // JR back to LY 72
+                      });
+    rom.Place(0x0300, {
+                          0x2A, 0x12, 0x13, 0x0B, // LD A, (HL+); LD (DE), A; INC DE; DEC BC
+                          0x78, 0xB1, 0x20, 0xF8, // LD A, B; OR C; JR NZ, 0300h
+                          0xC9,                   // RET
+                      });
+    return rom;
+}
+
+// The picture after each VBlank, the last published one when nothing new was
+static std::vector<uint32_t> RunFrames(const std::string &path, CoreType core, int count)
+{
+    Cartridge cartridge(path);
+    TripleBuffer frames;
+    Machine *machine = Machine::Create(core, &cartridge, &frames);
+
+    std::vector<uint32_t> shown(WIDTH * TripleBuffer::HEIGHT);
+    std::vector<uint32_t> history;
+    for (int frame = 0; frame < count; frame++)
+    {
+        machine->RunUntilVBlank();
+        if (const uint32_t *published = frames.AcquireLatest())
+            std::memcpy(shown.data(), published, shown.size() * sizeof(uint32_t));
+        history.insert(history.end(), shown.begin(), shown.end());
+    }
+
+    delete machine;
+    return history;
+}
+
+// Mode 3 length of every visible line of one frame
+static std::vector<int> DrawingCycles(Machine *machine)
+{
+    MachineState *state = machine->state;
+    machine->RunUntilVBlank();
+
+    std::vector<int> cycles(144, 0);
+    while (state->ppuMode != 2)
+        machine->Step();
+    for (int line = 0; line < 144; line++)
+    {
+        while (state->ppuMode != 0)
+            machine->Step();
+        cycles[line] = state->ppuDrawingCycles;
+        while (state->ppuMode == 0)
+            machine->Step();
+    }
+    return cycles;
+}
+
+static void CheckScene(bool cgb)
+{
+    std::string path = SceneRom(cgb).Save(cgb ? "pixelfifo-cgb" : "pixelfifo-dmg");
+
+    // Scroll, sprites and the window only change between lines
+    size_t skipped = WARMUP * WIDTH * TripleBuffer::HEIGHT;
+    std::vector<uint32_t> scanline = RunFrames(path, CoreType::FAST, 30);
+    std::vector<uint32_t> fifo = RunFrames(path, CoreType::ACCURATE, 30);
+    CHECK(std::equal(scanline.begin() + skipped, scanline.end(), fifo.begin() + skipped));
+
+    // Fine scroll, every sprite and the window hold the fetcher up
+    Cartridge cartridge(path);
+    Machine *machine = Machine::Create(CoreType::ACCURATE, &cartridge, nullptr);
+    for (int i = 0; i < WARMUP; i++)
+        machine->RunUntilVBlank();
+    std::vector<int> cycles = DrawingCycles(machine);
+    const uint8_t *io = machine->state->io;
+    for (int line = 0; line < 144; line++)
+    {
+        int count;
+        machine->ppu->sprites->Line(line, count);
+        bool window = line >= io[0x4A];
+        int least = PPUBase::DRAWING_CYCLES + (io[0x43] & 7);
+        if (!count && !window)
+            CHECK(cycles[line] == least);
+        else
+            CHECK(cycles[line] >= least + 6 * count + (window ? 6 : 0));
+    }
+    delete machine;
+}
+
+static void CheckMidLineWrite()
+{
+    std::string path = MidLineRom().Save("pixelfifo-midline");
+    const int FRAMES = 4;
+    size_t frameSize = WIDTH * TripleBuffer::HEIGHT;
+
+    std::vector<uint32_t> fifo = RunFrames(path, CoreType::ACCURATE, FRAMES);
+    const uint32_t *frame = fifo.data() + (FRAMES - 1) * frameSize;
+    CHECK(frame[71 * WIDTH] == BLACK && frame[71 * WIDTH + 159] == BLACK);
+    CHECK(frame[72 * WIDTH] == BLACK);
+    CHECK(frame[72 * WIDTH + 159] == WHITE);
+    CHECK(frame[73 * WIDTH] == WHITE && frame[99 * WIDTH + 159] == WHITE);
+
+    // The scanline renderer sees BGP as it is when the line ends
+    std::vector<uint32_t> scanline = RunFrames(path, CoreType::FAST, FRAMES);
+    frame = scanline.data() + (FRAMES - 1) * frameSize;
+    CHECK(frame[72 * WIDTH] == WHITE && frame[72 * WIDTH + 159] == WHITE);
+
+    // A palette write doesn't move the end of mode 3
+    Cartridge cartridge(path);
+    Machine *machine = Machine::Create(CoreType::ACCURATE, &cartridge, nullptr);
+    std::vector<int> cycles = DrawingCycles(machine);
+    for (int line = 0; line < 144; line++)
+        CHECK(cycles[line] == PPUBase::DRAWING_CYCLES);
+    delete machine;
+}
+
+int main()
+{
+    CheckScene(false);
+    CheckScene(true);
+    CheckMidLineWrite();
+    return TestResult();
+}
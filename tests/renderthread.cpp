@@ -0,0 +1,54 @@
+#include "test.h"
+#include "cartridge.h"
+#include "machine.h"
+#include <cstring>
+
+// The render worker must produce the same frames as drawing inline. Build
+// with SIGMABOY_TSAN to have ThreadSanitizer watch the hand-over as well.
+static const int FRAMES = 120;
+
+// Every frame as the frontend would see it, the last one again when nothing new was published
+static std::vector<uint32_t> RunScene(const std::string &path, CoreType core, bool threaded)
+{
+    Cartridge cartridge(path);
+    TripleBuffer frames;
+    Machine *machine = Machine::Create(core, &cartridge, &frames);
+    if (threaded)
+        machine->ppu->renderer.StartThread();
+    CHECK(machine->ppu->renderer.IsThreaded() == threaded);
+
+    std::vector<uint32_t> shown(TripleBuffer::WIDTH * TripleBuffer::HEIGHT);
+    std::vector<uint32_t> history;
+    for (int frame = 0; frame < FRAMES; frame++)
+    {
+        machine->Run(machine->state->cycles + 70224);
+
+        machine->ppu->renderer.Finish();
+        if (const uint32_t *published = frames.AcquireLatest())
+            std::memcpy(shown.data(), published, shown.size() * sizeof(uint32_t));
+        history.insert(history.end(), shown.begin(), shown.end());
+    }
+
+    delete machine;
+    return history;
+}
+
+int main()
+{
+    for (bool cgb : {false, true})
+    {
+        std::string path = SceneRom(cgb).Save(cgb ? "renderthread-cgb" : "renderthread-dmg");
+        for (CoreType core : {CoreType::FAST, CoreType::ACCURATE})
+        {
+            std::vector<uint32_t> drawnInline = RunScene(path, core, false);
+            std::vector<uint32_t> drawnThreaded = RunScene(path, core, true);
+            CHECK(drawnInline == drawnThreaded);
+
+            // The scene actually moves, so this compares more than one picture
+            size_t frameSize = TripleBuffer::WIDTH * TripleBuffer::HEIGHT;
+            CHECK(!std::equal(drawnInline.end() - frameSize, drawnInline.end(), drawnInline.end() - 2 * frameSize));
+        }
+    }
+
+    return TestResult();
+}
@@ -0,0 +1,69 @@
+#include "test.h"
+#include "cartridge.h"
+#include "machine.h"
+
+// Run-ahead rolls the machine back every frame. Line memoisation has to
+// survive the rollback when VRAM is unchanged, and must not when it isn't.
+static void RunFrame(Machine *machine, bool draw)
+{
+    machine->ppu->drawFrame = draw;
+    machine->RunUntilVBlank();
+    machine->ppu->drawFrame = true;
+}
+
+// Frames published over 30 frames of running 2 frames ahead
+static int PublishedFrames(const std::string &rom)
+{
+    Cartridge cartridge(rom);
+    TripleBuffer frames;
+    Machine *machine = Machine::Create(CoreType::FAST, &cartridge, &frames);
+    Machine *saved = machine->Fork();
+
+    int published = 0;
+    for (int frame = 0; frame < 30; frame++)
+    {
+        RunFrame(machine, false);
+        saved->CopyFrom(*machine);
+        RunFrame(machine, true);
+        machine->CopyFrom(*saved);
+        if (frames.AcquireLatest())
+            published++;
+    }
+
+    delete saved;
+    delete machine;
+    return published;
+}
+
+int main()
+{
+    // LCD on, then spin with the picture untouched
+    TestRom still;
+    still.Place(0x0150, {
+                            0x3E, 0x91,       // LD A, 91h
+                            0xE0, 0x40,       // LDH (40h), A
+                            0x18, 0xFE,       // JR 0154h
+                        });
+    CHECK(PublishedFrames(still.Save("runahead-still")) <= 2);
+
+    // The VBlank handler writes a new tile number into the map every frame
+    TestRom moving = still;
+    moving.Place(0x0040, {
+                             0xF0, 0x80,       // LDH A, (80h)
+                             0x3C,             // INC A
+                             0xE0, 0x80,       // LDH (80h), A
+                             0xEA, 0x00, 0x98, // LD (9800h), A
+                             0xD9,             // RETI
+                         });
+    moving.Place(0x0150, {
+                             0x3E, 0x01,       // LD A, 01h
+                             0xE0, 0xFF,       // LDH (FFh), A
+                             0x3E, 0x91,       // LD A, 91h
+                             0xE0, 0x40,       // LDH (40h), A
+                             0xFB,             // EI
+                             0x18, 0xFE,       // JR 0159h
+                         });
+    CHECK(PublishedFrames(moving.Save("runahead-moving")) >= 29);
+
+    return TestResult();
+}
@@ -0,0 +1,66 @@
+#include "test.h"
+#include "cartridge.h"
+#include "machine.h"
+
+// PUSH/POP and CALL/RST/RET must store and load at the same addresses
+static void CheckStack(CoreType core, const std::string &rom)
+{
+    Cartridge cartridge(rom);
+    TripleBuffer frames;
+    Machine *machine = Machine::Create(core, &cartridge, &frames);
+    Registers &registers = machine->state->registers;
+    MMUBase &memory = *machine->memory;
+    registers.pc = 0x0150;
+
+    machine->Step(); // LD BC, 1234h
+    machine->Step(); // PUSH BC
+    CHECK(registers.sp == 0xFFFC);
+    CHECK(memory.Load(0xFFFD) == 0x12);
+    CHECK(memory.Load(0xFFFC) == 0x34);
+
+    machine->Step(); // POP DE
+    CHECK(registers.de == 0x1234);
+    CHECK(registers.sp == 0xFFFE);
+
+    machine->Step(); // CALL 0200h
+    CHECK(registers.pc == 0x0200);
+    CHECK(registers.sp == 0xFFFC);
+    CHECK(memory.Load(0xFFFD) == 0x01);
+    CHECK(memory.Load(0xFFFC) == 0x58);
+
+    machine->Step(); // RET
+    CHECK(registers.pc == 0x0158);
+    CHECK(registers.sp == 0xFFFE);
+
+    machine->Step(); // RST 38H
+    CHECK(registers.pc == 0x0038);
+    CHECK(registers.sp == 0xFFFC);
+    CHECK(memory.Load(0xFFFD) == 0x01);
+    CHECK(memory.Load(0xFFFC) == 0x59);
+
+    machine->Step(); // RET
+    CHECK(registers.pc == 0x0159);
+    CHECK(registers.sp == 0xFFFE);
+
+    delete machine;
+}
+
+int main()
+{
+    TestRom rom;
+    rom.Place(0x0150, {
+                          0x01, 0x34, 0x12, // LD BC, 1234h
+                          0xC5,             // PUSH BC
+                          0xD1,             // POP DE
+                          0xCD, 0x00, 0x02, // CALL 0200h
+                          0xFF,             // RST 38H
+                          0x00,             // NOP
+                      });
+    rom.Place(0x0200, {0xC9}); // RET
+    rom.Place(0x0038, {0xC9}); // RET
+    std::string path = rom.Save("stack");
+
+    CheckStack(CoreType::FAST, path);
+    CheckStack(CoreType::ACCURATE, path);
+    return TestResult();
+}
@@ -0,0 +1,141 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <initializer_list>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+// Minimal harness for the tests/ executables: CHECK reports and counts, main returns TestResult()
+inline int &TestFailures()
+{
+    static int failures = 0;
+    return failures;
+}
+
+#define CHECK(condition)                                                                          \
+    do                                                                                            \
+    {                                                                                             \
+        if (!(condition))                                                                         \
+        {                                                                                         \
+            std::cout << __FILE__ << ":" << __LINE__ << ": CHECK failed: " #condition << std::endl; \
+            TestFailures()++;                                                                     \
+        }                                                                                         \
+    } while (0)
+
+inline int TestResult()
+{
+    if (TestFailures())
+        std::cout << TestFailures() << " check(s) failed" << std::endl;
+    return TestFailures() ? 1 : 0;
+}
+
+// 32 KB ROM-only cartridge image whose entry point jumps to code placed at 0x0150
+class TestRom
+{
+public:
+    TestRom() : data(0x8000, 0x00)
+    {
+        static const uint8_t logo[] = {
+            0xCE, 0xED, 0x66, 0x66, 0xCC, 0x0D, 0x00, 0x0B,
+            0x03, 0x73, 0x00, 0x83, 0x00, 0x0C, 0x00, 0x0D,
+            0x00, 0x08, 0x11, 0x1F, 0x88, 0x89, 0x00, 0x0E,
+            0xDC, 0xCC, 0x6E, 0xE6, 0xDD, 0xDD, 0xD9, 0x99,
+            0xBB, 0xBB, 0x67, 0x63, 0x6E, 0x0E, 0xEC, 0xCC,
+            0xDD, 0xDC, 0x99, 0x9F, 0xBB, 0xB9, 0x33, 0x3E};
+        std::copy(std::begin(logo), std::end(logo), data.begin() + 0x104);
+        std::string title = "TEST";
+        std::copy(title.begin(), title.end(), data.begin() + 0x134);
+        Place(0x0100, {0x00, 0xC3, 0x50, 0x01}); // NOP; JP 0150h
+    }
+
+    void Place(uint16_t address, std::initializer_list<uint8_t> bytes)
+    {
+        std::copy(bytes.begin(), bytes.end(), data.begin() + address);
+    }
+
+    // Cartridge loads from disk, so the image goes next to the test binary
+    std::string Save(const std::string &name) const
+    {
+        std::string path = name + ".gb";
+        std::ofstream file(path, std::ios::binary);
+        file.write(reinterpret_cast<const char *>(data.data()), data.size());
+        return path;
+    }
+
+    std::vector<uint8_t> data;
+};
+
+// Tiles, both maps, CGB attributes, palettes and sprites from ROM tables,
+// then SCX/sprite 0 moving every VBlank and SCY changing every HBlank
+inline TestRom SceneRom(bool cgb)
+{
+    TestRom rom;
+    rom.data[0x143] = cgb ? 0x80 : 0x00;
+    for (int i = 0; i < 0x800; i++)
+    {
+        rom.data[0x1000 + i] = i * 37;
+        rom.data[0x2000 + i] = i * 13;
+        rom.data[0x2800 + i] = i * 11;
+    }
+    for (int i = 0; i < 40; i++)
+    {
+        rom.data[0x3000 + i * 4] = 16 + i * 3 % 144;
+        rom.data[0x3001 + i * 4] = 8 + i * 7 % 160;
+        rom.data[0x3002 + i * 4] = i;
+        rom.data[0x3003 + i * 4] = i * 0x1B;
+    }
+    for (int i = 0; i < 128; i++)
+        rom.data[0x3100 + i] = i * 29;
+
+    rom.Place(0x0040, {0xC3, 0x00, 0x04}); // JP 0400h
+    rom.Place(0x0048, {0xC3, 0x40, 0x04}); // JP 0440h
+    rom.Place(0x0150, {
+                          0xAF, 0xE0, 0x40,                   // LCD off
+                          0x21, 0x00, 0x10, 0x11, 0x00, 0x80, // tiles
+                          0x01, 0x00, 0x08, 0xCD, 0x00, 0x03,
+                          0x21, 0x00, 0x20, 0x11, 0x00, 0x98, // maps
+                          0x01, 0x00, 0x08, 0xCD, 0x00, 0x03,
+                          0x21, 0x00, 0x30, 0x11, 0x00, 0xFE, // OAM
+                          0x01, 0xA0, 0x00, 0xCD, 0x00, 0x03,
+                          0x3E, 0x01, 0xE0, 0x4F,             // VBK 1, attributes
+                          0x21, 0x00, 0x28, 0x11, 0x00, 0x98,
+                          0x01, 0x00, 0x08, 0xCD, 0x00, 0x03,
+                          0xAF, 0xE0, 0x4F,
+                          0x3E, 0x80, 0xE0, 0x68,             // BG palettes
+                          0x21, 0x00, 0x31, 0x06, 0x40,
+                          0x2A, 0xE0, 0x69, 0x05, 0x20, 0xFA,
+                          0x3E, 0x80, 0xE0, 0x6A,             // OBJ palettes
+                          0x06, 0x40,
+                          0x2A, 0xE0, 0x6B, 0x05, 0x20, 0xFA,
+                          0x3E, 0x40, 0xE0, 0x4A,             // WY
+                          0x3E, 0x57, 0xE0, 0x4B,             // WX
+                          0x3E, 0xE4, 0xE0, 0x47,             // BGP
+                          0x3E, 0xD2, 0xE0, 0x48,             // OBP0
+                          0x3E, 0x1B, 0xE0, 0x49,             // OBP1
+                          0x3E, 0x08, 0xE0, 0x41,             // STAT on HBlank
+                          0x3E, 0x03, 0xE0, 0xFF,             // IE VBlank and STAT
+                          0x3E, 0xF3, 0xE0, 0x40,             // LCD, window, sprites, BG
+                          0xFB,                               // EI
+                          0x76, 0x18, 0xFD,                   // HALT; JR -3
+                      });
+    rom.Place(0x0300, {
+                          0x2A, 0x12, 0x13, 0x0B, // LD A, (HL+); LD (DE), A; INC DE; DEC BC
+                          0x78, 0xB1, 0x20, 0xF8, // LD A, B; OR C; JR NZ, 0300h
+                          0xC9,                   // RET
+                      });
+    rom.Place(0x0400, {
+                          0xF5,                   // PUSH AF
+                          0xF0, 0x43, 0x3C, 0xE0, 0x43, // SCX++
+                          0xFA, 0x01, 0xFE, 0x3C, 0xEA, 0x01, 0xFE, // sprite 0 X++
+                          0xF1, 0xD9,             // POP AF; RETI
+                      });
+    rom.Place(0x0440, {
+                          0xF5,                   // PUSH AF
+                          0xF0, 0x44, 0xE6, 0x07, 0xE0, 0x42, // SCY = LY & 7
+                          0xF1, 0xD9,             // POP AF; RETI
+                      });
+    return rom;
+}